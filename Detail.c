@@ -857,8 +857,11 @@ int Detail_Platform(struct superswitch *ss, int scan, int verbose, int export, c
 			pr_err("specify a metadata type or --scan\n");
 	}
 
-	if (!scan)
+	if (!scan) {
+		if (!export && ss && ss->detail_platform)
+			print_parity_algorithms();
 		return err;
+	}
 
 	err = 0;
 	for (i = 0; superlist[i]; i++) {
@@ -879,5 +882,8 @@ int Detail_Platform(struct superswitch *ss, int scan, int verbose, int export, c
 			err |= meta->detail_platform(verbose, 0, controller_path);
 	}
 
+	if (!export)
+		print_parity_algorithms();
+
 	return err;
 }
@@ -24,11 +24,13 @@
 #include	"mdadm.h"
 #include	"dlink.h"
 #include	"xmalloc.h"
+#include	"reshape_policy.h"
 
 #include	<sys/mman.h>
 #include	<stddef.h>
 #include	<stdint.h>
 #include	<sys/wait.h>
+#include	<pthread.h>
 
 #if ! defined(__BIG_ENDIAN) && ! defined(__LITTLE_ENDIAN)
 #error no endian defined
@@ -674,9 +676,24 @@ static struct mdp_backup_super {
 	__u64	arraystart2;
 	__u64	length2;
 	__u32	sb_csum2;	/* csum of preceeding bytes. */
-	__u8 pad[512-68-32];
+	__u32	crc_unit;	/* bytes per entry of the crc index, 0 if none */
+	__u32	crc_csum;	/* crc32c of the crc index */
+	__u32	sb_csum3;	/* crc32c of preceeding bytes. */
+	__u8 pad[512-68-32-12];
 } __attribute__((aligned(512))) bsb, bsb2;
 
+/* The rest of the 4K in front of the backup data holds a crc32c of each
+ * 'crc_unit' bytes of each part, so that a backup can be checked
+ * before it is restored without reading the array.  Backups written
+ * before this have crc_unit zero.
+ */
+#define BACKUP_CRC_ENTRIES ((4096 - 512) / sizeof(__u32) / 2)
+static struct mdp_backup_crc {
+	__u32	crc[2][BACKUP_CRC_ENTRIES];
+} bsb_crc;
+
+__u32 crc32c_le(__u32 crc, unsigned char const *p, size_t len);
+
 static __u32 bsb_csum(char *buf, int len)
 {
 	int i;
@@ -686,6 +703,131 @@ static __u32 bsb_csum(char *buf, int len)
 	return __cpu_to_le32(csum);
 }
 
+static __u32 bsb_csum3(struct mdp_backup_super *sb)
+{
+	return __cpu_to_le32(~crc32c_le(~0, (unsigned char *)sb,
+			offsetof(struct mdp_backup_super, sb_csum3)));
+}
+
+/* crc_unit for parts of up to 'len' bytes: whole chunks, and few
+ * enough of them to fit in the index.
+ */
+static unsigned int backup_crc_unit(unsigned long long len, int chunk)
+{
+	unsigned long long chunks = (len + chunk - 1) / chunk;
+
+	return chunk * ((chunks + BACKUP_CRC_ENTRIES - 1) / BACKUP_CRC_ENTRIES);
+}
+
+/* crc32c of each 'unit' bytes of the 'len' bytes in 'buf' */
+static void backup_crc_buf(__u32 *crc, unsigned int unit,
+			   char *buf, unsigned long long len)
+{
+	unsigned long long i;
+
+	for (i = 0; i * unit < len; i++) {
+		unsigned long long n = len - i * unit;
+
+		if (n > unit)
+			n = unit;
+		crc[i] = __cpu_to_le32(~crc32c_le(~0,
+				(unsigned char *)buf + i * unit, n));
+	}
+}
+
+/* As backup_crc_buf(), for the data at 'offset' in 'fd', read through
+ * 'buf' at most 'bufsize' bytes at a time.
+ */
+static int backup_crc_read(__u32 *crc, unsigned int unit, int fd,
+			   unsigned long long offset, unsigned long long len,
+			   char *buf, unsigned long long bufsize)
+{
+	unsigned long long i;
+
+	for (i = 0; i * unit < len; i++) {
+		unsigned long long left = len - i * unit;
+		__u32 c = ~0;
+
+		if (left > unit)
+			left = unit;
+		while (left) {
+			unsigned long long n = left < bufsize ? left : bufsize;
+
+			if (pread(fd, buf, n, offset) != (ssize_t)n)
+				return -1;
+			c = crc32c_le(c, (unsigned char *)buf, n);
+			offset += n;
+			left -= n;
+		}
+		crc[i] = __cpu_to_le32(~c);
+	}
+	return 0;
+}
+
+/* Is the crc index 'idx' that 'sb' describes intact, and does it
+ * cover both parts?
+ */
+static int backup_crc_index_ok(struct mdp_backup_super *sb,
+			       struct mdp_backup_crc *idx)
+{
+	unsigned long long unit = __le32_to_cpu(sb->crc_unit);
+
+	if (sb->sb_csum3 != bsb_csum3(sb) || unit == 0 || unit % 512)
+		return 0;
+	if ((__le64_to_cpu(sb->length)*512 + unit - 1) / unit >
+	    BACKUP_CRC_ENTRIES ||
+	    (__le64_to_cpu(sb->length2)*512 + unit - 1) / unit >
+	    BACKUP_CRC_ENTRIES)
+		return 0;
+	return sb->crc_csum == __cpu_to_le32(~crc32c_le(~0, (unsigned char *)idx,
+							 sizeof(*idx)));
+}
+
+/* Check the 'len' bytes of 'part' in 'buf' against the index */
+static int backup_crc_match(struct mdp_backup_super *sb,
+			    struct mdp_backup_crc *idx, int part,
+			    char *buf, unsigned long long len)
+{
+	unsigned int unit = __le32_to_cpu(sb->crc_unit);
+	__u32 crc[BACKUP_CRC_ENTRIES];
+
+	backup_crc_buf(crc, unit, buf, len);
+	return memcmp(crc, idx->crc[part],
+		      (len + unit - 1) / unit * sizeof(crc[0])) == 0;
+}
+
+/* As backup_crc_match() for one part, reading the data from 'fd'.
+ * Returns 0 if the data matches, 1 if it does not, -1 if it cannot be
+ * read.
+ */
+static int backup_crc_check(int fd, struct mdp_backup_super *sb,
+			    struct mdp_backup_crc *idx, int part)
+{
+	unsigned int unit = __le32_to_cpu(sb->crc_unit);
+	unsigned long long bufsize = 1024 * 1024;
+	unsigned long long start = __le64_to_cpu(sb->devstart)*512;
+	unsigned long long len = __le64_to_cpu(sb->length)*512;
+	__u32 crc[BACKUP_CRC_ENTRIES];
+	char *buf;
+	int rv = 0;
+
+	if (part) {
+		start += __le64_to_cpu(sb->devstart2)*512;
+		len = __le64_to_cpu(sb->length2)*512;
+	}
+	if (bufsize > unit)
+		bufsize = unit;
+	if (posix_memalign((void **)&buf, 4096, bufsize))
+		return -1;
+	if (backup_crc_read(crc, unit, fd, start, len, buf, bufsize))
+		rv = -1;
+	else if (memcmp(crc, idx->crc[part],
+			(len + unit - 1) / unit * sizeof(crc[0])) != 0)
+		rv = 1;
+	free(buf);
+	return rv;
+}
+
 static int check_idle(struct supertype *st)
 {
 	/* Check that all member arrays for this container, or the
@@ -1191,26 +1333,6 @@ error:
 	return 0;
 }
 
-unsigned long compute_backup_blocks(int nchunk, int ochunk,
-				    unsigned int ndata, unsigned int odata)
-{
-	unsigned long a, b, blocks;
-	/* So how much do we need to backup.
-	 * We need an amount of data which is both a whole number of
-	 * old stripes and a whole number of new stripes.
-	 * So LCM for (chunksize*datadisks).
-	 */
-	a = (ochunk/512) * odata;
-	b = (nchunk/512) * ndata;
-	/* Find GCD */
-	a = GCD(a, b);
-	/* LCM == product / GCD */
-	blocks = (unsigned long)(ochunk/512) * (unsigned long)(nchunk/512) *
-		odata * ndata / a;
-
-	return blocks;
-}
-
 char *analyse_change(char *devname, struct mdinfo *info, struct reshape *re)
 {
 	/* Based on the current array state in info->array and
@@ -1746,7 +1868,7 @@ static int reshape_array(char *container, int fd, char *devname,
 			 int force, struct mddev_dev *devlist,
 			 unsigned long long data_offset,
 			 char *backup_file, int verbose, int forked,
-			 int restart);
+			 int restart, int max_suspend_ms);
 static int reshape_container(char *container, char *devname,
 			     int mdfd,
 			     struct supertype *st,
@@ -2341,7 +2463,7 @@ size_change_error:
 		sync_metadata(st);
 		rv = reshape_array(container, fd, devname, st, &info, c->force,
 				   devlist, s->data_offset, c->backup_file,
-				   c->verbose, 0, 0);
+				   c->verbose, 0, 0, c->reshape_max_suspend_ms);
 		frozen = 0;
 	}
 release:
@@ -2997,23 +3119,63 @@ static void catch_term(int sig)
 }
 
 
+/**
+ * grow_service_env() - Pass reshape options to GROW_SERVICE.
+ *
+ * @devnm: device name, as the service instance.
+ * @max_suspend_ms: --reshape-max-suspend-ms, or 0.
+ * Returns: 0 on success, -1 if the options could not be recorded.
+ *
+ * The service runs "mdadm --grow --continue" afresh, so options that shape
+ * the reshape go to it in MAP_DIR/<devnm>.grow, which it reads as an
+ * EnvironmentFile.  Without any, a file from an earlier reshape is removed.
+ */
+static int grow_service_env(char *devnm, int max_suspend_ms)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int rv;
+
+	snprintf(path, sizeof(path), "%s/%s.grow", MAP_DIR, devnm);
+	if (!max_suspend_ms) {
+		if (unlink(path) < 0 && errno != ENOENT)
+			return -1;
+		return 0;
+	}
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	fprintf(f, "MDADM_GROW_ARGS=--reshape-max-suspend-ms=%d\n",
+		max_suspend_ms);
+	rv = ferror(f);
+	if (fclose(f) != 0 || rv) {
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
 /**
  * handle_forking() - Handle reshape forking.
  *
  * @forked: if already forked.
  * @devname: device name.
+ * @max_suspend_ms: --reshape-max-suspend-ms, or 0.
  * Returns: -1 if fork() failed,
  *           0 if child process,
  *           1 if job delegated to forked process or systemd.
  *
  * This function is a helper function for reshapes for fork handling.
+ * If the options can't be passed on to systemd, fork() instead.
  */
-static mdadm_status_t handle_forking(bool forked, char *devname)
+static mdadm_status_t handle_forking(bool forked, char *devname,
+				     int max_suspend_ms)
 {
 	if (forked)
 		return MDADM_STATUS_FORKED;
 
-	if (devname && continue_via_systemd(devname, GROW_SERVICE, NULL) == MDADM_STATUS_SUCCESS)
+	if (devname && grow_service_env(devname, max_suspend_ms) == 0 &&
+	    continue_via_systemd(devname, GROW_SERVICE, NULL) == MDADM_STATUS_SUCCESS)
 		return MDADM_STATUS_SUCCESS;
 
 	switch (fork()) {
@@ -3029,7 +3191,7 @@ static int reshape_array(char *container, int fd, char *devname,
 			 int force, struct mddev_dev *devlist,
 			 unsigned long long data_offset,
 			 char *backup_file, int verbose, int forked,
-			 int restart)
+			 int restart, int max_suspend_ms)
 {
 	struct reshape reshape;
 	int spares_needed;
@@ -3094,6 +3256,7 @@ static int reshape_array(char *container, int fd, char *devname,
 			pr_err("%s\n", msg);
 		goto release;
 	}
+	reshape.max_suspend_ms = max_suspend_ms;
 	if (restart && (reshape.level != info->array.level ||
 			reshape.before.layout != info->array.layout ||
 			reshape.before.data_disks + reshape.parity !=
@@ -3435,16 +3598,8 @@ started:
 	/* Decide how many blocks (sectors) for a reshape
 	 * unit.  The number we have so far is just a minimum
 	 */
-	blocks = reshape.backup_blocks;
-	if (reshape.before.data_disks ==
-	    reshape.after.data_disks) {
-		/* Make 'blocks' bigger for better throughput, but
-		 * not so big that we reject it below.
-		 * Try for 16 megabytes
-		 */
-		while (blocks * 32 < sra->component_size && blocks < 16*1024*2)
-			blocks *= 2;
-	} else
+	blocks = reshape_backup_size(&reshape, sra->component_size);
+	if (reshape.before.data_disks != reshape.after.data_disks)
 		pr_err("Need to backup %luK of critical section..\n", blocks/2);
 
 	if (blocks >= sra->component_size/2) {
@@ -3494,6 +3649,9 @@ started:
 			  min(reshape.before.data_disks,
 			      reshape.after.data_disks), blocks);
 
+	if (reshape.parity)
+		select_parity_algorithms(verbose);
+
 	/* Right, everything seems fine. Let's kick things off.
 	 * If only changing raid_disks, use ioctl, else use
 	 * sysfs.
@@ -3528,7 +3686,8 @@ started:
 	 * handling backups of the data...
 	 * This is all done by a forked background process.
 	 */
-	switch (handle_forking(forked, container ? container : sra->sys_name)) {
+	switch (handle_forking(forked, container ? container : sra->sys_name,
+			       max_suspend_ms)) {
 	default: /* Unused, only to satisfy compiler. */
 	case MDADM_STATUS_ERROR: /* error */
 		pr_err("Cannot run child to monitor reshape: %s\n",
@@ -3711,7 +3870,8 @@ int reshape_container(char *container, char *devname,
 	 */
 	ping_monitor(container);
 
-	switch (handle_forking(forked, container)) {
+	switch (handle_forking(forked, container,
+			       c->reshape_max_suspend_ms)) {
 	default: /* Unused, only to satisfy compiler. */
 	case MDADM_STATUS_ERROR: /* error */
 		perror("Cannot fork to complete reshape\n");
@@ -3816,7 +3976,8 @@ int reshape_container(char *container, char *devname,
 
 		rv = reshape_array(container, fd, adev, st,
 				   content, c->force, NULL, INVALID_SECTORS,
-				   c->backup_file, c->verbose, 1, restart);
+				   c->backup_file, c->verbose, 1, restart,
+				   c->reshape_max_suspend_ms);
 		close(fd);
 
 		/* Do not run reshape in initrd but let it initialize.*/
@@ -3924,6 +4085,7 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 	unsigned long long read_offset, write_offset;
 	unsigned long long write_range;
 	unsigned long long max_progress, target, completed;
+	unsigned long long start_completed, start_ms;
 	unsigned long long array_size = (info->component_size
 					 * reshape->before.data_disks);
 	int fd;
@@ -3955,8 +4117,10 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 	 * reaches (within 'blocks' of) the read_offset at the current location.
 	 * However that region must be suspended unless we are using native
 	 * metadata.
-	 * If we need to suspend more, we limit it to 128M per device, which is
-	 * rather arbitrary and should be some time-based calculation.
+	 * If we need to suspend more, we limit it to 128M per device, or to
+	 * what the reshape and the backup get through in
+	 * --reshape-max-suspend-ms, see
+	 * suspend_target().
 	 */
 	read_offset = info->reshape_progress / reshape->before.data_disks;
 	write_offset = info->reshape_progress / reshape->after.data_disks;
@@ -4001,12 +4165,7 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 	 * FIXME this is too big - it takes to long to complete
 	 * this much.
 	 */
-	target = 64*1024*2 * min(reshape->before.data_disks,
-				 reshape->after.data_disks);
-	target /= reshape->backup_blocks;
-	if (target < 2)
-		target = 2;
-	target *= reshape->backup_blocks;
+	target = suspend_target(reshape);
 
 	/* For externally managed metadata we always need to suspend IO to
 	 * the area being reshaped so we regularly push suspend_point forward.
@@ -4100,12 +4259,15 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 
 	if (sysfs_fd_get_ll(fd, &completed) < 0)
 		goto check_progress;
+	start_completed = completed;
+	start_ms = monotonic_ms();
 
 	while (completed < max_progress && completed < wait_point) {
 		/* Check that sync_action is still 'reshape' to avoid
 		 * waiting forever on a dead array
 		 */
 		char action[SYSFS_MAX_BUF_SIZE];
+		int timeout;
 
 		if (sysfs_get_str(info, NULL, "sync_action", action, sizeof(action)) <= 0)
 			break;
@@ -4128,10 +4290,19 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 		}
 		if (strncmp(action, "reshape", 7) != 0)
 			break;
-		sysfs_wait(fd, NULL);
+		/* wake now and then so a stall gets reported */
+		timeout = 5000;
+		sysfs_wait(fd, &timeout);
 		if (sysfs_fd_get_ll(fd, &completed) < 0)
 			goto check_progress;
-	}
+		reshape_report_done(completed * reshape->after.data_disks);
+	}
+	/* The reshape was not held back by sync_max while we waited */
+	if (completed > start_completed)
+		reshape_rate_sample(reshape,
+				    (completed - start_completed) *
+				    reshape->after.data_disks,
+				    monotonic_ms() - start_ms);
 	/* Some kernels reset 'sync_completed' to zero,
 	 * we need to have real point we are in md.
 	 * So in that case, read 'reshape_position' from sysfs.
@@ -4219,32 +4390,17 @@ check_progress:
 	}
 }
 
-/* FIXME return status is never checked */
-static int grow_backup(struct mdinfo *sra,
-		unsigned long long offset, /* per device */
-		unsigned long stripes, /* per device, in old chunks */
-		int *sources, unsigned long long *offsets,
-		int disks, int chunk, int level, int layout,
-		int dests, int *destfd, unsigned long long *destoffsets,
-		int part, int *degraded,
-		char *buf)
+/* Check the array is still healthy and describe the backup of
+ * 'stripes' at 'offset' in part 'part' of the backup-super-block.
+ */
+static int grow_backup_prepare(struct mdinfo *sra,
+			       unsigned long long offset, /* per device */
+			       unsigned long stripes, /* per device, in old chunks */
+			       int *sources, int chunk, int odata,
+			       int part, int *degraded)
 {
-	/* Backup 'blocks' sectors at 'offset' on each device of the array,
-	 * to storage 'destfd' (offset 'destoffsets'), after first
-	 * suspending IO.  Then allow resync to continue
-	 * over the suspended section.
-	 * Use part 'part' of the backup-super-block.
-	 */
-	int odata = disks;
-	int rv = 0;
-	int i;
 	unsigned long long ll;
 	int new_degraded;
-	//printf("offset %llu\n", offset);
-	if (level >= 4)
-		odata--;
-	if (level == 6)
-		odata--;
 
 	/* Check that array hasn't become degraded, else we might backup the wrong data */
 	if (sysfs_get_ll(sra, NULL, "degraded", &ll) < 0)
@@ -4284,6 +4440,123 @@ static int grow_backup(struct mdinfo *sra,
 	}
 	if (part)
 		bsb.magic[15] = '2';
+	return 0;
+}
+
+/* Write 'sb' and the crc index 'crc' in front of (and, if 'len' is given
+ * and there is room, 'sb' behind) the 'len' bytes of backup data on each
+ * destination and make it stable.  The destinations are written, and
+ * then flushed, all at once: with the backup in spares a critical
+ * section costs one flush whatever the number of them.
+ */
+static int write_backup_super(struct mdp_backup_super *sb,
+			      struct mdp_backup_crc *crc, int dests,
+			      int *destfd, unsigned long long *destoffsets,
+			      unsigned long long len)
+{
+	unsigned long long start_ms;
+	char *heads;
+	struct stripe_io *io;
+	struct iovec *iov;
+	int rv = 0;
+	int n = 0;
+	int i;
+
+	if (dests <= 0)
+		return 0;
+	/* Each destination gets its own copy, they may be O_DIRECT */
+	if (posix_memalign((void **)&heads, 4096, dests * 4096))
+		return -1;
+	iov = xmalloc(dests * 2 * sizeof(*iov));
+	io = xcalloc(dests * 2, sizeof(*io));
+
+	sb->mtime = __cpu_to_le64(time(0));
+	sb->crc_csum = __cpu_to_le32(~crc32c_le(~0, (unsigned char *)crc,
+						 sizeof(*crc)));
+	for (i = 0; i < dests; i++) {
+		struct mdp_backup_super *s;
+
+		s = (struct mdp_backup_super *)(heads + i * 4096);
+		*s = *sb;
+		memcpy(s + 1, crc, sizeof(*crc));
+		s->devstart = __cpu_to_le64(destoffsets[i]/512);
+		s->sb_csum = bsb_csum((char*)s,
+				      ((char*)&s->sb_csum)-((char*)s));
+		if (memcmp(s->magic, "md_backup_data-2", 16) == 0)
+			s->sb_csum2 = bsb_csum((char*)s,
+					       ((char*)&s->sb_csum2)-((char*)s));
+		s->sb_csum3 = bsb_csum3(s);
+		iov[i * 2].iov_base = s;
+		iov[i * 2].iov_len = 4096;
+		iov[i * 2 + 1].iov_base = s;
+		iov[i * 2 + 1].iov_len = 512;
+
+		io[n].fd = destfd[i];
+		io[n].op = STRIPE_IO_WRITE;
+		io[n].iov = &iov[i * 2];
+		io[n].iovcnt = 1;
+		io[n].offset = destoffsets[i] - 4096;
+		n++;
+		if (len && destoffsets[i] > 4096) {
+			io[n] = io[n - 1];
+			io[n].iov = &iov[i * 2 + 1];
+			io[n].offset = destoffsets[i] + len;
+			n++;
+		}
+	}
+	/* callers look at what was written last */
+	*sb = *(struct mdp_backup_super *)(heads + (dests - 1) * 4096);
+
+	stripe_io_submit(io, n);
+	for (i = 0; i < n; i++)
+		if (io[i].res != (ssize_t)io[i].iov->iov_len)
+			rv = -1;
+
+	for (i = 0; i < dests; i++) {
+		io[i].fd = destfd[i];
+		io[i].op = STRIPE_IO_SYNC;
+	}
+	start_ms = monotonic_ms();
+	stripe_io_submit(io, dests);
+	reshape_report_sync(monotonic_ms() - start_ms);
+	for (i = 0; i < dests; i++)
+		if (io[i].res < 0)
+			rv = -1;
+
+	free(io);
+	free(iov);
+	free(heads);
+	return rv;
+}
+
+static int grow_backup(struct mdinfo *sra,
+		unsigned long long offset, /* per device */
+		unsigned long stripes, /* per device, in old chunks */
+		int *sources, unsigned long long *offsets,
+		int disks, int chunk, int level, int layout,
+		int dests, int *destfd, unsigned long long *destoffsets,
+		int part, int *degraded,
+		char *buf)
+{
+	/* Backup 'blocks' sectors at 'offset' on each device of the array,
+	 * to storage 'destfd' (offset 'destoffsets'), after first
+	 * suspending IO.  Then allow resync to continue
+	 * over the suspended section.
+	 * Use part 'part' of the backup-super-block.
+	 */
+	int odata = disks;
+	int rv = 0;
+	int i;
+	//printf("offset %llu\n", offset);
+	if (level >= 4)
+		odata--;
+	if (level == 6)
+		odata--;
+
+	rv = grow_backup_prepare(sra, offset, stripes, sources, chunk, odata,
+				 part, degraded);
+	if (rv)
+		return rv;
 	for (i = 0; i < dests; i++)
 		if (part)
 			lseek64(destfd[i], destoffsets[i] +
@@ -4297,35 +4570,20 @@ static int grow_backup(struct mdinfo *sra,
 
 	if (rv)
 		return rv;
-	bsb.mtime = __cpu_to_le64(time(0));
-	for (i = 0; i < dests; i++) {
-		bsb.devstart = __cpu_to_le64(destoffsets[i]/512);
+	/* The data went straight out, read one copy back for the index */
+	memset(bsb_crc.crc[part], 0, sizeof(bsb_crc.crc[part]));
+	if (dests > 0 && bsb.crc_unit) {
+		unsigned long long start = destoffsets[0];
 
-		bsb.sb_csum = bsb_csum((char*)&bsb,
-				       ((char*)&bsb.sb_csum)-((char*)&bsb));
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0)
-			bsb.sb_csum2 = bsb_csum((char*)&bsb,
-						((char*)&bsb.sb_csum2)-((char*)&bsb));
-
-		rv = -1;
-		if ((unsigned long long)lseek64(destfd[i],
-						destoffsets[i] - 4096, 0) !=
-		    destoffsets[i] - 4096)
-			break;
-		if (write(destfd[i], &bsb, 512) != 512)
-			break;
-		if (destoffsets[i] > 4096) {
-			if ((unsigned long long)lseek64(destfd[i], destoffsets[i]+stripes*chunk*odata, 0) !=
-			    destoffsets[i]+stripes*chunk*odata)
-				break;
-			if (write(destfd[i], &bsb, 512) != 512)
-				break;
-		}
-		fsync(destfd[i]);
-		rv = 0;
+		if (part)
+			start += __le64_to_cpu(bsb.devstart2)*512;
+		if (backup_crc_read(bsb_crc.crc[part],
+				    __le32_to_cpu(bsb.crc_unit), destfd[0],
+				    start, stripes * chunk * odata, buf, chunk))
+			return -1;
 	}
-
-	return rv;
+	return write_backup_super(&bsb, &bsb_crc, dests, destfd, destoffsets,
+				  stripes * chunk * odata);
 }
 
 /* in 2.6.30, the value reported by sync_completed can be
@@ -4346,9 +4604,6 @@ static int forget_backup(int dests, int *destfd,
 	/*
 	 * Erase backup 'part' (which is 0 or 1)
 	 */
-	int i;
-	int rv;
-
 	if (part) {
 		bsb.arraystart2 = __cpu_to_le64(0);
 		bsb.length2 = __cpu_to_le64(0);
@@ -4356,23 +4611,9 @@ static int forget_backup(int dests, int *destfd,
 		bsb.arraystart = __cpu_to_le64(0);
 		bsb.length = __cpu_to_le64(0);
 	}
-	bsb.mtime = __cpu_to_le64(time(0));
-	rv = 0;
-	for (i = 0; i < dests; i++) {
-		bsb.devstart = __cpu_to_le64(destoffsets[i]/512);
-		bsb.sb_csum = bsb_csum((char*)&bsb,
-				       ((char*)&bsb.sb_csum)-((char*)&bsb));
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0)
-			bsb.sb_csum2 = bsb_csum((char*)&bsb,
-						((char*)&bsb.sb_csum2)-((char*)&bsb));
-		if ((unsigned long long)lseek64(destfd[i], destoffsets[i]-4096, 0) !=
-		    destoffsets[i]-4096)
-			rv = -1;
-		if (rv == 0 && write(destfd[i], &bsb, 512) != 512)
-			rv = -1;
-		fsync(destfd[i]);
-	}
-	return rv;
+	memset(bsb_crc.crc[part], 0, sizeof(bsb_crc.crc[part]));
+	return write_backup_super(&bsb, &bsb_crc, dests, destfd,
+				  destoffsets, 0);
 }
 
 static void fail(char *msg)
@@ -4477,6 +4718,131 @@ out:
 	return;
 }
 
+/*
+ * child_monitor() overlaps reading the next backup window with writing
+ * out the previous one.  A backup_job is a window that has been read
+ * from the array and is being written to the backup destinations, with
+ * a copy of the backup-super-block describing it, by a separate thread.
+ * Only one is ever in flight so the superblocks reach the disk in order.
+ */
+static struct backup_job {
+	struct mdp_backup_super sb;
+	struct mdp_backup_crc crc;
+	pthread_t thread;
+	int active;	/* started, not yet reaped */
+	int done;	/* set by the writer when it is finished */
+	int threaded;
+	int rv;
+	char *buf;
+	unsigned long long len;
+	unsigned long long start_ms;	/* when reading it began */
+	unsigned long long end_ms;	/* when it was stable */
+	unsigned long long point;	/* backup_point once this is safe */
+	int part;
+	int dests;
+	int *destfd;
+	unsigned long long *destoffsets;
+} backup_job;
+
+static void *backup_job_write(void *arg)
+{
+	struct backup_job *job = arg;
+	struct iovec iov = { .iov_base = job->buf, .iov_len = job->len };
+	struct stripe_io *io = xcalloc(job->dests, sizeof(*io));
+	int i;
+
+	for (i = 0; i < job->dests; i++) {
+		io[i].fd = job->destfd[i];
+		io[i].op = STRIPE_IO_WRITE;
+		io[i].iov = &iov;
+		io[i].iovcnt = 1;
+		io[i].offset = job->destoffsets[i];
+		if (job->part)
+			io[i].offset += __le64_to_cpu(job->sb.devstart2)*512;
+	}
+	stripe_io_submit(io, job->dests);
+	job->rv = 0;
+	for (i = 0; i < job->dests; i++)
+		if (io[i].res != (ssize_t)job->len)
+			job->rv = -1;
+	free(io);
+	/* Only a window that is on every destination gets an index and a
+	 * backup-super-block; one that isn't must never look valid.
+	 */
+	if (job->rv == 0 && job->sb.crc_unit)
+		backup_crc_buf(job->crc.crc[job->part],
+			       __le32_to_cpu(job->sb.crc_unit),
+			       job->buf, job->len);
+	if (job->rv == 0)
+		job->rv = write_backup_super(&job->sb, &job->crc, job->dests,
+					     job->destfd, job->destoffsets,
+					     job->len);
+	job->end_ms = monotonic_ms();
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void backup_job_start(struct backup_job *job, char *buf,
+			     unsigned long long len,
+			     unsigned long long start_ms, int part,
+			     unsigned long long point, int dests,
+			     int *destfd, unsigned long long *destoffsets)
+{
+	pthread_attr_t attr;
+
+	job->sb = bsb;
+	job->crc = bsb_crc;
+	memset(job->crc.crc[part], 0, sizeof(job->crc.crc[part]));
+	job->buf = buf;
+	job->len = len;
+	job->start_ms = start_ms;
+	job->part = part;
+	job->point = point;
+	job->dests = dests;
+	job->destfd = destfd;
+	job->destoffsets = destoffsets;
+	job->done = 0;
+	job->active = 1;
+
+	/* Memory is locked by now, keep the stack small */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+	job->threaded = pthread_create(&job->thread, &attr,
+				       backup_job_write, job) == 0;
+	pthread_attr_destroy(&attr);
+	if (!job->threaded)
+		backup_job_write(job);
+}
+
+/* Reap the job in flight if it has finished, or if 'wait' is set.
+ * Returns 1 if a job was reaped and *backup_point moved, -1 if the
+ * backup could not be written, in which case *backup_point stays
+ * where it was.
+ */
+static int backup_job_reap(struct backup_job *job, int wait, int afd,
+			   struct reshape *reshape,
+			   unsigned long long *backup_point)
+{
+	if (!job->active)
+		return 0;
+	if (!wait && !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+		return 0;
+	if (job->threaded)
+		pthread_join(job->thread, NULL);
+	job->active = 0;
+	if (job->rv) {
+		pr_err("writing backup failed\n");
+		return -1;
+	}
+	bsb_crc = job->crc;
+	reshape_report_backup(job->len);
+	validate(afd, job->destfd[0], job->destoffsets[0]);
+	backup_time_sample(reshape, job->len / 512,
+			   job->end_ms - job->start_ms);
+	*backup_point = job->point;
+	return 1;
+}
+
 int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		  struct supertype *st, unsigned long blocks,
 		  int *fds, unsigned long long *offsets,
@@ -4485,12 +4851,21 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	/* Monitor a reshape where backup is being performed using
 	 * 'native' mechanism - either to a backup file, or
 	 * to some space in a spare.
+	 * If there is memory for two whole backup windows, the next
+	 * window is read while the previous one is being written out,
+	 * see struct backup_job.
 	 */
 	char *buf;
+	char *wbuf[2] = { NULL, NULL };
+	int cur = 0;
+	int pipelined;
+	struct backup_job *job = &backup_job;
 	int degraded = -1;
 	unsigned long long suspend_point, array_size;
 	unsigned long long backup_point, wait_point;
+	unsigned long long next_point; /* end of what has been read for backup */
 	unsigned long long reshape_completed;
+	unsigned long long report_total;
 	int done = 0;
 	int increasing = reshape->after.data_disks >=
 		reshape->before.data_disks;
@@ -4503,8 +4878,10 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	int chunk = sra->array.chunk_size;
 	struct mdinfo *sd;
 	unsigned long stripes;
+	unsigned long unit;
 	int uuid[4];
 	int frozen = 0;
+	int failed = 0;
 
 	/* set up the backup-super-block.  This requires the
 	 * uuid from the array.
@@ -4536,13 +4913,25 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	memcpy(bsb.set_uuid, uuid, 16);
 	bsb.mtime = __cpu_to_le64(time(0));
 	bsb.devstart2 = blocks;
+	bsb.crc_unit = __cpu_to_le32(backup_crc_unit(blocks * 512, chunk));
+	memset(&bsb_crc, 0, sizeof(bsb_crc));
 
 	stripes = blocks / (sra->array.chunk_size/512) /
 		reshape->before.data_disks;
+	unit = reshape->backup_blocks / (sra->array.chunk_size/512) /
+		reshape->before.data_disks;
+	if (unit < 1 || unit > stripes)
+		unit = stripes;
 
 	if (posix_memalign((void**)&buf, 4096, disks * chunk))
 		/* Don't start the 'reshape' */
 		return 0;
+	pipelined = dests > 0 &&
+		posix_memalign((void**)&wbuf[0], 4096,
+			       stripes * chunk * data) == 0 &&
+		posix_memalign((void**)&wbuf[1], 4096,
+			       stripes * chunk * data) == 0;
+	dprintf("%s backup\n", pipelined ? "pipelined" : "sequential");
 
 	if (increasing) {
 		array_size = sra->component_size * reshape->after.data_disks;
@@ -4553,6 +4942,12 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		backup_point = reshape->backup_blocks;
 		suspend_point = array_size;
 	}
+	next_point = backup_point;
+	report_total = sra->component_size * reshape->after.data_disks;
+	reshape_report_start(sra->sys_name,
+			     increasing ? sra->reshape_progress :
+			     report_total - sra->reshape_progress,
+			     report_total);
 
 	while (!done) {
 		int rv;
@@ -4578,13 +4973,38 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 				wait_point = __le64_to_cpu(bsb.arraystart2);
 		}
 
+		/* A finished write makes more progress safe */
+		if (backup_job_reap(job, 0, afd, reshape,
+				    &backup_point) < 0) {
+			failed = 1;
+			break;
+		}
+
 		reshape_completed = sra->reshape_progress;
 		rv = progress_reshape(sra, reshape,
 				      backup_point, wait_point,
 				      &suspend_point, &reshape_completed,
 				      &frozen);
+		/* The reshape went on while the last window was written.
+		 * Anything from here on - forgetting a part, the next
+		 * backup, finishing - needs that write complete.
+		 */
+		if (backup_job_reap(job, 1, afd, reshape,
+				    &backup_point) < 0) {
+			failed = 1;
+			break;
+		}
 		/* external metadata would need to ping_monitor here */
 		sra->reshape_progress = reshape_completed;
+		if (increasing)
+			reshape_report_progress(reshape_completed,
+						reshape_completed,
+						suspend_point);
+		else
+			reshape_report_progress(report_total -
+						reshape_completed,
+						suspend_point,
+						reshape_completed);
 
 		/* Clear any backup region that is before 'here' */
 		if (increasing) {
@@ -4618,12 +5038,14 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		if (rv == 0 && increasing && !st->ss->external) {
 			/* No longer need to monitor this reshape */
 			sysfs_set_str(sra, NULL, "sync_max", "max");
+			reshape_report_end("released");
 			done = 1;
 			break;
 		}
 
 		while (rv) {
 			unsigned long long offset;
+			unsigned long long start_ms;
 			unsigned long actual_stripes;
 			/* Need to backup some data.
 			 * If 'part' is not used and the desired
@@ -4636,8 +5058,8 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 			if (part == 1 && __le64_to_cpu(bsb.length2) != 0)
 				break;
 
-			offset = backup_point / data;
-			actual_stripes = stripes;
+			offset = next_point / data;
+			actual_stripes = backup_window(reshape, stripes, unit);
 			if (increasing) {
 				if (offset + actual_stripes * (chunk/512) >
 				    sra->component_size)
@@ -4655,30 +5077,378 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 			}
 			if (actual_stripes == 0)
 				break;
-			grow_backup(sra, offset, actual_stripes, fds, offsets,
-				    disks, chunk, level, layout, dests, destfd,
-				    destoffsets, part, &degraded, buf);
-			validate(afd, destfd[0], destoffsets[0]);
-			/* record where 'part' is up to */
-			part = !part;
 			if (increasing)
-				backup_point += actual_stripes * (chunk/512) * data;
+				next_point += actual_stripes * (chunk/512) * data;
 			else
-				backup_point -= actual_stripes * (chunk/512) * data;
+				next_point -= actual_stripes * (chunk/512) * data;
+			start_ms = monotonic_ms();
+			if (pipelined) {
+				unsigned long long len;
+
+				len = actual_stripes * chunk * data;
+				/* Read while the previous window is written */
+				if (grow_backup_prepare(sra, offset,
+							actual_stripes, fds,
+							chunk, data, part,
+							&degraded) ||
+				    save_stripes(fds, offsets, disks, chunk,
+						 level, layout, 0, NULL,
+						 offset * 512 * data, len,
+						 wbuf[cur])) {
+					backup_job_reap(job, 1, afd, reshape,
+							&backup_point);
+					failed = 1;
+					break;
+				}
+				/* don't count waiting for the last one */
+				start_ms = monotonic_ms() - start_ms;
+				if (backup_job_reap(job, 1, afd, reshape,
+						    &backup_point) < 0) {
+					failed = 1;
+					break;
+				}
+				start_ms = monotonic_ms() - start_ms;
+				backup_job_start(job, wbuf[cur], len,
+						 start_ms, part,
+						 next_point, dests, destfd,
+						 destoffsets);
+				cur = !cur;
+			} else {
+				if (grow_backup(sra, offset, actual_stripes,
+						fds, offsets, disks, chunk,
+						level, layout, dests, destfd,
+						destoffsets, part, &degraded,
+						buf)) {
+					failed = 1;
+					break;
+				}
+				backup_time_sample(reshape, actual_stripes *
+						   (chunk/512) * data,
+						   monotonic_ms() - start_ms);
+				reshape_report_backup(actual_stripes * chunk *
+						      data);
+				validate(afd, destfd[0], destoffsets[0]);
+				backup_point = next_point;
+			}
+			/* record where 'part' is up to */
+			part = !part;
 		}
+		if (failed)
+			break;
 	}
+	if (backup_job_reap(job, 1, afd, reshape, &backup_point) < 0)
+		failed = 1;
+	if (failed)
+		pr_err("Cannot back up critical section, aborting reshape\n");
 
 	/* FIXME maybe call progress_reshape one more time instead */
-	/* remove any remaining suspension */
-	sysfs_set_num(sra, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
-	sysfs_set_num(sra, NULL, "suspend_hi", 0);
-	sysfs_set_num(sra, NULL, "suspend_lo", 0);
-	sysfs_set_num(sra, NULL, "sync_min", 0);
+	/* remove any remaining suspension, unless a window that was not
+	 * backed up is in it: then abort_reshape() stops the reshape
+	 * before lifting it.
+	 */
+	if (!failed) {
+		sysfs_set_num(sra, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
+		sysfs_set_num(sra, NULL, "suspend_hi", 0);
+		sysfs_set_num(sra, NULL, "suspend_lo", 0);
+		sysfs_set_num(sra, NULL, "sync_min", 0);
+	}
+	reshape_report_end(done ? "finished" : "aborted");
 
 	free(buf);
+	free(wbuf[0]);
+	free(wbuf[1]);
 	return done;
 }
 
+/* A backup of the critical section on a spare or in the backup file */
+struct backup_found {
+	struct mdp_backup_super sb;	/* the copy found first */
+	char *head;			/* the 4K in front of the data */
+	char *devname;
+	char namebuf[20];
+	int fd;
+	int usable;
+	unsigned long long offset;	/* of 'sb' */
+};
+
+/* Can backup-super-block 'sb' be restored to the array described by
+ * 'info'?  Returns 1 if it is sound and holds data the reshape still
+ * needs.
+ */
+static int backup_usable(struct mdp_backup_super *sb, struct mdinfo *info,
+			 char *devname, int verbose)
+{
+	if (memcmp(sb->magic, "md_backup_data-1", 16) != 0 &&
+	    memcmp(sb->magic, "md_backup_data-2", 16) != 0) {
+		if (verbose)
+			pr_err("No backup metadata on %s\n", devname);
+		return 0;
+	}
+	if (sb->sb_csum != bsb_csum((char*)sb, ((char*)&sb->sb_csum)-((char*)sb))) {
+		if (verbose)
+			pr_err("Bad backup-metadata checksum on %s\n",
+			       devname);
+		return 0; /* bad checksum */
+	}
+	if (memcmp(sb->magic, "md_backup_data-2", 16) == 0 &&
+	    sb->sb_csum2 != bsb_csum((char*)sb, ((char*)&sb->sb_csum2)-((char*)sb))) {
+		if (verbose)
+			pr_err("Bad backup-metadata checksum2 on %s\n",
+			       devname);
+		return 0; /* Bad second checksum */
+	}
+	if (memcmp(sb->set_uuid, info->uuid, 16) != 0) {
+		if (verbose)
+			pr_err("Wrong uuid on backup-metadata on %s\n",
+			       devname);
+		return 0; /* Wrong uuid */
+	}
+
+	/*
+	 * array utime and backup-mtime should be updated at
+	 * much the same time, but it seems that sometimes
+	 * they aren't... So allow considerable flexability in
+	 * matching, and allow this test to be overridden by
+	 * an environment variable.
+	 */
+	if(time_after(info->array.utime, (unsigned int)__le64_to_cpu(sb->mtime) + 2*60*60) ||
+	   time_before(info->array.utime, (unsigned int)__le64_to_cpu(sb->mtime) - 10*60)) {
+		if (check_env("MDADM_GROW_ALLOW_OLD")) {
+			pr_err("accepting backup with timestamp %lu for array with timestamp %lu\n",
+				(unsigned long)__le64_to_cpu(sb->mtime),
+				(unsigned long)info->array.utime);
+		} else {
+			pr_err("too-old timestamp on backup-metadata on %s\n", devname);
+			pr_err("If you think it is should be safe, try 'export MDADM_GROW_ALLOW_OLD=1'\n");
+			return 0; /* time stamp is too bad */
+		}
+	}
+
+	if (sb->magic[15] == '1') {
+		if (sb->length == 0)
+			return 0;
+		if (info->delta_disks >= 0) {
+			/* reshape_progress is increasing */
+			if (__le64_to_cpu(sb->arraystart)
+			    + __le64_to_cpu(sb->length)
+			    < info->reshape_progress)
+				goto nonew; /* No new data here */
+		} else {
+			/* reshape_progress is decreasing */
+			if (__le64_to_cpu(sb->arraystart) >=
+			    info->reshape_progress)
+				goto nonew; /* No new data here */
+		}
+	} else {
+		if (sb->length == 0 && sb->length2 == 0)
+			return 0;
+		if (info->delta_disks >= 0) {
+			/* reshape_progress is increasing */
+			if ((__le64_to_cpu(sb->arraystart)
+			     + __le64_to_cpu(sb->length)
+			     < info->reshape_progress) &&
+			    (__le64_to_cpu(sb->arraystart2)
+			     + __le64_to_cpu(sb->length2)
+			     < info->reshape_progress))
+				goto nonew; /* No new data here */
+		} else {
+			/* reshape_progress is decreasing */
+			if (__le64_to_cpu(sb->arraystart) >=
+			    info->reshape_progress &&
+			    __le64_to_cpu(sb->arraystart2) >=
+			    info->reshape_progress)
+				goto nonew; /* No new data here */
+		}
+	}
+	return 1;
+nonew:
+	if (verbose)
+		pr_err("backup-metadata found on %s but is not needed\n",
+		       devname);
+	return 0;
+}
+
+/* How far along the reshape the data in the 'parts' (a mask) of backup
+ * 'sb' reaches
+ */
+static unsigned long long backup_reach(struct mdp_backup_super *sb,
+				       int increasing, int parts)
+{
+	unsigned long long reach = increasing ? 0 : ~0ULL;
+	int part;
+
+	for (part = 0; part < (sb->magic[15] == '2' ? 2 : 1); part++) {
+		unsigned long long start = __le64_to_cpu(part ? sb->arraystart2
+							  : sb->arraystart);
+		unsigned long long len = __le64_to_cpu(part ? sb->length2
+							: sb->length);
+
+		if (len == 0 || !(parts & (1 << part)))
+			continue;
+		if (increasing && start + len > reach)
+			reach = start + len;
+		if (!increasing && start < reach)
+			reach = start;
+	}
+	return reach;
+}
+
+/* The copies of a backup on all spares are written together, but a crash
+ * can leave some behind.  Prefer the newest, then the one furthest along.
+ */
+static int backup_better(struct backup_found *a, struct backup_found *b,
+			 int increasing)
+{
+	unsigned long long ra, rb;
+
+	if (__le64_to_cpu(a->sb.mtime) != __le64_to_cpu(b->sb.mtime))
+		return __le64_to_cpu(a->sb.mtime) > __le64_to_cpu(b->sb.mtime);
+	ra = backup_reach(&a->sb, increasing, 3);
+	rb = backup_reach(&b->sb, increasing, 3);
+	return increasing ? ra > rb : ra < rb;
+}
+
+/*
+ * The window data and the backup-super-block describing it share one
+ * flush, so a crash can leave a new superblock next to a torn window.
+ * The reshape never enters a window before it is stable, so such a part
+ * lies wholly on one side of reshape_progress and is not needed; the
+ * array still holds that data.  Only a part reshape_progress is inside
+ * must be intact.
+ */
+static int backup_part_needed(struct mdp_backup_super *sb, int part,
+			      struct mdinfo *info)
+{
+	unsigned long long start = __le64_to_cpu(part ? sb->arraystart2
+						  : sb->arraystart);
+	unsigned long long len = __le64_to_cpu(part ? sb->length2
+						: sb->length);
+
+	return info->reshape_progress > start &&
+		info->reshape_progress < start + len;
+}
+
+/*
+ * Read the parts of backup 'b' with one large request each, check them
+ * against its crc index and write them into the array.  A damaged part
+ * that is not needed is left out.
+ * Returns 0 once restored, with the parts written in *restored (a mask),
+ * 1 if the backup is damaged and another one should be tried, -1 if
+ * writing to the array failed.
+ */
+static int restore_backup_copy(struct backup_found *b, struct mdinfo *info,
+			       int *fdlist, unsigned long long *offsets,
+			       int *restored, int verbose)
+{
+	struct mdp_backup_super *sb = (struct mdp_backup_super *)b->head;
+	struct mdp_backup_crc *idx = (struct mdp_backup_crc *)(b->head + 512);
+	int parts = sb->magic[15] == '2' ? 2 : 1;
+	char *data[2] = { NULL, NULL };
+	unsigned long long start[2], len[2];
+	struct stripe_io io[2];
+	struct iovec iov[2];
+	int n = 0;
+	int part;
+	int rv = 1;
+
+	for (part = 0; part < parts; part++) {
+		start[part] = __le64_to_cpu(sb->devstart)*512;
+		len[part] = __le64_to_cpu(sb->length)*512;
+		if (part) {
+			start[part] += __le64_to_cpu(sb->devstart2)*512;
+			len[part] = __le64_to_cpu(sb->length2)*512;
+		}
+		if (len[part] == 0)
+			continue;
+		if (posix_memalign((void **)&data[part], 4096, len[part])) {
+			data[part] = NULL;
+			break;
+		}
+		iov[n].iov_base = data[part];
+		iov[n].iov_len = len[part];
+		io[n].fd = b->fd;
+		io[n].op = STRIPE_IO_READ;
+		io[n].iov = &iov[n];
+		io[n].iovcnt = 1;
+		io[n].offset = start[part];
+		n++;
+	}
+
+	if (part < parts) {
+		/* No room to hold it, check and restore it in pieces */
+		free(data[0]);
+		data[0] = data[1] = NULL;
+	} else {
+		stripe_io_submit(io, n);
+		for (part = 0; part < n; part++)
+			if (io[part].res != (ssize_t)iov[part].iov_len) {
+				if (verbose)
+					pr_err("Cannot read backup data from %s\n",
+					       b->devname);
+				goto out;
+			}
+	}
+
+	for (part = 0; part < parts; part++) {
+		int bad;
+
+		if (!sb->crc_unit || len[part] == 0)
+			continue;
+		if (data[part])
+			bad = !backup_crc_match(sb, idx, part, data[part],
+						len[part]);
+		else
+			bad = backup_crc_check(b->fd, sb, idx, part);
+		if (bad < 0) {
+			if (verbose)
+				pr_err("Cannot read backup data from %s\n",
+				       b->devname);
+			goto out;
+		}
+		if (!bad)
+			continue;
+		if (backup_part_needed(sb, part, info)) {
+			if (verbose)
+				pr_err("Backup data does not match its checksums on %s\n",
+				       b->devname);
+			goto out;
+		}
+		if (verbose)
+			pr_err("Ignoring damaged %sbackup on %s, it is not needed\n",
+			       part ? "second " : "", b->devname);
+		len[part] = 0;
+	}
+
+	printf("%s: restoring critical section\n", Name);
+	select_parity_algorithms(verbose);
+
+	rv = -1;
+	*restored = 0;
+	for (part = 0; part < parts; part++) {
+		if (len[part] == 0)
+			continue;
+		if (restore_stripes(fdlist, offsets, info->array.raid_disks,
+				    info->new_chunk, info->new_level,
+				    info->new_layout, b->fd,
+				    data[part] ? 0 : start[part],
+				    __le64_to_cpu(part ? sb->arraystart2
+						  : sb->arraystart)*512,
+				    len[part], data[part])) {
+			/* didn't succeed, so giveup */
+			if (verbose)
+				pr_err("Error restoring %sbackup from %s\n",
+				       part ? "second " : "", b->devname);
+			goto out;
+		}
+		*restored |= 1 << part;
+	}
+	rv = 0;
+out:
+	free(data[0]);
+	free(data[1]);
+	return rv;
+}
+
 /*
  * If any spare contains md_back_data-1 which is recent wrt mtime,
  * write that data into the array and update the super blocks with
@@ -4687,12 +5457,18 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist,
 		 int cnt, char *backup_file, int verbose)
 {
-	int i, j;
+	int i, j, n;
 	int old_disks;
-	unsigned long long *offsets;
+	unsigned long long *offsets = NULL;
 	unsigned long long  nstripe, ostripe;
 	int ndata, odata;
-	int fd, backup_fd = -1;
+	int backup_fd = -1;
+	struct backup_found *found = NULL;
+	int nfound = 0;
+	struct stripe_io *io = NULL;
+	struct iovec *iov = NULL;
+	struct mdinfo dinfo;
+	int rv = 1;
 
 	odata = info->array.raid_disks - info->delta_disks - 1;
 	if (info->array.level == 6)
@@ -4718,199 +5494,150 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist,
 		}
 	}
 
+	/* Find every copy of the backup and read all the backup-super-blocks
+	 * at once.  Each spare may have some saved data on it, as may the
+	 * backup file.
+	 */
+	if (posix_memalign((void **)&found, 4096, cnt * sizeof(*found)))
+		goto out;
+	memset(found, 0, cnt * sizeof(*found));
+	io = xcalloc(cnt, sizeof(*io));
+	iov = xcalloc(cnt, sizeof(*iov));
 	for (i=old_disks-(backup_file?1:0); i<cnt; i++) {
-		struct mdinfo dinfo;
-		int bsbsize;
-		char *devname, namebuf[20];
-		unsigned long long lo, hi;
+		struct backup_found *b = &found[nfound];
 
-		/* This was a spare and may have some saved data on it.
-		 * Load the superblock, find and load the
-		 * backup_super_block.
-		 * If either fail, go on to next device.
-		 * If the backup contains no new info, just return
-		 * else restore data and update all superblocks
-		 */
 		if (i == old_disks-1) {
 			if (!is_fd_valid(backup_fd))
 				continue;
-			fd = backup_fd;
-			devname = backup_file;
+			b->fd = backup_fd;
+			b->devname = backup_file;
+			b->offset = 0;
 		} else {
-			fd = fdlist[i];
-			if (fd < 0)
+			b->fd = fdlist[i];
+			if (b->fd < 0)
 				continue;
-			if (st->ss->load_super(st, fd, NULL))
+			if (st->ss->load_super(st, b->fd, NULL))
 				continue;
 
 			st->ss->getinfo_super(st, &dinfo, NULL);
 			st->ss->free_super(st);
 
-			if (lseek64(fd,
-				    (dinfo.data_offset + dinfo.component_size - 8) <<9,
-				    0) < 0) {
-				pr_err("Cannot seek on device %d\n", i);
-				continue; /* Cannot seek */
-			}
-			sprintf(namebuf, "device-%d", i);
-			devname = namebuf;
+			b->offset = (dinfo.data_offset +
+				     dinfo.component_size - 8) << 9;
+			sprintf(b->namebuf, "device-%d", i);
+			b->devname = b->namebuf;
 		}
-		if (read(fd, &bsb, sizeof(bsb)) != sizeof(bsb)) {
+		iov[nfound].iov_base = &b->sb;
+		iov[nfound].iov_len = sizeof(b->sb);
+		io[nfound].fd = b->fd;
+		io[nfound].op = STRIPE_IO_READ;
+		io[nfound].iov = &iov[nfound];
+		io[nfound].iovcnt = 1;
+		io[nfound].offset = b->offset;
+		nfound++;
+	}
+	stripe_io_submit(io, nfound);
+
+	/* There should be a duplicate backup superblock 4k before the data
+	 * of each one worth having, with the crc index after it.
+	 */
+	for (i = 0, n = 0; i < nfound; i++) {
+		struct backup_found *b = &found[i];
+
+		if (io[i].res != (ssize_t)sizeof(b->sb)) {
 			if (verbose)
-				pr_err("Cannot read from %s\n", devname);
+				pr_err("Cannot read from %s\n", b->devname);
 			continue; /* Cannot read */
 		}
-		if (memcmp(bsb.magic, "md_backup_data-1", 16) != 0 &&
-		    memcmp(bsb.magic, "md_backup_data-2", 16) != 0) {
-			if (verbose)
-				pr_err("No backup metadata on %s\n", devname);
+		if (!backup_usable(&b->sb, info, b->devname, verbose))
+			continue;
+		if (posix_memalign((void **)&b->head, 4096, 4096)) {
+			b->head = NULL;
 			continue;
 		}
-		if (bsb.sb_csum != bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum)-((char*)&bsb))) {
-			if (verbose)
-				pr_err("Bad backup-metadata checksum on %s\n",
-				       devname);
-			continue; /* bad checksum */
-		}
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0 &&
-		    bsb.sb_csum2 != bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum2)-((char*)&bsb))) {
-			if (verbose)
-				pr_err("Bad backup-metadata checksum2 on %s\n",
-				       devname);
-			continue; /* Bad second checksum */
-		}
-		if (memcmp(bsb.set_uuid,info->uuid, 16) != 0) {
-			if (verbose)
-				pr_err("Wrong uuid on backup-metadata on %s\n",
-				       devname);
-			continue; /* Wrong uuid */
-		}
-
-		/*
-		 * array utime and backup-mtime should be updated at
-		 * much the same time, but it seems that sometimes
-		 * they aren't... So allow considerable flexability in
-		 * matching, and allow this test to be overridden by
-		 * an environment variable.
-		 */
-		if(time_after(info->array.utime, (unsigned int)__le64_to_cpu(bsb.mtime) + 2*60*60) ||
-		   time_before(info->array.utime, (unsigned int)__le64_to_cpu(bsb.mtime) - 10*60)) {
-			if (check_env("MDADM_GROW_ALLOW_OLD")) {
-				pr_err("accepting backup with timestamp %lu for array with timestamp %lu\n",
-					(unsigned long)__le64_to_cpu(bsb.mtime),
-					(unsigned long)info->array.utime);
-			} else {
-				pr_err("too-old timestamp on backup-metadata on %s\n", devname);
-				pr_err("If you think it is should be safe, try 'export MDADM_GROW_ALLOW_OLD=1'\n");
-				continue; /* time stamp is too bad */
-			}
-		}
+		b->usable = 1;
+		iov[i].iov_base = b->head;
+		iov[i].iov_len = 4096;
+		io[n] = io[i];
+		io[n].iov = &iov[i];
+		io[n].offset = __le64_to_cpu(b->sb.devstart)*512 - 4096;
+		n++;
+	}
+	stripe_io_submit(io, n);
+	for (i = 0, n = 0; i < nfound; i++) {
+		struct backup_found *b = &found[i];
+		struct mdp_backup_super *head;
+		int bsbsize;
 
-		if (bsb.magic[15] == '1') {
-			if (bsb.length == 0)
-				continue;
-			if (info->delta_disks >= 0) {
-				/* reshape_progress is increasing */
-				if (__le64_to_cpu(bsb.arraystart)
-				    + __le64_to_cpu(bsb.length)
-				    < info->reshape_progress) {
-				nonew:
-					if (verbose)
-						pr_err("backup-metadata found on %s but is not needed\n", devname);
-					continue; /* No new data here */
-				}
-			} else {
-				/* reshape_progress is decreasing */
-				if (__le64_to_cpu(bsb.arraystart) >=
-				    info->reshape_progress)
-					goto nonew; /* No new data here */
-			}
-		} else {
-			if (bsb.length == 0 && bsb.length2 == 0)
-				continue;
-			if (info->delta_disks >= 0) {
-				/* reshape_progress is increasing */
-				if ((__le64_to_cpu(bsb.arraystart)
-				     + __le64_to_cpu(bsb.length)
-				     < info->reshape_progress) &&
-				    (__le64_to_cpu(bsb.arraystart2)
-				     + __le64_to_cpu(bsb.length2)
-				     < info->reshape_progress))
-					goto nonew; /* No new data here */
-			} else {
-				/* reshape_progress is decreasing */
-				if (__le64_to_cpu(bsb.arraystart) >=
-				    info->reshape_progress &&
-				    __le64_to_cpu(bsb.arraystart2) >=
-				    info->reshape_progress)
-					goto nonew; /* No new data here */
-			}
-		}
-		if (lseek64(fd, __le64_to_cpu(bsb.devstart)*512, 0)< 0) {
-		second_fail:
-			if (verbose)
-				pr_err("Failed to verify secondary backup-metadata block on %s\n",
-				       devname);
-			continue; /* Cannot seek */
-		}
-		/* There should be a duplicate backup superblock 4k before here */
-		if (lseek64(fd, -4096, 1) < 0 ||
-		    read(fd, &bsb2, sizeof(bsb2)) != sizeof(bsb2))
-			goto second_fail; /* Cannot find leading superblock */
-		if (bsb.magic[15] == '1')
+		if (!b->usable)
+			continue;
+		head = (struct mdp_backup_super *)b->head;
+		if (b->sb.magic[15] == '1')
 			bsbsize = offsetof(struct mdp_backup_super, pad1);
 		else
 			bsbsize = offsetof(struct mdp_backup_super, pad);
-		if (memcmp(&bsb2, &bsb, bsbsize) != 0)
-			goto second_fail; /* Cannot find leading superblock */
-
-		/* Now need the data offsets for all devices. */
-		offsets = xmalloc(sizeof(*offsets)*info->array.raid_disks);
-		for(j=0; j<info->array.raid_disks; j++) {
-			if (fdlist[j] < 0)
-				continue;
-			if (st->ss->load_super(st, fdlist[j], NULL))
-				/* FIXME should be this be an error */
-				continue;
-			st->ss->getinfo_super(st, &dinfo, NULL);
-			st->ss->free_super(st);
-			offsets[j] = dinfo.data_offset * 512;
-		}
-		printf("%s: restoring critical section\n", Name);
-
-		if (restore_stripes(fdlist, offsets, info->array.raid_disks,
-				    info->new_chunk, info->new_level,
-				    info->new_layout, fd,
-				    __le64_to_cpu(bsb.devstart)*512,
-				    __le64_to_cpu(bsb.arraystart)*512,
-				    __le64_to_cpu(bsb.length)*512, NULL)) {
-			/* didn't succeed, so giveup */
+		if (io[n++].res != 4096 ||
+		    memcmp(head, &b->sb, bsbsize) != 0) {
 			if (verbose)
-				pr_err("Error restoring backup from %s\n",
-					devname);
-			free(offsets);
-			close_fd(&backup_fd);
-			return 1;
+				pr_err("Failed to verify secondary backup-metadata block on %s\n",
+				       b->devname);
+			b->usable = 0;
+			continue; /* Cannot find leading superblock */
 		}
-
-		if (bsb.magic[15] == '2' &&
-		    restore_stripes(fdlist, offsets, info->array.raid_disks,
-				    info->new_chunk, info->new_level,
-				    info->new_layout, fd,
-				    __le64_to_cpu(bsb.devstart)*512 +
-				    __le64_to_cpu(bsb.devstart2)*512,
-				    __le64_to_cpu(bsb.arraystart2)*512,
-				    __le64_to_cpu(bsb.length2)*512, NULL)) {
-			/* didn't succeed, so giveup */
+		if (head->crc_unit &&
+		    !backup_crc_index_ok(head,
+				(struct mdp_backup_crc *)(b->head + 512))) {
 			if (verbose)
-				pr_err("Error restoring second backup from %s\n",
-					devname);
-			free(offsets);
-			close_fd(&backup_fd);
-			return 1;
+				pr_err("Bad backup data checksum index on %s\n",
+				       b->devname);
+			b->usable = 0;
 		}
+	}
 
-		free(offsets);
+	/* Restore the best of them whose data is intact */
+	while (1) {
+		struct backup_found *best = NULL;
+		unsigned long long lo, hi;
+		int restored = 0;
+
+		for (i = 0; i < nfound; i++)
+			if (found[i].usable &&
+			    (!best || backup_better(&found[i], best,
+						    info->delta_disks >= 0)))
+				best = &found[i];
+		if (!best)
+			break;
+		best->usable = 0;
+
+		if (!offsets) {
+			/* Now need the data offsets for all devices. */
+			offsets = xcalloc(info->array.raid_disks,
+					  sizeof(*offsets));
+			for(j=0; j<info->array.raid_disks; j++) {
+				if (fdlist[j] < 0)
+					continue;
+				if (st->ss->load_super(st, fdlist[j], NULL))
+					/* FIXME should be this be an error */
+					continue;
+				st->ss->getinfo_super(st, &dinfo, NULL);
+				st->ss->free_super(st);
+				offsets[j] = dinfo.data_offset * 512;
+			}
+		}
+		rv = restore_backup_copy(best, info, fdlist, offsets,
+					 &restored, verbose);
+		if (rv > 0)
+			continue; /* Torn or damaged, try another copy */
+		if (rv < 0) {
+			rv = 1;
+			goto out;
+		}
+		bsb = best->sb;
+		/* Only what was restored moves reshape_progress */
+		if (!(restored & 1))
+			bsb.length = __cpu_to_le64(0);
+		if (!(restored & 2))
+			bsb.length2 = __cpu_to_le64(0);
 
 		/* Ok, so the data is restored. Let's update those superblocks. */
 
@@ -4931,30 +5658,13 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist,
 			else
 				lo = lo1;
 		}
-		if (lo < hi && (info->reshape_progress < lo ||
-				info->reshape_progress > hi))
+		if (lo == hi || info->reshape_progress < lo ||
+		    info->reshape_progress > hi)
 			/* backup does not affect reshape_progress*/ ;
-		else if (info->delta_disks >= 0) {
-			info->reshape_progress = __le64_to_cpu(bsb.arraystart) +
-				__le64_to_cpu(bsb.length);
-			if (bsb.magic[15] == '2') {
-				unsigned long long p2;
-
-				p2 = __le64_to_cpu(bsb.arraystart2) +
-					__le64_to_cpu(bsb.length2);
-				if (p2 > info->reshape_progress)
-					info->reshape_progress = p2;
-			}
-		} else {
-			info->reshape_progress = __le64_to_cpu(bsb.arraystart);
-			if (bsb.magic[15] == '2') {
-				unsigned long long p2;
-
-				p2 = __le64_to_cpu(bsb.arraystart2);
-				if (p2 < info->reshape_progress)
-					info->reshape_progress = p2;
-			}
-		}
+		else
+			info->reshape_progress =
+				backup_reach(&bsb, info->delta_disks >= 0,
+					     restored);
 		for (j=0; j<info->array.raid_disks; j++) {
 			if (fdlist[j] < 0)
 				continue;
@@ -4968,11 +5678,20 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist,
 			st->ss->store_super(st, fdlist[j]);
 			st->ss->free_super(st);
 		}
-		close_fd(&backup_fd);
-		return 0;
+		rv = 0;
+		goto out;
 	}
-
+	rv = -1; /* nothing restored */
+out:
+	for (i = 0; found && i < nfound; i++)
+		free(found[i].head);
+	free(found);
+	free(offsets);
+	free(io);
+	free(iov);
 	close_fd(&backup_fd);
+	if (rv >= 0)
+		return rv;
 
 	/* Didn't find any backup data, try to see if any
 	 * was needed.
@@ -5239,7 +5958,8 @@ int Grow_continue(int mdfd, struct supertype *st, struct mdinfo *info,
 	} else
 		ret_val = reshape_array(NULL, mdfd, "array", st, info, 1,
 					NULL, INVALID_SECTORS, c->backup_file,
-					0, forked, 1 | info->reshape_active);
+					0, forked, 1 | info->reshape_active,
+					c->reshape_max_suspend_ms);
 
 	return ret_val;
 }
@@ -175,6 +175,7 @@ struct option long_options[] = {
 	{"no-degraded", 0, 0, NoDegraded},
 	{"wait", 0, 0,  WaitOpt},
 	{"wait-clean", 0, 0, Waitclean},
+	{"monitor-stats", 0, 0, MonitorStats},
 	{"action", 1, 0, Action},
 	{"cluster-confirm", 0, 0, ClusterConfirm},
 
@@ -200,12 +201,15 @@ struct option long_options[] = {
 	{"pid-file", 1, 0, 'i'},
 	{"syslog", 0, 0, 'y'},
 	{"no-sharing", 0, 0, NoSharing},
+	{"tune", 0, 0, Tune},
+	{"sync-latency-target", 1, 0, SyncLatency},
 
 	/* For Grow */
 	{"backup-file", 1, 0, BackupFile},
 	{"invalid-backup", 0, 0, InvalidBackup},
 	{"array-size", 1, 0, 'Z'},
 	{"continue", 0, 0, Continue},
+	{"reshape-max-suspend-ms", 1, 0, ReshapeMaxSuspend},
 
 	/* For Incremental */
 	{"rebuild-map", 0, 0, RebuildMapOpt},
@@ -467,6 +471,7 @@ char Help_misc[] =
 "  --test        -t   : exit status 0 if ok, 1 if degrade, 2 if dead, 4 if missing\n"
 "  --wait        -W   : wait for resync/rebuild/recovery to finish\n"
 "  --action=          : initiate or abort ('idle' or 'frozen') a 'check' or 'repair'.\n"
+"  --monitor-stats    : show mdmon's latency statistics for external metadata\n"
 ;
 
 char Help_monitor[] =
@@ -494,6 +499,10 @@ char Help_monitor[] =
 "  --pid-file=   -i   : In daemon mode write pid to specified file instead of stdout\n"
 "  --oneshot     -1   : Check for degraded arrays, then exit\n"
 "  --test        -t   : Generate a TestMessage event against each array at startup\n"
+"  --tune             : Adjust the stripe cache and worker threads of RAID4/5/6\n"
+"                     : arrays to the load\n"
+"  --sync-latency-target= : Slow resync and recovery down to keep the latency of\n"
+"                     : other IO to the array under this many milliseconds\n"
 ;
 
 char Help_grow[] =
@@ -525,6 +534,9 @@ char Help_grow[] =
 "                        : when changing parameters other than raid-devices\n"
 "  --array-size=      -Z : Change visible size of array. This does not change any\n"
 "                        : data on the device, and is not stable across restarts.\n"
+"  --reshape-max-suspend-ms= : Size the region suspended during a reshape with\n"
+"                        : a backup from the measured reshape speed, so that\n"
+"                        : IO is not held up for much longer than this.\n"
 "  --data-offset=        : Location on device to move start of data to.\n"
 "  --consistency-policy= : Change the consistency policy of an active array.\n"
 "                     -k : Currently works only for PPL with RAID5.\n"
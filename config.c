@@ -83,7 +83,7 @@ char DefaultAltConfDir[] = CONFFILE2 ".d";
 
 enum linetype { Devices, Array, Mailaddr, Mailfrom, Program, CreateDev,
 		Homehost, HomeCluster, AutoMode, Policy, PartPolicy, Sysfs,
-		MonitorDelay, EncryptionNoVerify, LTEnd };
+		MonitorDelay, EncryptionNoVerify, Checkpoint, LTEnd };
 char *keywords[] = {
 	[Devices]  = "devices",
 	[Array]    = "array",
@@ -99,6 +99,7 @@ char *keywords[] = {
 	[Sysfs]    = "sysfs",
 	[MonitorDelay] = "monitordelay",
 	[EncryptionNoVerify] = "ENCRYPTION_NO_VERIFY",
+	[Checkpoint] = "checkpoint",
 	[LTEnd]    = NULL
 };
 
@@ -716,6 +717,28 @@ void encryption_no_verify_line(char *line)
 	}
 }
 
+static struct checkpoint_policy checkpoint_policy;
+void checkpointline(char *line)
+{
+	char *w;
+
+	for (w = dl_next(line); w != line; w = dl_next(w)) {
+		if (strncasecmp(w, "interval=", 9) == 0)
+			checkpoint_policy.interval_ms = strtoul(w + 9, NULL, 10);
+		else if (strncasecmp(w, "advance=", 8) == 0) {
+			unsigned long long s = parse_size(w + 8);
+
+			if (s == INVALID_SECTORS)
+				pr_err("invalid size on CHECKPOINT line: %s\n", w);
+			else
+				checkpoint_policy.min_advance = s;
+		} else if (strcasecmp(w, "adaptive") == 0)
+			checkpoint_policy.adaptive = true;
+		else
+			pr_err("unrecognised word on CHECKPOINT line: %s\n", w);
+	}
+}
+
 char auto_yes[] = "yes";
 char auto_no[] = "no";
 char auto_homehost[] = "homehost";
@@ -903,6 +926,9 @@ void conf_file(FILE *f)
 		case EncryptionNoVerify:
 			encryption_no_verify_line(line);
 			break;
+		case Checkpoint:
+			checkpointline(line);
+			break;
 		default:
 			pr_err("Unknown keyword %s\n", line);
 		}
@@ -1072,6 +1098,12 @@ bool conf_get_sata_opal_encryption_no_verify(void)
 	return sata_opal_encryption_no_verify;
 }
 
+void conf_get_checkpoint_policy(struct checkpoint_policy *cp)
+{
+	load_conffile();
+	*cp = checkpoint_policy;
+}
+
 struct createinfo *conf_get_create_info(void)
 {
 	load_conffile();
@@ -29,6 +29,12 @@
 #include <sys/types.h>
 #include <asm/types.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__TINYC__)
+#define CRC32C_X86 1
+#endif
 
 /*
  * There are multiple 16-bit CRC polynomials in common use, but this is
@@ -71,9 +77,81 @@ __u32 crc32_le(__u32 crc, unsigned char const *p, size_t len)
 	return crc32_le_generic(crc, p, len, CRCPOLY_LE);
 }
 
+/*
+ * crc32c is also used over whole reshape backups, so it gets the
+ * slicing-by-8 tables, or the SSE4.2 instruction where there is one.
+ */
+static __u32 crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_make_table(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		unsigned char b = i;
+
+		crc32c_table[0][i] = crc32_le_generic(0, &b, 1, CRC32C_POLY_LE);
+	}
+	for (j = 1; j < 8; j++)
+		for (i = 0; i < 256; i++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+static __u32 crc32c_le_slice8(__u32 crc, unsigned char const *p, size_t len)
+{
+	__u32 (*t)[256] = crc32c_table;
+
+	pthread_once(&crc32c_table_once, crc32c_make_table);
+	while (len >= 8) {
+		__u32 lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+				  (__u32)p[3] << 24);
+
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+			t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+			t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static __u32 crc32c_le_sse42(__u32 crc, unsigned char const *p, size_t len)
+{
+	unsigned long long c;
+
+	while (len && ((unsigned long)p & 7)) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		len--;
+	}
+	c = crc;
+	while (len >= 8) {
+		unsigned long long v;
+
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = c;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#endif
+
 __u32 crc32c_le(__u32 crc, unsigned char const *p, size_t len)
 {
-	return crc32_le_generic(crc, p, len, CRC32C_POLY_LE);
+#ifdef CRC32C_X86
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_le_sse42(crc, p, len);
+#endif
+	return crc32c_le_slice8(crc, p, len);
 }
 
 /**
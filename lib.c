@@ -590,6 +590,19 @@ int parse_num(int *dest, const char *num)
 	return 0;
 }
 
+/**
+ * monotonic_ms() - milliseconds from CLOCK_MONOTONIC.
+ *
+ * For measuring intervals, unaffected by changes to the wall clock.
+ */
+unsigned long long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**
  * s_gethostname() - secure get hostname. Assure null-terminated string.
  *
@@ -208,14 +208,18 @@ static void replace_array(struct supertype *container,
 	 */
 	remove_old();
 	while (pending_discard) {
-		while (discard_this == NULL)
-			sleep_for(1, 0, true);
+		unsigned int seen = __atomic_load_n(&mon_events,
+						    __ATOMIC_ACQUIRE);
+
+		if (discard_this == NULL)
+			mdmon_futex_wait(&mon_events, seen);
 		remove_old();
 	}
 	pending_discard = old;
 	new->replaces = old;
 	new->next = container->arrays;
 	container->arrays = new;
+	__atomic_add_fetch(&arrays_gen, 1, __ATOMIC_RELEASE);
 	wakeup_monitor();
 }
 
@@ -879,23 +883,31 @@ static void handle_message(struct supertype *container, struct metadata_update *
 	struct metadata_update *mu;
 
 	if (msg->len <= 0)
-		while (update_queue_pending || update_queue) {
+		while (1) {
+			unsigned int seen = __atomic_load_n(&mon_events,
+							    __ATOMIC_ACQUIRE);
+
 			check_update_queue(container);
-			sleep_for(0, MSEC_TO_NSEC(15), true);
+			if (!update_queue_pending && !update_queue)
+				break;
+			mdmon_futex_wait(&mon_events, seen);
 		}
 
 	if (msg->len == 0) { /* ping_monitor */
-		int cnt;
+		int cnt, now;
 
-		cnt = monitor_loop_cnt;
+		__atomic_store_n(&monitor_loop_waiter, 1, __ATOMIC_SEQ_CST);
+		cnt = __atomic_load_n(&monitor_loop_cnt, __ATOMIC_SEQ_CST);
 		if (cnt & 1)
 			cnt += 2; /* wait until next pselect */
 		else
 			cnt += 3; /* wait for 2 pselects */
 		wakeup_monitor();
 
-		while (monitor_loop_cnt - cnt < 0)
-			sleep_for(0, MSEC_TO_NSEC(10), true);
+		while ((now = __atomic_load_n(&monitor_loop_cnt,
+					      __ATOMIC_SEQ_CST)) - cnt < 0)
+			mdmon_futex_wait(&monitor_loop_cnt, now);
+		__atomic_store_n(&monitor_loop_waiter, 0, __ATOMIC_SEQ_CST);
 	} else if (msg->len == -1) { /* ping_manager */
 		struct mdstat_ent *mdstat = mdstat_read(1, 0);
 
@@ -916,6 +928,69 @@ static void handle_message(struct supertype *container, struct metadata_update *
 	}
 }
 
+static void stats_hist(FILE *f, char *devnm, char *name, struct mon_hist *h)
+{
+	int i;
+
+	fprintf(f, "%s.%s.count=%llu\n", devnm, name, h->count);
+	fprintf(f, "%s.%s.avg=%llu\n", devnm, name,
+		h->count ? h->total_us / h->count : 0);
+	fprintf(f, "%s.%s.max=%llu\n", devnm, name, h->max_us);
+	/* the non-empty buckets, by their upper bound */
+	fprintf(f, "%s.%s.hist=", devnm, name);
+	for (i = 0; i < MON_HIST_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		if (i == MON_HIST_BUCKETS - 1)
+			fprintf(f, " inf:%llu", h->bucket[i]);
+		else
+			fprintf(f, " %llu:%llu", 1ULL << (i + 1), h->bucket[i]);
+	}
+	fprintf(f, "\n");
+}
+
+/*
+ * The reply to MSG_MONITOR_STATS: "key=value" lines, those of each
+ * array prefixed with its name.  Times are in microseconds.  The
+ * counters are read while the monitor may be updating them, which at
+ * worst makes one sample look a little off.
+ */
+static char *stats_text(struct supertype *container)
+{
+	struct active_array *a;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	f = open_memstream(&buf, &len);
+	if (!f)
+		return NULL;
+	fprintf(f, "container=%s\n", container->devnm);
+	fprintf(f, "wakeups=%llu\n", mon_stats.wakeups);
+	fprintf(f, "spurious_wakeups=%llu\n", mon_stats.spurious_wakeups);
+	fprintf(f, "metadata_syncs=%llu\n", mon_stats.metadata_syncs);
+	fprintf(f, "metadata_bytes_written=%llu\n", container->metadata_bytes);
+	for (a = container->arrays; a; a = a->next) {
+		char *devnm = a->info.sys_name;
+
+		if (!a->container || a->to_remove || a->replaces)
+			continue;
+		fprintf(f, "%s.write_pending=%llu\n", devnm,
+			a->stats.write_pending);
+		stats_hist(f, devnm, "write_pending_us",
+			   &a->stats.write_pending_us);
+		stats_hist(f, devnm, "read_and_act_us",
+			   &a->stats.read_and_act_us);
+		stats_hist(f, devnm, "sync_metadata_us",
+			   &a->stats.sync_metadata_us);
+	}
+	if (fclose(f) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
 void read_sock(struct supertype *container)
 {
 	int fd;
@@ -944,6 +1019,14 @@ void read_sock(struct supertype *container)
 
 		/* read and validate the message */
 		if (receive_message(fd, &msg, tmo) == 0) {
+			if (msg.len == MSG_MONITOR_STATS) {
+				msg.buf = stats_text(container);
+				msg.len = msg.buf ? strlen(msg.buf) + 1 : 0;
+				if (send_message(fd, &msg, tmo) < 0)
+					terminate = 1;
+				free(msg.buf);
+				continue;
+			}
 			handle_message(container, &msg);
 			if (msg.len == 0) {
 				/* ping reply with version */
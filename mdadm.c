@@ -288,6 +288,7 @@ int main(int argc, char *argv[])
 		case 'W':
 		case WaitOpt:
 		case Waitclean:
+		case MonitorStats:
 		case DetailPlatform:
 		case KillSubarray:
 		case UpdateSubarray:
@@ -298,6 +299,8 @@ int main(int argc, char *argv[])
 			break;
 
 		case NoSharing:
+		case Tune:
+		case SyncLatency:
 			newmode = MONITOR;
 			break;
 		}
@@ -892,6 +895,17 @@ int main(int argc, char *argv[])
 				exit(2);
 			}
 			continue;
+		case O(MONITOR, Tune):
+			c.tune = 1;
+			continue;
+		case O(MONITOR, SyncLatency):
+			if (parse_num(&c.sync_latency_ms, optarg) != 0 ||
+			    c.sync_latency_ms < 1) {
+				pr_err("invalid --sync-latency-target: %s\n",
+				       optarg);
+				exit(2);
+			}
+			continue;
 		case O(MONITOR,'f'): /* daemonise */
 		case O(MONITOR,Fork):
 			daemonise = 1;
@@ -1003,6 +1017,7 @@ int main(int argc, char *argv[])
 		case O(MISC,'W'):
 		case O(MISC, WaitOpt):
 		case O(MISC, Waitclean):
+		case O(MISC, MonitorStats):
 		case O(MISC, DetailPlatform):
 		case O(MISC, KillSubarray):
 		case O(MISC, UpdateSubarray):
@@ -1104,6 +1119,19 @@ int main(int argc, char *argv[])
 			c.backup_file = optarg;
 			continue;
 
+		case O(ASSEMBLE, ReshapeMaxSuspend):
+		case O(GROW, ReshapeMaxSuspend):
+			/* Bound on how long a reshape with a backup may
+			 * keep IO suspended
+			 */
+			if (parse_num(&c.reshape_max_suspend_ms, optarg) != 0 ||
+			    c.reshape_max_suspend_ms < 1) {
+				pr_err("invalid --reshape-max-suspend-ms: %s\n",
+				       optarg);
+				exit(2);
+			}
+			continue;
+
 		case O(GROW, Continue):
 			/* Continue interrupted grow
 			 */
@@ -1913,6 +1941,9 @@ static int misc_list(struct mddev_dev *devlist,
 		case Waitclean:
 			rv |= WaitClean(dv->devname, c->verbose);
 			continue;
+		case MonitorStats:
+			rv |= Monitor_stats(dv->devname, c->verbose);
+			continue;
 		case KillSubarray:
 			rv |= Kill_subarray(dv->devname, c->subarray, c->verbose);
 			continue;
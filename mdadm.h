@@ -544,6 +544,10 @@ enum special_options {
 	ClusterConfirm,
 	WriteJournal,
 	ConsistencyPolicy,
+	ReshapeMaxSuspend,
+	Tune,
+	SyncLatency,
+	MonitorStats,
 };
 
 enum update_opt {
@@ -684,6 +688,9 @@ struct context {
 	char	*action;
 	int	nodes;
 	char	*homecluster;
+	int	reshape_max_suspend_ms;
+	int	tune;
+	int	sync_latency_ms;
 };
 
 struct shape {
@@ -867,6 +874,14 @@ extern int sysfs_unique_holder(char *devnm, long rdev);
 extern int sysfs_freeze_array(struct mdinfo *sra);
 extern int sysfs_wait(int fd, int *msec);
 extern int load_sys(char *path, char *buf, int len);
+
+/* The parts of /sys/block/<devnm>/stat that are used */
+struct blkstat {
+	unsigned long long rd_ios, rd_sectors, rd_ticks;
+	unsigned long long wr_ios, wr_sectors, wr_ticks;
+	unsigned long long in_flight, io_ticks;
+};
+extern int sysfs_get_blkstat(char *devnm, struct blkstat *bs);
 extern int zero_disk_range(int fd, unsigned long long sector, size_t count);
 extern int reshape_prepare_fdlist(char *devname,
 				  struct mdinfo *sra,
@@ -902,6 +917,76 @@ extern int restore_stripes(int *dest, unsigned long long *offsets,
 			   int source, unsigned long long read_offset,
 			   unsigned long long start, unsigned long long length,
 			   char *src_buf);
+
+/* The placement of data, P and Q for one array geometry, computed once
+ * with geo_map() over a whole rotation of the layout.  Use the
+ * stripe_map_*() helpers to get the row for a particular stripe.
+ */
+struct stripe_map {
+	int raid_disks, level, layout;
+	int data_disks;
+	int syndrome_disks;	/* RAID-6 only */
+	int period;		/* stripes before the layout repeats */
+	int *disk;	/* per stripe: [block + 2] -> raid disk, block -2 is Q,
+			 * -1 is P.  -1 if not present.
+			 */
+	int *block;	/* per stripe: [raid disk] -> block, as above */
+	int *syndrome;	/* per stripe: [syndrome slot] -> raid disk */
+	struct stripe_map *next;
+};
+
+extern struct stripe_map *stripe_map_get(int raid_disks, int level,
+					 int layout);
+
+static inline int stripe_map_row(const struct stripe_map *map,
+				 unsigned long long stripe)
+{
+	return map->period == 1 ? 0 : stripe % map->period;
+}
+
+/* Indexed by block number, from -2 (Q) to data_disks - 1 */
+static inline const int *stripe_map_disks(const struct stripe_map *map,
+					  unsigned long long stripe)
+{
+	return map->disk + stripe_map_row(map, stripe) *
+		(map->data_disks + 2) + 2;
+}
+
+static inline const int *stripe_map_blocks(const struct stripe_map *map,
+					   unsigned long long stripe)
+{
+	return map->block + stripe_map_row(map, stripe) * map->raid_disks;
+}
+
+static inline const int *stripe_map_syndrome(const struct stripe_map *map,
+					     unsigned long long stripe)
+{
+	return map->syndrome + stripe_map_row(map, stripe) *
+		map->syndrome_disks;
+}
+
+enum stripe_io_op {
+	STRIPE_IO_READ,
+	STRIPE_IO_WRITE,
+	STRIPE_IO_SYNC,		/* fdatasync(), no data */
+};
+
+/* A vectored read or write, or a flush, for stripe_io_submit() */
+struct stripe_io {
+	int fd;
+	enum stripe_io_op op;
+	const struct iovec *iov;
+	int iovcnt;
+	unsigned long long offset;
+	ssize_t res;	/* bytes transferred or -errno */
+};
+
+extern void stripe_io_submit(struct stripe_io *io, int cnt);
+extern void stripe_io_no_threads(void);
+extern const char *stripe_io_engine_name(void);
+
+extern void select_parity_algorithms(int verbose);
+extern void print_parity_algorithms(void);
 extern bool sysfs_is_libata_allow_tpm_enabled(const int verbose);
 
 #ifndef Sendmail
@@ -989,6 +1074,15 @@ struct reshape {
 	unsigned long long min_offset_change;
 	unsigned long long stripes; /* number of old stripes that comprise 'blocks'*/
 	unsigned long long new_size; /* New size of array in sectors */
+	/* With max_suspend_ms set, the suspended region and the backup
+	 * windows are sized from the measured reshape speed so that IO is
+	 * not held up for longer than that.
+	 */
+	unsigned int max_suspend_ms;
+	unsigned long long rate; /* reshape speed, array sectors per second */
+	unsigned long long backup_rate; /* backup speed, likewise */
+	/* sectors and ms of samples too short to use on their own */
+	unsigned long long rate_pending[2], backup_pending[2];
 };
 
 /**
@@ -1418,6 +1512,7 @@ struct supertype {
 			 */
 	int devcnt;
 	int retry_soon;
+	unsigned long long metadata_bytes; /* written, for mdmon statistics */
 	int nodes;
 	char *cluster_name;
 
@@ -1624,6 +1719,7 @@ extern int Kill_subarray(char *dev, char *subarray, int verbose);
 extern int Update_subarray(char *dev, char *subarray, enum update_opt update, struct mddev_ident *ident, int quiet);
 extern int Wait(char *dev);
 extern int WaitClean(char *dev, int verbose);
+extern int Monitor_stats(char *dev, int verbose);
 extern int SetAction(char *dev, char *action);
 
 extern int Incremental(struct mddev_dev *devlist, struct context *c,
@@ -1714,6 +1810,14 @@ extern char *conf_get_homehost(int *require_homehostp);
 extern char *conf_get_homecluster(void);
 extern int conf_get_monitor_delay(void);
 extern bool conf_get_sata_opal_encryption_no_verify(void);
+
+/* When mdmon records resync/reshape progress, from a CHECKPOINT line */
+struct checkpoint_policy {
+	unsigned int interval_ms;	/* since the last checkpoint */
+	unsigned long long min_advance;	/* sectors of progress */
+	bool adaptive;			/* scale with the cost of a checkpoint */
+};
+extern void conf_get_checkpoint_policy(struct checkpoint_policy *cp);
 extern char *conf_line(FILE *file);
 extern char *conf_word(FILE *file, int allow_key);
 extern void print_quoted(char *str);
@@ -1821,6 +1925,15 @@ extern int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 			 int *fds, unsigned long long *offsets,
 			 int dests, int *destfd, unsigned long long *destoffsets);
 void abort_reshape(struct mdinfo *sra);
+extern void reshape_report_start(char *devnm, unsigned long long done,
+				 unsigned long long total);
+extern void reshape_report_progress(unsigned long long done,
+				    unsigned long long suspend_lo,
+				    unsigned long long suspend_hi);
+extern void reshape_report_done(unsigned long long done);
+extern void reshape_report_backup(unsigned long long bytes);
+extern void reshape_report_sync(unsigned long long ms);
+extern void reshape_report_end(const char *state);
 
 void *super1_make_v0(struct supertype *st, struct mdinfo *info, mdp_super_t *sb0);
 
@@ -1877,6 +1990,7 @@ extern void sleep_for(unsigned int sec, long nsec, bool wake_after_interrupt);
 extern bool is_directory(const char *path);
 extern bool is_file(const char *path);
 extern int s_gethostname(char *buf, int buf_len);
+extern unsigned long long monotonic_ms(void);
 
 #define _ROUND_UP(val, base)	(((val) + (base) - 1) & ~(base - 1))
 #define ROUND_UP(val, base)	_ROUND_UP(val, (typeof(val))(base))
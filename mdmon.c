@@ -52,6 +52,8 @@
 #include	<sys/mman.h>
 #include	<sys/syscall.h>
 #include	<sys/wait.h>
+#include	<linux/futex.h>
+#include	<limits.h>
 #include	<stdio.h>
 #include	<errno.h>
 #include	<string.h>
@@ -71,11 +73,31 @@ char const Name[] = "mdmon";
 
 struct active_array *discard_this;
 struct active_array *pending_discard;
+unsigned int arrays_gen;
+unsigned int mon_events;
+struct checkpoint_policy checkpoint_policy;
 
 int mon_tid, mgr_tid;
 
 int sigterm;
 
+/*
+ * The manager waits for the monitor on a futex rather than by polling.
+ * The waits are bounded, so a missed wakeup only costs what polling did.
+ */
+void mdmon_futex_wake(void *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Wait while *word is still 'val', for up to a second */
+void mdmon_futex_wait(void *word, unsigned int val)
+{
+	struct timespec ts = { 1, 0 };
+
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
 #ifdef USE_PTHREADS
 static void *run_child(void *v)
 {
@@ -310,6 +332,7 @@ static int mdmon(char *devnm, int must_fork, int takeover);
 int main(int argc, char *argv[])
 {
 	char *container_name = NULL;
+	char *config;
 	int status = 0;
 	int opt;
 	int all = 0;
@@ -332,6 +355,11 @@ int main(int argc, char *argv[])
 	 */
 	imsm_set_no_platform(1);
 
+	/* Read a private configuration rather than mdadm's, for testing */
+	config = getenv("MDMON_CONFIG");
+	if (config && *config)
+		set_conffile(config);
+
 	while ((opt = getopt_long(argc, argv, "thaF", options, NULL)) != -1) {
 		switch (opt) {
 		case 'a':
@@ -570,6 +598,9 @@ static int mdmon(char *devnm, int must_fork, int takeover)
 		close(pfd[1]);
 	}
 
+	conf_get_checkpoint_policy(&checkpoint_policy);
+
+	stripe_io_no_threads();
 	mlockall(MCL_CURRENT | MCL_FUTURE);
 
 	if (clone_monitor(container) < 0) {
@@ -25,6 +25,28 @@ enum array_state { clear, inactive, suspended, readonly, read_auto,
 
 enum sync_action { idle, reshape, resync, recover, check, repair, bad_action };
 
+/* Bucket i counts times of 2^i to 2^(i+1) microseconds, the last any longer */
+#define MON_HIST_BUCKETS 24
+
+struct mon_hist {
+	unsigned long long count, total_us, max_us;
+	unsigned long long bucket[MON_HIST_BUCKETS];
+};
+
+/* Kept by the monitor, reported over the socket by the manager */
+struct mon_array_stats {
+	unsigned long long write_pending; /* transitions to active */
+	struct mon_hist write_pending_us; /* from the wakeup to "active" */
+	struct mon_hist read_and_act_us;
+	struct mon_hist sync_metadata_us;
+};
+
+struct mon_stats {
+	unsigned long long wakeups;
+	unsigned long long spurious_wakeups; /* nothing had changed */
+	unsigned long long metadata_syncs; /* sync_metadata() calls */
+};
+
 struct active_array {
 	struct mdinfo info;
 	struct supertype *container;
@@ -56,6 +78,18 @@ struct active_array {
 	 * Monitor must acknowledge faulty state first.
 	 */
 	bool check_member_remove : 1;
+
+	bool woken; /* an attribute fired, set and cleared by mon */
+
+	/* left by read_and_act() for effect_changes(), mon only */
+	bool act_pending, act_deactivate;
+	bool act_check_degraded, act_check_reshape, act_checkpoint;
+	unsigned long long act_us;
+
+	/* when progress was last recorded, and what the metadata write cost */
+	unsigned long long checkpoint_ms, checkpoint_bytes;
+
+	struct mon_array_stats stats;
 };
 
 /*
@@ -76,6 +110,13 @@ extern struct metadata_update *update_queue, *update_queue_handled;
 extern struct active_array *container;
 extern struct active_array *discard_this;
 extern struct active_array *pending_discard;
+/* bumped by the manager whenever it puts an array on the list */
+extern unsigned int arrays_gen;
+/* bumped by the monitor whenever it hands something to the manager */
+extern unsigned int mon_events;
+extern struct checkpoint_policy checkpoint_policy;
+void mdmon_futex_wake(void *word);
+void mdmon_futex_wait(void *word, unsigned int val);
 extern struct md_generic_cmd *active_cmd;
 
 void remove_pidfile(char *devname);
@@ -91,6 +132,8 @@ struct mdstat_ent *mdstat_read(int hold, int start);
 extern int exit_now, manager_ready;
 extern int mon_tid, mgr_tid;
 extern int monitor_loop_cnt;
+extern int monitor_loop_waiter;
+extern struct mon_stats mon_stats;
 
 /* helper routine to determine resync completion since MaxSector is a
  * moving target
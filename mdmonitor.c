@@ -36,6 +36,49 @@
 #define EVENT_NAME_MAX 32
 #define AUTOREBUILD_PID_PATH MDMON_DIR "/autorebuild.pid"
 #define FALLBACK_DELAY 5
+#define PACE_DELAY 5
+
+/**
+ * struct tune_state - what --tune knows about an array.
+ * @ms: time of the last sample, 0 before the first.
+ * @stat: block statistics at the last sample.
+ * @min_cache: stripe_cache_size when first seen, never shrunk below.
+ * @min_threads: group_thread_cnt when first seen.
+ * @idle: samples in a row with the stripe cache mostly unused.
+ * @base_rate: write rate before the last group_thread_cnt change, 0 if
+ *	       the change is not being evaluated.
+ * @prev_threads: group_thread_cnt before that change.
+ * @threads_settled: more threads did not help, leave them until idle.
+ */
+struct tune_state {
+	unsigned long long ms;
+	struct blkstat stat;
+	int min_cache;
+	int min_threads;
+	int idle;
+	unsigned long long base_rate;
+	int prev_threads;
+	int threads_settled;
+};
+
+/**
+ * struct pace_state - what --sync-latency-target knows about an array.
+ * @ms: time of the last sample, 0 before the first.
+ * @stat: block statistics at the last sample.
+ * @max: sync_speed_max set for the array, in K/sec, 0 if the array has
+ *	 its own limits.
+ * @min: sync_speed_min of the array before it was paced, in K/sec, 0 if
+ *	 it followed the system limit.
+ * @admin: sync_speed_max was set by someone else, leave the array alone
+ *	   until the resync ends.
+ */
+struct pace_state {
+	unsigned long long ms;
+	struct blkstat stat;
+	unsigned long long max;
+	unsigned long long min;
+	int admin;
+};
 
 /**
  * struct state - external array or container properties.
@@ -64,6 +107,8 @@ struct state {
 	struct state *subarray;
 	struct state *parent;
 	struct state *next;
+	struct tune_state tune;
+	struct pace_state pace;
 };
 
 struct alert_info {
@@ -133,6 +178,16 @@ static void try_spare_migration(struct state *statelist);
 static void wait_for_events(int *delay_for_event, int c_delay);
 static void wait_for_events_mdstat(int *delay_for_event, int c_delay);
 static int write_autorebuild_pid(void);
+static void tune_array(struct state *st, int verbose);
+static int pace_array(struct state *st, int target_ms, int verbose);
+static void pace_end(struct state *st);
+
+static volatile sig_atomic_t monitor_stop;
+
+static void monitor_term(int sig)
+{
+	monitor_stop = 1;
+}
 
 int Monitor(struct mddev_dev *devlist,
 	    char *mailaddr, char *alert_cmd,
@@ -189,6 +244,7 @@ int Monitor(struct mddev_dev *devlist,
 	char *mailfrom;
 	struct mddev_ident *mdlist;
 	int delay_for_event = c->delay;
+	struct sigaction act;
 
 	if (devlist && c->scan) {
 		pr_err("Devices list and --scan option cannot be combined - not monitoring.\n");
@@ -203,7 +259,8 @@ int Monitor(struct mddev_dev *devlist,
 
 	mailfrom = conf_get_mailfrom();
 
-	if (c->scan && !mailaddr && !alert_cmd && !dosyslog) {
+	if (c->scan && !mailaddr && !alert_cmd && !dosyslog && !c->tune &&
+	    !c->sync_latency_ms) {
 		pr_err("No mail address or alert command - not monitoring.\n");
 		return 1;
 	}
@@ -247,6 +304,15 @@ int Monitor(struct mddev_dev *devlist,
 		if (write_autorebuild_pid() != 0)
 			return 1;
 
+	if (c->sync_latency_ms) {
+		/* give paced arrays their own limits back before exiting */
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = monitor_term;
+		sigaction(SIGTERM, &act, NULL);
+		sigaction(SIGINT, &act, NULL);
+		sigaction(SIGHUP, &act, NULL);
+	}
+
 	if (devlist == NULL) {
 		mdlist = conf_get_ident(NULL);
 		for (; mdlist; mdlist = mdlist->next) {
@@ -296,11 +362,12 @@ int Monitor(struct mddev_dev *devlist,
 		}
 	}
 
-	while (!finished) {
+	while (!finished && !monitor_stop) {
 		int new_found = 0;
 		struct state *st, **stp;
 		int anydegraded = 0;
 		int anyredundant = 0;
+		int pacing;
 
 		if (mdstat)
 			free_mdstat(mdstat);
@@ -318,6 +385,15 @@ int Monitor(struct mddev_dev *devlist,
 				anyredundant = 1;
 		}
 
+		if (c->tune)
+			for (st = statelist; st; st = st->next)
+				tune_array(st, c->verbose);
+		pacing = 0;
+		if (c->sync_latency_ms)
+			for (st = statelist; st; st = st->next)
+				pacing |= pace_array(st, c->sync_latency_ms,
+						     c->verbose);
+
 		/* now check if there are any new devices found in mdstat */
 		if (c->scan)
 			new_found = add_new_arrays(mdstat, &statelist);
@@ -336,13 +412,20 @@ int Monitor(struct mddev_dev *devlist,
 				break;
 			}
 
-			wait_for_events(&delay_for_event, c->delay);
+			if (pacing && delay_for_event > PACE_DELAY) {
+				/* a resync being paced needs a closer look */
+				int delay = PACE_DELAY;
+
+				wait_for_events(&delay, PACE_DELAY);
+			} else
+				wait_for_events(&delay_for_event, c->delay);
 		}
 		info.test = 0;
 
 		for (stp = &statelist; (st = *stp) != NULL; ) {
 			if (st->from_auto && st->err > 5) {
 				*stp = st->next;
+				pace_end(st);
 				if (st->spare_group)
 					free(st->spare_group);
 
@@ -386,7 +469,8 @@ static void wait_for_events_mdstat(int *delay_for_event, int c_delay)
 	int wait_result = mdstat_wait(*delay_for_event);
 
 	if (wait_result < 0) {
-		pr_err("Error while waiting for events on mdstat.\n");
+		if (errno != EINTR)
+			pr_err("Error while waiting for events on mdstat.\n");
 		return;
 	}
 
@@ -1236,6 +1320,7 @@ static void free_statelist(struct state *statelist)
 	struct state *tmp = NULL;
 
 	while (statelist) {
+		pace_end(statelist);
 		if (statelist->spare_group)
 			free(statelist->spare_group);
 
@@ -1245,6 +1330,369 @@ static void free_statelist(struct state *statelist)
 	}
 }
 
+/*
+ * --tune: size the stripe cache and the number of worker threads of
+ * RAID4/5/6 arrays to the load, rather than leaving the default of 256
+ * stripes, which halves the speed of heavy writes, or a static value
+ * that wastes memory while the array is idle.
+ *
+ * Once per pass of the monitor, so once per --delay, but never more
+ * often than every TUNE_INTERVAL_MS:
+ *  - if most of the stripe cache is in use while the array is written,
+ *    double it, as long as it stays within TUNE_MEM_SHARE of the memory
+ *    and what is available leaves room to spare;
+ *  - if it is mostly unused for TUNE_IDLE_SAMPLES passes, halve it, but
+ *    not below what it was when monitoring started;
+ *  - while the cache is under pressure but cannot grow, try one more
+ *    group_thread_cnt step and keep it only if the write rate improves
+ *    by a tenth on the next pass, which changes nothing else.  They go
+ *    back to where they started once the array is idle.
+ * Arrays that are reshaping are left alone, Grow sizes the cache then.
+ */
+#define TUNE_INTERVAL_MS	5000
+#define TUNE_IDLE_SAMPLES	6
+#define TUNE_CACHE_MAX		32768	/* limit in the kernel */
+#define TUNE_MEM_SHARE		16	/* of MemTotal per array */
+#define TUNE_THREADS_MAX	8
+
+static unsigned long long meminfo_bytes(char *buf, const char *key)
+{
+	char *p = strstr(buf, key);
+
+	if (!p)
+		return 0;
+	return strtoull(p + strlen(key), NULL, 10) * 1024;
+}
+
+static int tune_cache_fits(int disks, int from, int to)
+{
+	unsigned long long total, avail, need;
+	char buf[4096];
+	int fd, n;
+
+	fd = open("/proc/meminfo", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = 0;
+	total = meminfo_bytes(buf, "MemTotal:");
+	avail = meminfo_bytes(buf, "MemAvailable:");
+
+	/* every stripe holds a page for each device */
+	need = (unsigned long long)(to - from) * disks * getpagesize();
+	if ((unsigned long long)to * disks * getpagesize() >
+	    total / TUNE_MEM_SHARE)
+		return 0;
+	return avail > 4 * need;
+}
+
+static int tune_set(struct mdinfo *sra, char *name, int from, int to,
+		    int verbose)
+{
+	if (sysfs_set_num(sra, NULL, name, to) != 0)
+		return -1;
+	if (verbose > 0)
+		pr_err("%s: %s %d -> %d\n", sra->sys_name, name, from, to);
+	return 0;
+}
+
+static void tune_array(struct state *st, int verbose)
+{
+	struct tune_state *t = &st->tune;
+	unsigned long long now = monotonic_ms();
+	unsigned long long active, size, threads, disks;
+	unsigned long long wrate;
+	struct mdinfo sra;
+	struct blkstat bs;
+	char buf[SYSFS_MAX_BUF_SIZE];
+	int pressure;
+	int nthreads;
+
+	if (st->devnm[0] == 0 || st->err)
+		return;
+	if (t->ms && now - t->ms < TUNE_INTERVAL_MS)
+		return;
+
+	memset(&sra, 0, sizeof(sra));
+	snprintf(sra.sys_name, sizeof(sra.sys_name), "%s", st->devnm);
+	if (sysfs_get_str(&sra, NULL, "level", buf, sizeof(buf)) <= 0 ||
+	    (strncmp(buf, "raid4", 5) != 0 && strncmp(buf, "raid5", 5) != 0 &&
+	     strncmp(buf, "raid6", 5) != 0))
+		return;
+	if (sysfs_get_str(&sra, NULL, "sync_action", buf, sizeof(buf)) > 0 &&
+	    strncmp(buf, "reshape", 7) == 0) {
+		t->ms = 0;
+		return;
+	}
+	if (sysfs_get_ll(&sra, NULL, "stripe_cache_size", &size) != 0 ||
+	    sysfs_get_ll(&sra, NULL, "stripe_cache_active", &active) != 0 ||
+	    sysfs_get_ll(&sra, NULL, "raid_disks", &disks) != 0 ||
+	    sysfs_get_blkstat(st->devnm, &bs) != 0)
+		return;
+	if (sysfs_get_ll(&sra, NULL, "group_thread_cnt", &threads) != 0)
+		threads = 0;
+	nthreads = threads;
+
+	if (!t->ms) {
+		/* first sample, or the first after a reshape */
+		if (!t->min_cache) {
+			t->min_cache = size;
+			t->min_threads = threads;
+		}
+		t->ms = now;
+		t->stat = bs;
+		return;
+	}
+	wrate = 0;
+	if (bs.wr_sectors > t->stat.wr_sectors)
+		wrate = (bs.wr_sectors - t->stat.wr_sectors) * 1000 /
+			(now - t->ms);
+	t->ms = now;
+	t->stat = bs;
+
+	pressure = wrate && active * 4 >= size * 3;
+	if (pressure) {
+		int to = size * 2;
+
+		t->idle = 0;
+		if (to > TUNE_CACHE_MAX)
+			to = TUNE_CACHE_MAX;
+		/*
+		 * One knob per pass, so a thread step is judged on its own:
+		 * the cache grows only with no thread step pending, and
+		 * threads are stepped only once the cache cannot grow.
+		 */
+		if (!t->base_rate && to > (int)size &&
+		    tune_cache_fits(disks, size, to) &&
+		    tune_set(&sra, "stripe_cache_size", size, to,
+			     verbose) == 0)
+			return;
+	} else if (active * 8 <= size) {
+		if (++t->idle < TUNE_IDLE_SAMPLES)
+			return;
+		t->idle = 0;
+		if ((int)size > t->min_cache) {
+			int to = size / 2;
+
+			if (to < t->min_cache)
+				to = t->min_cache;
+			tune_set(&sra, "stripe_cache_size", size, to, verbose);
+		}
+		if (nthreads != t->min_threads)
+			tune_set(&sra, "group_thread_cnt", nthreads,
+				 t->min_threads, verbose);
+		t->base_rate = 0;
+		t->threads_settled = 0;
+		return;
+	} else
+		t->idle = 0;
+
+	/* judge the last group_thread_cnt step on the next pass with writes */
+	if (t->base_rate && wrate) {
+		if (wrate * 10 < t->base_rate * 11) {
+			tune_set(&sra, "group_thread_cnt", nthreads,
+				 t->prev_threads, verbose);
+			t->threads_settled = 1;
+		}
+		t->base_rate = 0;
+		return;
+	}
+	if (pressure && !t->threads_settled) {
+		int to = nthreads ? nthreads * 2 : 1;
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (to > TUNE_THREADS_MAX || to > cpus) {
+			t->threads_settled = 1;
+			return;
+		}
+		if (tune_set(&sra, "group_thread_cnt", nthreads, to,
+			     verbose) == 0) {
+			t->base_rate = wrate;
+			t->prev_threads = nthreads;
+		} else
+			t->threads_settled = 1;
+	}
+}
+
+/*
+ * --sync-latency-target: while an array resyncs or recovers, watch the
+ * latency of the other IO to it in /sys/block/mdX/stat - the resync
+ * itself goes to the members and is not counted there - and set its
+ * own sync_speed_max to keep that latency under the target:
+ *  - above the target, halve it, down to PACE_MIN_SPEED;
+ *  - well below the target, let it grow by a quarter;
+ *  - with hardly any other IO, double it, and once it reaches the system
+ *    limit give the array back to the system limits.
+ * sync_speed_min is lowered to PACE_MIN_SPEED meanwhile, otherwise the
+ * kernel would not go below the system minimum when the array is busy.
+ * When the resync ends, the array is removed or the monitor exits, the
+ * limits the array had before are put back.  An array whose
+ * sync_speed_max was set by hand is left alone.
+ */
+#define PACE_MIN_SPEED	1000	/* K/sec, the kernel's default minimum */
+#define PACE_MIN_IOS	10	/* fewer than this per sample is idle */
+
+static unsigned long long pace_system_max(void)
+{
+	char buf[32];
+
+	if (load_sys("/proc/sys/dev/raid/speed_limit_max", buf, sizeof(buf)))
+		return 200000;
+	return strtoull(buf, NULL, 10);
+}
+
+/*
+ * Read sync_speed_min or sync_speed_max, "NNN (local)" or "NNN (system)".
+ * Returns 1 if the array has its own limit, 0 if it follows the system
+ * limit, -1 on error.
+ */
+static int pace_get_limit(struct mdinfo *sra, char *name,
+			  unsigned long long *val)
+{
+	char buf[SYSFS_MAX_BUF_SIZE];
+	char *ep;
+
+	if (sysfs_get_str(sra, NULL, name, buf, sizeof(buf)) <= 0)
+		return -1;
+	*val = strtoull(buf, &ep, 10);
+	if (ep == buf)
+		return -1;
+	return strstr(ep, "local") != NULL;
+}
+
+static void pace_restore_min(struct mdinfo *sra, struct pace_state *p)
+{
+	if (p->min)
+		sysfs_set_num(sra, NULL, "sync_speed_min", p->min);
+	else
+		sysfs_set_str(sra, NULL, "sync_speed_min", "system");
+}
+
+static void pace_set(struct mdinfo *sra, struct pace_state *p,
+		     unsigned long long max, int verbose)
+{
+	unsigned long long val;
+	int local;
+
+	if (max == p->max)
+		return;
+	if (!max) {
+		pace_restore_min(sra, p);
+		sysfs_set_str(sra, NULL, "sync_speed_max", "system");
+	} else {
+		if (!p->max) {
+			if (pace_get_limit(sra, "sync_speed_max", &val) != 0) {
+				p->admin = 1;
+				return;
+			}
+			local = pace_get_limit(sra, "sync_speed_min", &val);
+			if (local < 0)
+				return;
+			p->min = local ? val : 0;
+			sysfs_set_num(sra, NULL, "sync_speed_min",
+				      PACE_MIN_SPEED);
+		}
+		sysfs_set_num(sra, NULL, "sync_speed_max", max);
+	}
+	if (verbose > 0) {
+		if (max)
+			pr_err("%s: sync_speed_max %llu\n", sra->sys_name, max);
+		else
+			pr_err("%s: sync speed limits restored\n",
+			       sra->sys_name);
+	}
+	p->max = max;
+}
+
+/* Give the array back the limits it had before it was paced */
+static void pace_end(struct state *st)
+{
+	struct mdinfo sra;
+
+	if (!st->pace.max || st->devnm[0] == 0)
+		return;
+	memset(&sra, 0, sizeof(sra));
+	snprintf(sra.sys_name, sizeof(sra.sys_name), "%s", st->devnm);
+	pace_set(&sra, &st->pace, 0, 0);
+}
+
+/* Returns 1 if the array is resyncing */
+static int pace_array(struct state *st, int target_ms, int verbose)
+{
+	struct pace_state *p = &st->pace;
+	unsigned long long now = monotonic_ms();
+	unsigned long long ios, ticks, speed, ceiling, max;
+	struct mdinfo sra;
+	struct blkstat bs;
+	char action[SYSFS_MAX_BUF_SIZE];
+
+	if (st->devnm[0] == 0 || st->err)
+		return 0;
+
+	memset(&sra, 0, sizeof(sra));
+	snprintf(sra.sys_name, sizeof(sra.sys_name), "%s", st->devnm);
+	if (sysfs_get_str(&sra, NULL, "sync_action", action,
+			  sizeof(action)) <= 0 ||
+	    strncmp(action, "idle", 4) == 0 ||
+	    strncmp(action, "frozen", 6) == 0) {
+		pace_set(&sra, p, 0, verbose);
+		p->ms = 0;
+		p->admin = 0;
+		return 0;
+	}
+	if (p->admin)
+		return 0;
+	if (p->max && (pace_get_limit(&sra, "sync_speed_max", &max) != 1 ||
+		       max != p->max)) {
+		/* someone else changed the limit, it is theirs now */
+		if (verbose > 0)
+			pr_err("%s: sync_speed_max changed, not pacing\n",
+			       sra.sys_name);
+		pace_restore_min(&sra, p);
+		p->max = 0;
+		p->admin = 1;
+		return 0;
+	}
+	if (sysfs_get_blkstat(st->devnm, &bs) != 0)
+		return 1;
+	if (!p->ms || bs.rd_ios + bs.wr_ios < p->stat.rd_ios + p->stat.wr_ios) {
+		p->ms = now;
+		p->stat = bs;
+		return 1;
+	}
+	ios = bs.rd_ios + bs.wr_ios - p->stat.rd_ios - p->stat.wr_ios;
+	ticks = bs.rd_ticks + bs.wr_ticks - p->stat.rd_ticks - p->stat.wr_ticks;
+	p->ms = now;
+	p->stat = bs;
+
+	ceiling = pace_system_max();
+	max = p->max ? p->max : ceiling;
+	if (ios < PACE_MIN_IOS) {
+		if (p->max)
+			max = p->max * 2;
+		if (max >= ceiling)
+			max = 0;
+	} else if (ticks > ios * target_ms) {
+		/* start from what it does now rather than the limit */
+		if (sysfs_get_ll(&sra, NULL, "sync_speed", &speed) == 0 &&
+		    speed && speed < max)
+			max = speed;
+		max /= 2;
+		if (max < PACE_MIN_SPEED)
+			max = PACE_MIN_SPEED;
+	} else if (p->max && ticks * 10 < ios * target_ms * 8) {
+		max = p->max + p->max / 4;
+		if (max >= ceiling)
+			max = 0;
+	} else
+		max = p->max;
+	pace_set(&sra, p, max, verbose);
+	return 1;
+}
+
 /* Not really Monitor but ... */
 int Wait(char *dev)
 {
@@ -1409,3 +1857,65 @@ int WaitClean(char *dev, int verbose)
 
 	return rv;
 }
+
+/*
+ * Show what mdmon measured for an array with external metadata, or
+ * for all the arrays of a container.
+ */
+int Monitor_stats(char *dev, int verbose)
+{
+	struct mdinfo *mdi;
+	char devnm[32];
+	char *stats, *line, *next;
+	int member;
+	int fd;
+
+	if (!stat_is_blkdev(dev, NULL))
+		return 2;
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		if (verbose)
+			pr_err("Couldn't open %s: %s\n", dev, strerror(errno));
+		return 1;
+	}
+
+	snprintf(devnm, sizeof(devnm), "%s", fd2devnm(fd));
+
+	mdi = sysfs_read(fd, devnm, GET_VERSION);
+	close(fd);
+	if (!mdi) {
+		pr_err("Failed to read sysfs attributes for %s\n", dev);
+		return 1;
+	}
+
+	member = is_subarray(mdi->text_version);
+	if (!member && mdi->array.major_version != -1) {
+		pr_err("%s does not use external metadata\n", dev);
+		sysfs_free(mdi);
+		return 1;
+	}
+
+	stats = monitor_stats(member ? mdi->text_version : devnm);
+	sysfs_free(mdi);
+	if (!stats) {
+		pr_err("Cannot get statistics for %s from mdmon\n", dev);
+		return 1;
+	}
+
+	/* for a member, the container lines and its own */
+	for (line = stats; *line; line = next) {
+		char *eq = strchr(line, '=');
+		char *dot = strchr(line, '.');
+
+		next = strchr(line, '\n');
+		next = next ? next + 1 : line + strlen(line);
+		if (member && dot && eq && dot < eq &&
+		    (strncmp(line, devnm, dot - line) != 0 ||
+		     devnm[dot - line] != '\0'))
+			continue;
+		printf("%.*s", (int)(next - line), line);
+	}
+	free(stats);
+
+	return 0;
+}
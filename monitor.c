@@ -21,7 +21,8 @@
 #include "mdadm.h"
 #include "mdmon.h"
 #include <sys/syscall.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <stdint.h>
 
 static char *array_states[] = {
 	"clear", "inactive", "suspended", "readonly", "read-auto",
@@ -35,9 +36,84 @@ enum bb_action {
 	COMPARE_BB,
 };
 
-static void add_fd(fd_set *fds, int *maxfd, int fd)
+/*
+ * The attributes the monitor waits on are registered with one epoll set
+ * and stay registered, rather than being collected on every wakeup.
+ * The registrations are brought up to date when the manager puts an
+ * array on the list (a new one, or a copy replacing one, which shares
+ * the fds of the original), when the monitor drops an array, and when
+ * a member is being removed.  The event data is the array or member and
+ * which of its attributes fired, the low bits of the pointer hold the
+ * latter.
+ */
+enum watch_kind {
+	WATCH_ARRAY_STATE,
+	WATCH_ACTION,
+	WATCH_SYNC_COMPLETED,
+	WATCH_DEV_STATE,
+	WATCH_BB,
+	WATCH_UBB,
+};
+#define WATCH_KIND_MASK 7
+
+#define MAX_EVENTS 64
+
+/* Arrays nothing fired for are still looked at this often */
+#define FULL_SWEEP_MS 10000
+
+static int epfd = -1;
+static unsigned int arrays_seen;	/* arrays_gen last registered */
+static int rewatch = 1;			/* registrations need redoing */
+
+struct mon_stats mon_stats;
+static unsigned long long wake_us;	/* when the monitor last woke */
+
+static unsigned long long mon_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void mon_hist_add(struct mon_hist *h, unsigned long long us)
+{
+	int b = us < 2 ? 0 : 63 - __builtin_clzll(us);
+
+	if (b >= MON_HIST_BUCKETS)
+		b = MON_HIST_BUCKETS - 1;
+	h->bucket[b]++;
+	h->count++;
+	h->total_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+}
+
+static int watch_fd(struct active_array *a, struct mdinfo *mdi,
+		    enum watch_kind kind)
+{
+	switch (kind) {
+	case WATCH_ARRAY_STATE:
+		return a->info.state_fd;
+	case WATCH_ACTION:
+		return a->action_fd;
+	case WATCH_SYNC_COMPLETED:
+		return a->sync_completed_fd;
+	case WATCH_DEV_STATE:
+		return mdi->state_fd;
+	case WATCH_BB:
+		return mdi->bb_fd;
+	case WATCH_UBB:
+		return mdi->ubb_fd;
+	}
+	return -1;
+}
+
+static void watch(int fd, void *owner, enum watch_kind kind)
 {
+	struct epoll_event ev;
 	struct stat st;
+
 	if (fd < 0)
 		return;
 	if (fstat(fd, &st) == -1) {
@@ -45,12 +121,73 @@ static void add_fd(fd_set *fds, int *maxfd, int fd)
 		return;
 	}
 	if (st.st_nlink == 0) {
+		/* a deleted attribute would report an event forever */
 		dprintf("fd %d was deleted\n", fd);
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
 		return;
 	}
-	if (fd > *maxfd)
-		*maxfd = fd;
-	FD_SET(fd, fds);
+	ev.events = EPOLLPRI;
+	ev.data.u64 = (uintptr_t)owner | kind;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT)
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void unwatch(int fd)
+{
+	if (fd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void watch_dev(struct mdinfo *mdi)
+{
+	watch(mdi->state_fd, mdi, WATCH_DEV_STATE);
+	watch(mdi->bb_fd, mdi, WATCH_BB);
+	watch(mdi->ubb_fd, mdi, WATCH_UBB);
+}
+
+static void unwatch_dev(struct mdinfo *mdi)
+{
+	unwatch(mdi->state_fd);
+	unwatch(mdi->bb_fd);
+	unwatch(mdi->ubb_fd);
+}
+
+static void watch_array(struct active_array *a)
+{
+	struct mdinfo *mdi;
+
+	watch(a->info.state_fd, a, WATCH_ARRAY_STATE);
+	watch(a->action_fd, a, WATCH_ACTION);
+	watch(a->sync_completed_fd, a, WATCH_SYNC_COMPLETED);
+	for (mdi = a->info.devs; mdi; mdi = mdi->next)
+		if (!mdi->man_disk_to_remove)
+			watch_dev(mdi);
+}
+
+static void unwatch_array(struct active_array *a)
+{
+	struct mdinfo *mdi;
+
+	unwatch(a->info.state_fd);
+	unwatch(a->action_fd);
+	unwatch(a->sync_completed_fd);
+	for (mdi = a->info.devs; mdi; mdi = mdi->next)
+		unwatch_dev(mdi);
+}
+
+static void watch_arrays(struct active_array *list)
+{
+	struct active_array *a;
+
+	/* A copy shares its fds with the array it replaces and must
+	 * own them, so copies are done last.
+	 */
+	for (a = list; a; a = a->next)
+		if (a->container && !a->to_remove && !a->replaces)
+			watch_array(a);
+	for (a = list; a; a = a->next)
+		if (a->container && !a->to_remove && a->replaces)
+			watch_array(a);
 }
 
 static int read_attr(char *buf, int len, int fd)
@@ -334,6 +471,9 @@ static void signal_manager(void)
 {
 	/* tgkill(getpid(), mon_tid, SIGUSR1); */
 	int pid = getpid();
+
+	__atomic_add_fetch(&mon_events, 1, __ATOMIC_RELEASE);
+	mdmon_futex_wake(&mon_events);
 	syscall(SYS_tgkill, pid, mgr_tid, SIGUSR1);
 }
 
@@ -394,12 +534,46 @@ static void signal_manager(void)
  *
  */
 
+/*
+ * With an adaptive checkpoint policy, progress is recorded once the
+ * reshape has moved CHECKPOINT_SHARE times the bytes the last checkpoint
+ * wrote, but at least every CHECKPOINT_MAX_MS.
+ */
+#define CHECKPOINT_SHARE 1000
+#define CHECKPOINT_MAX_MS 30000
+
+/* Whether progress to sync_completed should be recorded now */
+static bool checkpoint_due(struct active_array *a,
+			   unsigned long long sync_completed)
+{
+	unsigned long long elapsed = wake_us / 1000 - a->checkpoint_ms;
+	unsigned long long want = checkpoint_policy.min_advance;
+
+	if (elapsed < checkpoint_policy.interval_ms)
+		return false;
+	if (checkpoint_policy.adaptive) {
+		if (elapsed >= CHECKPOINT_MAX_MS)
+			return true;
+		if (a->checkpoint_bytes * CHECKPOINT_SHARE / 512 > want)
+			want = a->checkpoint_bytes * CHECKPOINT_SHARE / 512;
+	}
+	return sync_completed - a->last_checkpoint >= want;
+}
+
 #define ARRAY_DIRTY 1
 #define ARRAY_BUSY 2
+#define ARRAY_CHANGED 4
+/*
+ * Read the state of an array and record what it means in the metadata.
+ * The changes to the array itself are left for effect_changes(), which
+ * is called once the metadata of all the arrays handled in this pass has
+ * been written: the kernel must not be told an array is active before
+ * the metadata says it is dirty.
+ */
 static int read_and_act(struct active_array *a)
 {
+	unsigned long long start = mon_now_us();
 	unsigned long long sync_completed;
-	bool disks_to_remove = false;
 	bool check_degraded = false;
 	bool check_reshape = false;
 	int deactivate = 0;
@@ -585,7 +759,8 @@ static int read_and_act(struct active_array *a)
 		write_checkpoint = true;
 	}
 
-	if (a->curr_action >= reshape && sync_completed > a->last_checkpoint) {
+	if (a->curr_action >= reshape && sync_completed > a->last_checkpoint &&
+	    checkpoint_due(a, sync_completed)) {
 		/* Update checkpoint if neither reshape nor idle action */
 		a->last_checkpoint = sync_completed;
 
@@ -594,6 +769,7 @@ static int read_and_act(struct active_array *a)
 
 	/* Save checkpoint */
 	if (write_checkpoint) {
+		a->checkpoint_ms = wake_us / 1000;
 		a->container->ss->set_array_state(a, a->curr_state <= clean);
 
 		if (a->curr_action <= reshape)
@@ -603,7 +779,28 @@ static int read_and_act(struct active_array *a)
 	if (sync_completed >= a->info.component_size)
 		a->last_checkpoint = 0;
 
-	a->container->ss->sync_metadata(a->container);
+	if (a->curr_state != a->prev_state || a->curr_action != a->prev_action ||
+	    a->next_state != bad_word || a->next_action != bad_action ||
+	    write_checkpoint)
+		ret |= ARRAY_CHANGED;
+	for (mdi = a->info.devs; mdi ; mdi = mdi->next)
+		if (mdi->curr_state != mdi->prev_state)
+			ret |= ARRAY_CHANGED;
+
+	a->act_deactivate = deactivate;
+	a->act_check_degraded = check_degraded;
+	a->act_check_reshape = check_reshape;
+	a->act_checkpoint = write_checkpoint;
+	a->act_us = mon_now_us() - start;
+	return ret;
+}
+
+static void effect_changes(struct active_array *a)
+{
+	unsigned long long start = mon_now_us();
+	bool disks_to_remove = false;
+	struct mdinfo *mdi;
+
 	dprintf("(%d): state:%s action:%s next(", a->info.container_member,
 		array_states[a->curr_state], sync_actions[a->curr_action]);
 
@@ -611,6 +808,11 @@ static int read_and_act(struct active_array *a)
 	if (a->next_state != bad_word) {
 		dprintf_cont(" state:%s", array_states[a->next_state]);
 		write_attr(array_states[a->next_state], a->info.state_fd);
+		if (a->curr_state == write_pending) {
+			a->stats.write_pending++;
+			mon_hist_add(&a->stats.write_pending_us,
+				     mon_now_us() - wake_us);
+		}
 	}
 	if (a->next_action != bad_action) {
 		write_attr(sync_actions[a->next_action], a->action_fd);
@@ -643,18 +845,19 @@ static int read_and_act(struct active_array *a)
 	for (mdi = a->info.devs; mdi ; mdi = mdi->next)
 		mdi->prev_state = mdi->curr_state;
 
-	if (check_degraded || check_reshape || disks_to_remove) {
+	if (a->act_check_degraded || a->act_check_reshape || disks_to_remove) {
 
 		a->check_member_remove |= disks_to_remove;
-		a->check_degraded |= check_degraded;
-		a->check_reshape |= check_reshape;
+		a->check_degraded |= a->act_check_degraded;
+		a->check_reshape |= a->act_check_reshape;
 		signal_manager();
 	}
 
-	if (deactivate)
+	if (a->act_deactivate)
 		a->container = NULL;
 
-	return ret;
+	mon_hist_add(&a->stats.read_and_act_us,
+		     a->act_us + mon_now_us() - start);
 }
 
 static struct mdinfo *
@@ -687,46 +890,123 @@ static void reconcile_failed(struct active_array *aa, struct mdinfo *failed)
 }
 
 #ifdef DEBUG
-static void dprint_wake_reasons(fd_set *fds)
+static void dprint_wake_reasons(struct epoll_event *events, int n)
 {
+	static const char * const names[] = {
+		"array_state", "sync_action", "sync_completed",
+		"state", "bad_blocks", "unacknowledged_bad_blocks",
+	};
 	int i;
-	char proc_path[256];
-	char link[256];
-	char *basename;
-	int rv;
 
 	fprintf(stderr, "monitor: wake ( ");
-	for (i = 0; i < FD_SETSIZE; i++) {
-		if (FD_ISSET(i, fds)) {
-			sprintf(proc_path, "/proc/%d/fd/%d",
-				(int) getpid(), i);
-
-			rv = readlink(proc_path, link, sizeof(link) - 1);
-			if (rv < 0) {
-				fprintf(stderr, "%d:unknown ", i);
-				continue;
-			}
-			link[rv] = '\0';
-			basename = strrchr(link, '/');
-			fprintf(stderr, "%d:%s ",
-				i, basename ? ++basename : link);
-		}
+	for (i = 0; i < n; i++) {
+		enum watch_kind kind = events[i].data.u64 & WATCH_KIND_MASK;
+		void *owner = (void *)(uintptr_t)(events[i].data.u64 &
+						  ~(uint64_t)WATCH_KIND_MASK);
+
+		if (kind >= WATCH_DEV_STATE)
+			fprintf(stderr, "%s:%s ",
+				((struct mdinfo *)owner)->sys_name,
+				names[kind]);
+		else
+			fprintf(stderr, "%s:%s ",
+				((struct active_array *)owner)->info.sys_name,
+				names[kind]);
 	}
 	fprintf(stderr, ")\n");
 }
 #endif
 
+/* Stop waiting on attributes that have been deleted */
+static void check_wake_reasons(struct epoll_event *events, int n)
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		enum watch_kind kind = events[i].data.u64 & WATCH_KIND_MASK;
+		void *owner = (void *)(uintptr_t)(events[i].data.u64 &
+						  ~(uint64_t)WATCH_KIND_MASK);
+		int fd;
+
+		if (kind >= WATCH_DEV_STATE)
+			fd = watch_fd(NULL, owner, kind);
+		else
+			fd = watch_fd(owner, NULL, kind);
+		if (fd >= 0 && fstat(fd, &st) == 0 && st.st_nlink == 0) {
+			dprintf("fd %d was deleted\n", fd);
+			unwatch(fd);
+		}
+	}
+}
+
+/*
+ * Mark the arrays an attribute fired for, so only they are read again.
+ * Returns 0 if an event could not be matched to an array, then they all
+ * have to be.
+ */
+static int mark_woken(struct active_array *aa, struct epoll_event *events,
+		      int n)
+{
+	struct active_array *a;
+	struct mdinfo *mdi;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		enum watch_kind kind = events[i].data.u64 & WATCH_KIND_MASK;
+		void *owner = (void *)(uintptr_t)(events[i].data.u64 &
+						  ~(uint64_t)WATCH_KIND_MASK);
+
+		if (kind < WATCH_DEV_STATE) {
+			((struct active_array *)owner)->woken = true;
+			continue;
+		}
+		for (a = aa; a; a = a->next) {
+			for (mdi = a->info.devs; mdi; mdi = mdi->next)
+				if (mdi == owner)
+					break;
+			if (mdi)
+				break;
+		}
+		if (!a)
+			return 0;
+		a->woken = true;
+	}
+	return 1;
+}
+
+/*
+ * Odd while the monitor waits, moved on at every wait and wakeup.
+ * ping_monitor waits on it, having set monitor_loop_waiter.
+ */
 int monitor_loop_cnt;
+int monitor_loop_waiter;
+
+static void monitor_loop_next(int wait)
+{
+	if (wait)
+		__atomic_or_fetch(&monitor_loop_cnt, 1, __ATOMIC_SEQ_CST);
+	else
+		__atomic_add_fetch(&monitor_loop_cnt, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&monitor_loop_waiter, __ATOMIC_SEQ_CST))
+		mdmon_futex_wake(&monitor_loop_cnt);
+}
 
 static int wait_and_act(struct supertype *container, int nowait)
 {
 	struct active_array *a, **ap, **aap = &container->arrays;
 	static unsigned int dirty_arrays = ~0; /* start at some non-zero value */
+	static unsigned long long last_sweep;
+	struct epoll_event events[MAX_EVENTS];
+	unsigned long long now;
+	unsigned int gen;
 	struct mdinfo *mdi;
-	int rv, maxfd = 0;
-	fd_set rfds;
-
-	FD_ZERO(&rfds);
+	unsigned long long sync_us, bytes;
+	int updates = 0;
+	int changed = 0;
+	int fired = 0;
+	int sweep = 1;
+	int rv;
 
 	for (ap = aap ; *ap ;) {
 		a = *ap;
@@ -734,6 +1014,11 @@ static int wait_and_act(struct supertype *container, int nowait)
 		 * ask the manager to discard it.
 		 */
 		if (!a->container || a->to_remove) {
+			/* It may share fds with a copy, which are then
+			 * registered again below.
+			 */
+			unwatch_array(a);
+			rewatch = 1;
 			if (discard_this) {
 				ap = &(*ap)->next;
 				continue;
@@ -745,29 +1030,31 @@ static int wait_and_act(struct supertype *container, int nowait)
 			continue;
 		}
 
-		add_fd(&rfds, &maxfd, a->info.state_fd);
-		add_fd(&rfds, &maxfd, a->action_fd);
-		add_fd(&rfds, &maxfd, a->sync_completed_fd);
-
-		for (mdi = a->info.devs ; mdi ; mdi = mdi->next) {
-			if (mdi->man_disk_to_remove) {
-				mdi->mon_descriptors_not_used = true;
+		if (a->check_member_remove)
+			for (mdi = a->info.devs ; mdi ; mdi = mdi->next) {
+				if (!mdi->man_disk_to_remove)
+					continue;
+				if (!mdi->mon_descriptors_not_used) {
+					unwatch_dev(mdi);
+					mdi->mon_descriptors_not_used = true;
+				}
 
 				/* Managemon could be blocked on suspend in kernel.
 				 * Monitor must respond if any badblock is recorded in this time.
 				 */
 				container->retry_soon = 1;
-				continue;
 			}
 
-			add_fd(&rfds, &maxfd, mdi->state_fd);
-			add_fd(&rfds, &maxfd, mdi->bb_fd);
-			add_fd(&rfds, &maxfd, mdi->ubb_fd);
-		}
-
 		ap = &(*ap)->next;
 	}
 
+	gen = __atomic_load_n(&arrays_gen, __ATOMIC_ACQUIRE);
+	if (rewatch || gen != arrays_seen) {
+		watch_arrays(*aap);
+		arrays_seen = gen;
+		rewatch = 0;
+	}
+
 	if (manager_ready && (*aap == NULL || (sigterm && !dirty_arrays))) {
 		/* No interesting arrays, or we have been told to
 		 * terminate and everything is clean.  Lets see about
@@ -800,34 +1087,37 @@ static int wait_and_act(struct supertype *container, int nowait)
 
 	if (!nowait) {
 		sigset_t set;
-		struct timespec ts;
-		ts.tv_sec = 24*3600;
-		ts.tv_nsec = 0;
-		if (*aap == NULL || container->retry_soon) {
+		int timeout = 24*3600*1000;
+
+		if (*aap == NULL || container->retry_soon)
 			/* just waiting to get O_EXCL access */
-			ts.tv_sec = 0;
-			ts.tv_nsec = 20000000ULL;
-		}
+			timeout = 20;
 		sigprocmask(SIG_UNBLOCK, NULL, &set);
 		sigdelset(&set, SIGUSR1);
-		monitor_loop_cnt |= 1;
-		rv = pselect(maxfd+1, NULL, NULL, &rfds, &ts, &set);
-		monitor_loop_cnt += 1;
+		monitor_loop_next(1);
+		rv = epoll_pwait(epfd, events, MAX_EVENTS, timeout, &set);
+		monitor_loop_next(0);
+		mon_stats.wakeups++;
 		if (rv == -1) {
-			if (errno == EINTR) {
-				rv = 0;
-				FD_ZERO(&rfds);
+			if (errno == EINTR)
 				dprintf("monitor: caught signal\n");
-			} else
-				dprintf("monitor: error %d in pselect\n",
+			else
+				dprintf("monitor: error %d in epoll_pwait\n",
 					errno);
+		} else if (rv > 0) {
+			#ifdef DEBUG
+			dprint_wake_reasons(events, rv);
+			#endif
+			check_wake_reasons(events, rv);
+			/* A signal or timeout may concern any array, and
+			 * when terminating all must be seen to be clean.
+			 */
+			sweep = sigterm || !mark_woken(*aap, events, rv);
+			fired = rv;
 		}
-		#ifdef DEBUG
-		else
-			dprint_wake_reasons(&rfds);
-		#endif
 		container->retry_soon = 0;
 	}
+	wake_us = mon_now_us();
 
 	if (update_queue) {
 		struct metadata_update *this;
@@ -835,14 +1125,21 @@ static int wait_and_act(struct supertype *container, int nowait)
 		for (this = update_queue; this ; this = this->next)
 			container->ss->process_update(container, this);
 
-		update_queue_handled = update_queue;
-		update_queue = NULL;
-		signal_manager();
-		container->ss->sync_metadata(container);
+		/* update_queue is cleared once they are on disk, below */
+		updates = 1;
+		sweep = 1;
+	}
+
+	now = wake_us / 1000;
+	if (now - last_sweep >= FULL_SWEEP_MS)
+		sweep = 1;
+	if (sweep) {
+		last_sweep = now;
+		/* only a sweep sees whether every array is clean */
+		dirty_arrays = 0;
 	}
 
 	rv = 0;
-	dirty_arrays = 0;
 	for (a = *aap; a ; a = a->next) {
 
 		if (a->replaces && !discard_this) {
@@ -857,11 +1154,15 @@ static int wait_and_act(struct supertype *container, int nowait)
 			/* FIXME check if device->state_fd need to be cleared?*/
 			signal_manager();
 		}
-		if (a->container && !a->to_remove) {
+		a->act_pending = false;
+		if (a->container && !a->to_remove && (sweep || a->woken)) {
 			int ret = read_and_act(a);
 
+			a->act_pending = true;
 			rv |= 1;
-			dirty_arrays += !!(ret & ARRAY_DIRTY);
+			if (sweep)
+				dirty_arrays += !!(ret & ARRAY_DIRTY);
+			changed |= ret & ARRAY_CHANGED;
 			/* when terminating stop manipulating the array after it
 			 * is clean, but make sure read_and_act() is given a
 			 * chance to handle 'active_idle'
@@ -871,8 +1172,39 @@ static int wait_and_act(struct supertype *container, int nowait)
 			if (ret & ARRAY_BUSY)
 				container->retry_soon = 1;
 		}
+		a->woken = false;
 	}
 
+	/* One metadata write covers the updates and every array handled */
+	if (updates || rv) {
+		sync_us = mon_now_us();
+		bytes = container->metadata_bytes;
+		container->ss->sync_metadata(container);
+		mon_stats.metadata_syncs++;
+		sync_us = mon_now_us() - sync_us;
+		bytes = container->metadata_bytes - bytes;
+		/*
+		 * The manager goes on once update_queue is empty, so only
+		 * hand the updates back now that they are written.
+		 */
+		if (updates) {
+			update_queue_handled = update_queue;
+			update_queue = NULL;
+			signal_manager();
+		}
+		for (a = *aap; a ; a = a->next) {
+			if (!a->act_pending)
+				continue;
+			mon_hist_add(&a->stats.sync_metadata_us, sync_us);
+			if (a->act_checkpoint)
+				a->checkpoint_bytes = bytes;
+			effect_changes(a);
+			a->act_pending = false;
+		}
+	}
+	if (fired && !changed)
+		mon_stats.spurious_wakeups++;
+
 	/* propagate failures across container members */
 	for (a = *aap; a ; a = a->next) {
 		if (!a->container || a->to_remove)
@@ -889,6 +1221,12 @@ void do_monitor(struct supertype *container)
 {
 	int rv;
 	int first = 1;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		pr_err("cannot create epoll instance: %s\n", strerror(errno));
+		exit(1);
+	}
 	do {
 		rv = wait_and_act(container, first);
 		first = 0;
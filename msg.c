@@ -481,3 +481,26 @@ void flush_mdmon(char *container)
 	ping_manager(container);
 	ping_monitor(container);
 }
+
+/* The statistics text of the mdmon for 'devname', to be freed, or NULL */
+char *monitor_stats(char *devname)
+{
+	int sfd = connect_monitor(devname);
+	struct metadata_update msg = { .len = MSG_MONITOR_STATS };
+	int err = 0;
+
+	if (sfd < 0)
+		return NULL;
+
+	err = send_message(sfd, &msg, 20);
+	if (!err && receive_message(sfd, &msg, 20) != 0)
+		err = -1;
+
+	close(sfd);
+
+	/* an mdmon without statistics just acknowledges the message */
+	if (err || msg.len <= 0 || !msg.buf)
+		return NULL;
+	msg.buf[msg.len - 1] = '\0';
+	return msg.buf;
+}
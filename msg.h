@@ -33,5 +33,8 @@ extern void unblock_monitor(char *container, const int unfreeze);
 extern int fping_monitor(int sock);
 extern int ping_manager(char *devname);
 extern void flush_mdmon(char *container);
+extern char *monitor_stats(char *devname);
 
 #define MSG_MAX_LEN (4*1024*1024)
+/* A message of this length asks mdmon for its statistics */
+#define MSG_MONITOR_STATS (-2)
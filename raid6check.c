@@ -23,6 +23,7 @@
  */
 
 #include "mdadm.h"
+#include "xmalloc.h"
 #include <stdint.h>
 #include <sys/mman.h>
 
@@ -349,6 +350,7 @@ int check_stripes(struct mdinfo *info, int *source, unsigned long long *offsets,
 	int i, j;
 	int diskP, diskQ, diskD;
 	int err = 0;
+	struct stripe_map *map = stripe_map_get(raid_disks, level, layout);
 
 	extern int tables_ready;
 
@@ -396,26 +398,21 @@ int check_stripes(struct mdinfo *info, int *source, unsigned long long *offsets,
 			}
 		}
 
-		diskP = geo_map(-1, start, raid_disks, level, layout);
+		diskP = stripe_map_disks(map, start)[-1];
 		block_index_for_slot[-1] = diskP;
 		blocks[-1] = stripes[diskP];
 
-		diskQ = geo_map(-2, start, raid_disks, level, layout);
+		diskQ = stripe_map_disks(map, start)[-2];
 		block_index_for_slot[-2] = diskQ;
 		blocks[-2] = stripes[diskQ];
 
 		if (!is_ddf(layout)) {
 			/* The syndrome-order of disks starts immediately after 'Q',
 			 * but skips P */
-			diskD = diskQ;
+			const int *syn = stripe_map_syndrome(map, start);
+
 			for (i = 0 ; i < data_disks ; i++) {
-				diskD = diskD + 1;
-				if (diskD >= raid_disks)
-					diskD = 0;
-				if (diskD == diskP)
-					diskD += 1;
-				if (diskD >= raid_disks)
-					diskD = 0;
+				diskD = syn[i];
 				blocks[i] = stripes[diskD];
 				block_index_for_slot[i] = diskD;
 			}
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * How child_monitor() sizes and paces the backup of a reshape.
+ *
+ * These are kept apart from the sysfs handling in Grow.c so that
+ * reshape_sim can run them against a model of the kernel.
+ */
+
+#include "mdadm.h"
+#include "reshape_policy.h"
+
+unsigned long compute_backup_blocks(int nchunk, int ochunk,
+				    unsigned int ndata, unsigned int odata)
+{
+	unsigned long a, b, blocks;
+	/* So how much do we need to backup.
+	 * We need an amount of data which is both a whole number of
+	 * old stripes and a whole number of new stripes.
+	 * So LCM for (chunksize*datadisks).
+	 */
+	a = (ochunk/512) * odata;
+	b = (nchunk/512) * ndata;
+	/* Find GCD */
+	a = GCD(a, b);
+	/* LCM == product / GCD */
+	blocks = (unsigned long)(ochunk/512) * (unsigned long)(nchunk/512) *
+		odata * ndata / a;
+
+	return blocks;
+}
+
+/* How many sectors to back up at most at a time.  backup_blocks is
+ * just a minimum.  When every stripe needs a backup, make it bigger
+ * for better throughput, but not so big that reshape_array() rejects
+ * it.  Try for 16 megabytes.
+ */
+unsigned long reshape_backup_size(struct reshape *reshape,
+				  unsigned long long component_size)
+{
+	unsigned long blocks = reshape->backup_blocks;
+
+	if (reshape->before.data_disks == reshape->after.data_disks)
+		while (blocks * 32 < component_size && blocks < 16*1024*2)
+			blocks *= 2;
+	return blocks;
+}
+
+/* Fold a measurement of 'sectors' in 'ms' into the speed '*rate'.
+ * Measurements too short to mean much on their own are added up in
+ * '*pending' first, so fast devices still get a speed.
+ */
+static void rate_sample(unsigned long long *rate,
+			unsigned long long pending[2],
+			unsigned long long sectors, unsigned long long ms)
+{
+	unsigned long long r;
+
+	pending[0] += sectors;
+	pending[1] += ms;
+	if (pending[1] < 10)
+		return;
+	r = pending[0] * 1000 / pending[1];
+	pending[0] = pending[1] = 0;
+	if (*rate)
+		r = (*rate * 3 + r) / 4;
+	*rate = r ? r : 1;
+}
+
+/* Fold a measurement of 'sectors' reshaped in 'ms' into reshape->rate */
+void reshape_rate_sample(struct reshape *reshape,
+			 unsigned long long sectors,
+			 unsigned long long ms)
+{
+	rate_sample(&reshape->rate, reshape->rate_pending, sectors, ms);
+}
+
+/* Fold the time taken to back up 'sectors' into reshape->backup_rate */
+void backup_time_sample(struct reshape *reshape, unsigned long long sectors,
+			unsigned long long ms)
+{
+	rate_sample(&reshape->backup_rate, reshape->backup_pending,
+		    sectors, ms);
+}
+
+/* How far to move suspend_point at a time, in array sectors */
+unsigned long long suspend_target(struct reshape *reshape)
+{
+	unsigned long long target, speed;
+
+	target = 64*1024*2 * min(reshape->before.data_disks,
+				 reshape->after.data_disks);
+	if (reshape->max_suspend_ms) {
+		/* progress_reshape() suspends 2 * 'target' more once less
+		 * than 'target' is left, so IO to the end of a region waits
+		 * until the reshape gets through up to three times 'target'.
+		 * The reshape can't go faster than the backup, so use the
+		 * slower of the two.  Until either is known, and never
+		 * far beyond the default, suspend one backup unit.
+		 */
+		unsigned long long limit = target * 4;
+
+		speed = reshape->rate;
+		if (reshape->backup_rate &&
+		    (!speed || reshape->backup_rate < speed))
+			speed = reshape->backup_rate;
+		target = speed * reshape->max_suspend_ms / 1000 / 3;
+		if (target > limit)
+			target = limit;
+	}
+	target /= reshape->backup_blocks;
+	if (target < 2 && !reshape->max_suspend_ms)
+		target = 2;
+	if (target < 1)
+		target = 1;
+	target *= reshape->backup_blocks;
+	return target;
+}
+
+/* IO to a window is suspended while it is backed up.  With
+ * --reshape-max-suspend-ms, back up no more at a time than fits in that,
+ * but always a whole number of 'unit's (reshape->backup_blocks).
+ */
+unsigned long backup_window(struct reshape *reshape,
+			    unsigned long stripes, unsigned long unit)
+{
+	unsigned long long window, fits;
+
+	if (!reshape->max_suspend_ms)
+		return stripes;
+	/* A window is only backed up once it is all suspended, and
+	 * suspend_point is moved on 'target' at a time: a bigger one
+	 * would never start.
+	 */
+	window = suspend_target(reshape) / reshape->backup_blocks * unit;
+	if (reshape->backup_rate) {
+		fits = reshape->backup_rate * reshape->max_suspend_ms / 1000 *
+			unit / reshape->backup_blocks;
+		if (window > fits)
+			window = fits;
+	}
+	window -= window % unit;
+	if (window < unit)
+		window = unit;
+	if (window < stripes)
+		return window;
+	return stripes;
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#ifndef RESHAPE_POLICY_H
+#define RESHAPE_POLICY_H
+
+struct reshape;
+
+extern unsigned long reshape_backup_size(struct reshape *reshape,
+					 unsigned long long component_size);
+extern void reshape_rate_sample(struct reshape *reshape,
+				unsigned long long sectors,
+				unsigned long long ms);
+extern unsigned long long suspend_target(struct reshape *reshape);
+extern void backup_time_sample(struct reshape *reshape,
+			       unsigned long long sectors,
+			       unsigned long long ms);
+extern unsigned long backup_window(struct reshape *reshape,
+				   unsigned long stripes, unsigned long unit);
+
+#endif
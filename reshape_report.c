@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Progress of a reshape monitored by mdadm.
+ *
+ * While child_monitor() or a metadata handler's manage_reshape() looks
+ * after a reshape in the background, /proc/mdstat only shows how far the
+ * kernel is.  The monitor also keeps MAP_DIR/<devnm>.reshape up to date
+ * with "key=value" lines:
+ *
+ *  state		running, or stalled after a minute without progress
+ *  pid			of the monitor
+ *  reshaped_bytes	of the array done, out of total_bytes
+ *  backup_bytes	of array data backed up so far
+ *  backup_window_bytes	size of the last backup window
+ *  suspended_start	array offset of the region IO is suspended on,
+ *  suspended_bytes	and its length
+ *  suspended_ms	total time some of the array was suspended
+ *  sync_wait_ms	total time spent waiting for backups to be stable
+ *  speed_mb_s		over the last few seconds, in MiB/s
+ *  avg_speed_mb_s	since the monitor started
+ *  eta_s		at the average speed, -1 if not known yet
+ *  stalled_s		time since the last progress
+ *  elapsed_s, time	time since the monitor started, and of the record
+ *
+ * The file is replaced as a whole, a reader never sees a partial record.
+ * It is removed when the monitor stops, however that happens, so that it
+ * is never mistaken for a live reshape.
+ */
+
+#include "mdadm.h"
+
+/* Rewrite the record at most this often, unless the state changes */
+#define REPORT_INTERVAL_MS 1000
+/* speed_mb_s is measured over this long */
+#define REPORT_SPEED_MS 10000
+/* No progress for this long is a stall */
+#define REPORT_STALL_MS 60000
+
+static struct {
+	char devnm[32];
+	int active;
+	int stalled;
+	unsigned long long start_ms, start_done;
+	unsigned long long done, total;		/* sectors */
+	unsigned long long backup_bytes, window_bytes;
+	unsigned long long suspend_lo, suspend_hi;
+	unsigned long long suspend_ms, suspend_since;
+	unsigned long long sync_ms;		/* added to by writer threads */
+	unsigned long long speed_ms, speed_done; /* start of the speed span */
+	unsigned long long speed;		/* sectors per second */
+	unsigned long long progress_ms;		/* 'done' last moved */
+	unsigned long long written_ms;
+} report;
+
+static void report_remove(void)
+{
+	char path[PATH_MAX];
+
+	if (!report.active)
+		return;
+	snprintf(path, sizeof(path), "%s/%s.reshape", MAP_DIR, report.devnm);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/%s.reshape.new", MAP_DIR,
+		 report.devnm);
+	unlink(path);
+	report.active = 0;
+}
+
+static double report_mb_s(unsigned long long sectors, unsigned long long ms)
+{
+	if (!ms)
+		return 0;
+	return (double)sectors * 512 / (1 << 20) * 1000 / ms;
+}
+
+static void report_write(const char *state, unsigned long long now)
+{
+	unsigned long long avg_ms = now - report.start_ms;
+	unsigned long long avg = 0;
+	unsigned long long suspend_ms = report.suspend_ms;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	long long eta = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s.reshape", MAP_DIR, report.devnm);
+	snprintf(tmp, sizeof(tmp), "%s/%s.reshape.new", MAP_DIR, report.devnm);
+	f = fopen(tmp, "w");
+	if (!f) {
+		(void)mkdir(MAP_DIR, 0755);
+		f = fopen(tmp, "w");
+	}
+	if (!f)
+		return;
+
+	if (report.suspend_hi > report.suspend_lo)
+		suspend_ms += now - report.suspend_since;
+	if (report.done > report.start_done)
+		avg = report.done - report.start_done;
+	if (avg && avg_ms)
+		eta = (report.total - report.done) * avg_ms / avg / 1000;
+
+	fprintf(f, "state=%s\n", state);
+	fprintf(f, "pid=%d\n", getpid());
+	fprintf(f, "reshaped_bytes=%llu\n", report.done * 512);
+	fprintf(f, "total_bytes=%llu\n", report.total * 512);
+	fprintf(f, "backup_bytes=%llu\n", report.backup_bytes);
+	fprintf(f, "backup_window_bytes=%llu\n", report.window_bytes);
+	fprintf(f, "suspended_start=%llu\n", report.suspend_lo * 512);
+	fprintf(f, "suspended_bytes=%llu\n",
+		report.suspend_hi > report.suspend_lo ?
+		(report.suspend_hi - report.suspend_lo) * 512 : 0);
+	fprintf(f, "suspended_ms=%llu\n", suspend_ms);
+	fprintf(f, "sync_wait_ms=%llu\n",
+		__atomic_load_n(&report.sync_ms, __ATOMIC_RELAXED));
+	/* until there is a full span, the average will do */
+	if (report.speed_ms == report.start_ms)
+		fprintf(f, "speed_mb_s=%.1f\n", report_mb_s(avg, avg_ms));
+	else
+		fprintf(f, "speed_mb_s=%.1f\n",
+			report_mb_s(report.speed, 1000));
+	fprintf(f, "avg_speed_mb_s=%.1f\n", report_mb_s(avg, avg_ms));
+	fprintf(f, "eta_s=%lld\n", eta);
+	fprintf(f, "stalled_s=%llu\n", (now - report.progress_ms) / 1000);
+	fprintf(f, "elapsed_s=%llu\n", avg_ms / 1000);
+	fprintf(f, "time=%llu\n", (unsigned long long)time(NULL));
+
+	if (fclose(f) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+	report.written_ms = now;
+}
+
+static void report_update(unsigned long long now, int force)
+{
+	int stalled = now - report.progress_ms >= REPORT_STALL_MS;
+
+	if (now - report.speed_ms >= REPORT_SPEED_MS) {
+		report.speed = 0;
+		if (report.done > report.speed_done)
+			report.speed = (report.done - report.speed_done) *
+				1000 / (now - report.speed_ms);
+		report.speed_ms = now;
+		report.speed_done = report.done;
+	}
+	if (stalled != report.stalled) {
+		if (stalled)
+			pr_err("reshape of %s has made no progress for %d seconds\n",
+			       report.devnm, REPORT_STALL_MS / 1000);
+		else
+			pr_err("reshape of %s is progressing again\n",
+			       report.devnm);
+		report.stalled = stalled;
+		force = 1;
+	}
+	if (force || now - report.written_ms >= REPORT_INTERVAL_MS)
+		report_write(stalled ? "stalled" : "running", now);
+}
+
+/**
+ * reshape_report_start() - start reporting on a reshape.
+ * @devnm: the array.
+ * @done: sectors of the array already reshaped.
+ * @total: sectors to reshape in all.
+ */
+void reshape_report_start(char *devnm, unsigned long long done,
+			  unsigned long long total)
+{
+	static int registered;
+	unsigned long long now = monotonic_ms();
+
+	/* error paths may exit() without getting to reshape_report_end() */
+	if (!registered && atexit(report_remove) == 0)
+		registered = 1;
+	report_remove();
+	memset(&report, 0, sizeof(report));
+	snprintf(report.devnm, sizeof(report.devnm), "%s", devnm);
+	report.active = 1;
+	report.total = total;
+	report.done = done;
+	report.start_done = done;
+	report.speed_done = done;
+	report.start_ms = now;
+	report.speed_ms = now;
+	report.progress_ms = now;
+	report_write("running", now);
+}
+
+/**
+ * reshape_report_progress() - the reshape has moved on.
+ * @done: sectors of the array reshaped.
+ * @suspend_lo: start of the region IO is now suspended on.
+ * @suspend_hi: end of it, no higher than @suspend_lo if there is none.
+ */
+void reshape_report_progress(unsigned long long done,
+			     unsigned long long suspend_lo,
+			     unsigned long long suspend_hi)
+{
+	unsigned long long now = monotonic_ms();
+
+	if (!report.active)
+		return;
+	if (report.suspend_hi > report.suspend_lo)
+		report.suspend_ms += now - report.suspend_since;
+	report.suspend_lo = suspend_lo;
+	report.suspend_hi = suspend_hi;
+	report.suspend_since = now;
+	reshape_report_done(done);
+}
+
+/**
+ * reshape_report_done() - record how far the reshape is.
+ * @done: sectors of the array reshaped.
+ *
+ * Also called while waiting for the kernel, so a stall is noticed.
+ */
+void reshape_report_done(unsigned long long done)
+{
+	unsigned long long now = monotonic_ms();
+
+	if (!report.active)
+		return;
+	if (done > report.total)
+		done = report.total;
+	if (done != report.done) {
+		report.done = done;
+		report.progress_ms = now;
+	}
+	report_update(now, 0);
+}
+
+/**
+ * reshape_report_backup() - a backup window is stable.
+ * @bytes: of array data in it.
+ */
+void reshape_report_backup(unsigned long long bytes)
+{
+	report.backup_bytes += bytes;
+	report.window_bytes = bytes;
+}
+
+/**
+ * reshape_report_sync() - add time spent waiting for a backup to be stable.
+ * @ms: how long.
+ *
+ * May be called from any thread.
+ */
+void reshape_report_sync(unsigned long long ms)
+{
+	__atomic_fetch_add(&report.sync_ms, ms, __ATOMIC_RELAXED);
+}
+
+/**
+ * reshape_report_end() - the monitor is stopping, remove the report.
+ * @state: "finished", "released" or "aborted".
+ */
+void reshape_report_end(const char *state)
+{
+	if (!report.active)
+		return;
+	dprintf("reshape of %s %s\n", report.devnm, state);
+	report_remove();
+}
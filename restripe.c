@@ -26,6 +26,18 @@
 #include "xmalloc.h"
 
 #include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+	!defined(__TINYC__)
+#define RESTRIPE_X86 1
+#include <immintrin.h>
+#endif
 
 /* To restripe, we read from old geometry to a buffer, and
  * read from buffer to new geometry.
@@ -230,23 +242,282 @@ int is_ddf(int layout)
 	}
 }
 
-void xor_blocks(char *target, char **sources, int disks, int size)
+/*
+ * geo_map() has to work out the layout every time it is called.  For
+ * bulk work, build the whole rotation of a geometry once and look
+ * blocks up in that instead.
+ */
+static int geo_period(int raid_disks, int level, int layout)
+{
+	if (level != 5 && level != 6)
+		return 1;
+
+	switch (layout) {
+	case ALGORITHM_PARITY_0:
+	case ALGORITHM_PARITY_N:
+	case ALGORITHM_PARITY_0_6:
+		return 1;
+	case ALGORITHM_LEFT_ASYMMETRIC_6:
+	case ALGORITHM_RIGHT_ASYMMETRIC_6:
+	case ALGORITHM_LEFT_SYMMETRIC_6:
+	case ALGORITHM_RIGHT_SYMMETRIC_6:
+		/* rotates over all but the Q disk */
+		return raid_disks - 1;
+	}
+	return raid_disks;
+}
+
+static void stripe_map_fill(struct stripe_map *map, int s)
+{
+	int n = map->raid_disks;
+	int *disk = map->disk + s * (map->data_disks + 2) + 2;
+	int *block = map->block + s * n;
+	int *syn;
+	int b, d, j;
+
+	for (d = 0; d < n; d++)
+		block[d] = -3;	/* not part of the array */
+
+	for (b = -2; b < map->data_disks; b++) {
+		if ((b == -2 && map->level != 6) ||
+		    (b == -1 && map->level == 0)) {
+			disk[b] = -1;
+			continue;
+		}
+		d = geo_map(b, s, n, map->level, map->layout);
+		disk[b] = d;
+		if (d >= 0 && d < n)
+			block[d] = b;
+	}
+
+	if (map->level != 6)
+		return;
+
+	syn = map->syndrome + s * map->syndrome_disks;
+	if (is_ddf(map->layout)) {
+		/* q over 'raid_disks' blocks, in device order.
+		 * 'p' and 'q' are treated as zero.
+		 */
+		for (d = 0; d < n; d++)
+			syn[d] = d;
+	} else if (disk[-1] < 0 || disk[-2] < 0) {
+		for (d = 0; d < map->syndrome_disks; d++)
+			syn[d] = -1;
+	} else {
+		/* for md, q is over 'data_disks' blocks, starting
+		 * immediately after 'q' and skipping 'p'.
+		 */
+		d = 0;
+		for (j = 0; j < n; j++) {
+			int dnum = (disk[-2] + 1 + j) % n;
+
+			if (dnum == disk[-1] || dnum == disk[-2])
+				continue;
+			syn[d++] = dnum;
+		}
+	}
+}
+
+struct stripe_map *stripe_map_get(int raid_disks, int level, int layout)
+{
+	static struct stripe_map *maps;
+	struct stripe_map *map;
+	int s;
+
+	for (map = maps; map; map = map->next)
+		if (map->raid_disks == raid_disks && map->level == level &&
+		    map->layout == layout)
+			return map;
+
+	map = xcalloc(1, sizeof(*map));
+	map->raid_disks = raid_disks;
+	map->level = level;
+	map->layout = layout;
+	map->data_disks = raid_disks -
+		(level == 0 ? 0 : level <= 5 ? 1 : 2);
+	if (level == 6)
+		map->syndrome_disks = is_ddf(layout) ? raid_disks
+						     : map->data_disks;
+	map->period = geo_period(raid_disks, level, layout);
+	map->disk = xcalloc(map->period * (map->data_disks + 2), sizeof(int));
+	map->block = xcalloc(map->period * raid_disks, sizeof(int));
+	if (map->syndrome_disks)
+		map->syndrome = xcalloc(map->period * map->syndrome_disks,
+					sizeof(int));
+	for (s = 0; s < map->period; s++)
+		stripe_map_fill(map, s);
+
+	map->next = maps;
+	maps = map;
+	return map;
+}
+
+/*
+ * There are several implementations of xor_blocks().  The byte-at-a-time
+ * loop is the reference; the others do the same work a word or a vector
+ * register at a time.  One is chosen, at first use, from those the CPU
+ * can run.
+ */
+struct xor_calls {
+	void (*gen)(char *target, char **sources, int disks, int size);
+	int (*valid)(void);	/* NULL means always usable */
+	const char *name;
+};
+
+static void xor_range(char *target, char **sources, int disks,
+		      int from, int to)
 {
 	int i, j;
 	/* Amazingly inefficient... */
-	for (i=0; i<size; i++) {
+	for (i = from; i < to; i++) {
 		char c = 0;
-		for (j=0 ; j<disks; j++)
+		for (j = 0; j < disks; j++)
 			c ^= sources[j][i];
 		target[i] = c;
 	}
 }
 
-void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+static void xor_blocks_byte(char *target, char **sources, int disks, int size)
+{
+	xor_range(target, sources, disks, 0, size);
+}
+
+static void xor_blocks_long(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+	unsigned long w, s;
+
+	/* memcpy keeps this safe for unaligned buffers and compiles
+	 * down to plain loads and stores.
+	 */
+	for (i = 0; i + (int)sizeof(w) <= size; i += sizeof(w)) {
+		memcpy(&w, sources[0] + i, sizeof(w));
+		for (j = 1; j < disks; j++) {
+			memcpy(&s, sources[j] + i, sizeof(s));
+			w ^= s;
+		}
+		memcpy(target + i, &w, sizeof(w));
+	}
+	xor_range(target, sources, disks, i, size);
+}
+
+#ifdef RESTRIPE_X86
+static int cpu_has_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int cpu_has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int cpu_has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512bw");
+}
+
+/* Each vector variant handles 64 bytes per pass over the sources */
+__attribute__((target("sse2")))
+static void xor_blocks_sse2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 64 <= size; i += 64) {
+		const __m128i *s = (const __m128i *)(sources[0] + i);
+		__m128i v0 = _mm_loadu_si128(s);
+		__m128i v1 = _mm_loadu_si128(s + 1);
+		__m128i v2 = _mm_loadu_si128(s + 2);
+		__m128i v3 = _mm_loadu_si128(s + 3);
+		__m128i *t = (__m128i *)(target + i);
+
+		for (j = 1; j < disks; j++) {
+			s = (const __m128i *)(sources[j] + i);
+			v0 = _mm_xor_si128(v0, _mm_loadu_si128(s));
+			v1 = _mm_xor_si128(v1, _mm_loadu_si128(s + 1));
+			v2 = _mm_xor_si128(v2, _mm_loadu_si128(s + 2));
+			v3 = _mm_xor_si128(v3, _mm_loadu_si128(s + 3));
+		}
+		_mm_storeu_si128(t, v0);
+		_mm_storeu_si128(t + 1, v1);
+		_mm_storeu_si128(t + 2, v2);
+		_mm_storeu_si128(t + 3, v3);
+	}
+	xor_range(target, sources, disks, i, size);
+}
+
+__attribute__((target("avx2")))
+static void xor_blocks_avx2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 64 <= size; i += 64) {
+		const __m256i *s = (const __m256i *)(sources[0] + i);
+		__m256i v0 = _mm256_loadu_si256(s);
+		__m256i v1 = _mm256_loadu_si256(s + 1);
+		__m256i *t = (__m256i *)(target + i);
+
+		for (j = 1; j < disks; j++) {
+			s = (const __m256i *)(sources[j] + i);
+			v0 = _mm256_xor_si256(v0, _mm256_loadu_si256(s));
+			v1 = _mm256_xor_si256(v1, _mm256_loadu_si256(s + 1));
+		}
+		_mm256_storeu_si256(t, v0);
+		_mm256_storeu_si256(t + 1, v1);
+	}
+	xor_range(target, sources, disks, i, size);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void xor_blocks_avx512(char *target, char **sources, int disks,
+			      int size)
+{
+	int i, j;
+
+	for (i = 0; i + 64 <= size; i += 64) {
+		__m512i v = _mm512_loadu_si512(sources[0] + i);
+
+		for (j = 1; j < disks; j++)
+			v = _mm512_xor_si512(v, _mm512_loadu_si512(sources[j] + i));
+		_mm512_storeu_si512(target + i, v);
+	}
+	xor_range(target, sources, disks, i, size);
+}
+#endif /* RESTRIPE_X86 */
+
+/* In increasing order of preference */
+static const struct xor_calls xor_algos[] = {
+	{ xor_blocks_byte, NULL, "byte" },
+	{ xor_blocks_long, NULL, "long" },
+#ifdef RESTRIPE_X86
+	{ xor_blocks_sse2, cpu_has_sse2, "sse2" },
+	{ xor_blocks_avx2, cpu_has_avx2, "avx2" },
+	{ xor_blocks_avx512, cpu_has_avx512, "avx512" },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+static const struct xor_calls *xor_algo;
+static unsigned long xor_speed;
+
+void xor_blocks(char *target, char **sources, int disks, int size)
+{
+	if (disks < 1) {
+		memset(target, 0, size);
+		return;
+	}
+	if (!xor_algo)
+		select_parity_algorithms(0);
+	xor_algo->gen(target, sources, disks, size);
+}
+
+static void qsyndrome_range(uint8_t *p, uint8_t *q, uint8_t **sources,
+			    int disks, int from, int size)
 {
 	int d, z;
 	uint8_t wq0, wp0, wd0, w10, w20;
-	for ( d = 0; d < size; d++) {
+	for ( d = from; d < size; d++) {
 		wq0 = wp0 = sources[disks-1][d];
 		for ( z = disks-2 ; z >= 0 ; z-- ) {
 			wd0 = sources[z][d];
@@ -262,6 +533,12 @@ void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
 	}
 }
 
+static void qsyndrome_byte(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	qsyndrome_range(p, q, sources, disks, 0, size);
+}
+
 /*
  * The following was taken from linux/drivers/md/mktables.c, and modified
  * to create in-memory tables rather than C code
@@ -298,6 +575,259 @@ static uint8_t gfpow(uint8_t a, int b)
 	return v;
 }
 
+/*
+ * qsyndrome() has the same set of implementations as xor_blocks().
+ * The vector variants follow linux/lib/raid6: multiplying Q by {02}
+ * is a shift plus a conditional xor of 0x1d on bytes whose top bit
+ * was set.  With GFNI the whole multiply is a single affine transform.
+ * Note GF2P8MULB can't be used as it reduces by the AES polynomial
+ * (0x11b) rather than the RAID-6 one (0x11d).
+ */
+struct raid6_calls {
+	void (*gen)(uint8_t *p, uint8_t *q, uint8_t **sources,
+		    int disks, int size);
+	int (*valid)(void);	/* NULL means always usable */
+	const char *name;
+};
+
+static void qsyndrome_long(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	const uint64_t hibits = 0x8080808080808080ULL;
+	const uint64_t poly = 0x1d1d1d1d1d1d1d1dULL;
+	uint64_t wp, wq, wd, hi;
+	int d, z;
+
+	for (d = 0; d + 8 <= size; d += 8) {
+		memcpy(&wq, sources[disks-1] + d, 8);
+		wp = wq;
+		for (z = disks-2; z >= 0; z--) {
+			memcpy(&wd, sources[z] + d, 8);
+			wp ^= wd;
+			hi = wq & hibits;
+			wq = ((wq << 1) & ~0x0101010101010101ULL) ^
+				(((hi << 1) - (hi >> 7)) & poly);
+			wq ^= wd;
+		}
+		memcpy(p + d, &wp, 8);
+		memcpy(q + d, &wq, 8);
+	}
+	qsyndrome_range(p, q, sources, disks, d, size);
+}
+
+#ifdef RESTRIPE_X86
+/*
+ * Build the GF2P8AFFINEQB matrix that multiplies each byte by 'c' in
+ * the RAID-6 field.  Row (7 - i) of the matrix selects the input bits
+ * that contribute to output bit i.
+ */
+static uint64_t gf_affine_matrix(uint8_t c)
+{
+	uint64_t m = 0;
+	int i, k;
+
+	for (i = 0; i < 8; i++) {
+		uint8_t row = 0;
+
+		for (k = 0; k < 8; k++)
+			if (gfmul(c, 1 << k) & (1 << i))
+				row |= 1 << k;
+		m |= (uint64_t)row << (8 * (7 - i));
+	}
+	return m;
+}
+
+static int cpu_has_gfni_avx2(void)
+{
+	return __builtin_cpu_supports("gfni") && cpu_has_avx2();
+}
+
+static int cpu_has_gfni_avx512(void)
+{
+	return __builtin_cpu_supports("gfni") && cpu_has_avx512();
+}
+
+__attribute__((target("sse2")))
+static void qsyndrome_sse2(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	const __m128i poly = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i wp0, wp1, wq0, wq1, wd0, wd1, t0, t1;
+	int d, z;
+
+	for (d = 0; d + 32 <= size; d += 32) {
+		wq0 = wp0 = _mm_loadu_si128((__m128i *)(sources[disks-1] + d));
+		wq1 = wp1 = _mm_loadu_si128((__m128i *)(sources[disks-1] + d + 16));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm_loadu_si128((__m128i *)(sources[z] + d));
+			wd1 = _mm_loadu_si128((__m128i *)(sources[z] + d + 16));
+			wp0 = _mm_xor_si128(wp0, wd0);
+			wp1 = _mm_xor_si128(wp1, wd1);
+			t0 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq0), poly);
+			t1 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq1), poly);
+			wq0 = _mm_xor_si128(_mm_add_epi8(wq0, wq0), t0);
+			wq1 = _mm_xor_si128(_mm_add_epi8(wq1, wq1), t1);
+			wq0 = _mm_xor_si128(wq0, wd0);
+			wq1 = _mm_xor_si128(wq1, wd1);
+		}
+		_mm_storeu_si128((__m128i *)(p + d), wp0);
+		_mm_storeu_si128((__m128i *)(p + d + 16), wp1);
+		_mm_storeu_si128((__m128i *)(q + d), wq0);
+		_mm_storeu_si128((__m128i *)(q + d + 16), wq1);
+	}
+	qsyndrome_range(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("avx2")))
+static void qsyndrome_avx2(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	const __m256i poly = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i wp0, wp1, wq0, wq1, wd0, wd1, t0, t1;
+	int d, z;
+
+	for (d = 0; d + 64 <= size; d += 64) {
+		wq0 = wp0 = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d));
+		wq1 = wp1 = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d + 32));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm256_loadu_si256((__m256i *)(sources[z] + d));
+			wd1 = _mm256_loadu_si256((__m256i *)(sources[z] + d + 32));
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+			t0 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq0), poly);
+			t1 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq1), poly);
+			wq0 = _mm256_xor_si256(_mm256_add_epi8(wq0, wq0), t0);
+			wq1 = _mm256_xor_si256(_mm256_add_epi8(wq1, wq1), t1);
+			wq0 = _mm256_xor_si256(wq0, wd0);
+			wq1 = _mm256_xor_si256(wq1, wd1);
+		}
+		_mm256_storeu_si256((__m256i *)(p + d), wp0);
+		_mm256_storeu_si256((__m256i *)(p + d + 32), wp1);
+		_mm256_storeu_si256((__m256i *)(q + d), wq0);
+		_mm256_storeu_si256((__m256i *)(q + d + 32), wq1);
+	}
+	qsyndrome_range(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void qsyndrome_avx512(uint8_t *p, uint8_t *q, uint8_t **sources,
+			     int disks, int size)
+{
+	const __m512i poly = _mm512_set1_epi8(0x1d);
+	__m512i wp0, wp1, wq0, wq1, wd0, wd1;
+	__mmask64 h0, h1;
+	int d, z;
+
+	for (d = 0; d + 128 <= size; d += 128) {
+		wq0 = wp0 = _mm512_loadu_si512(sources[disks-1] + d);
+		wq1 = wp1 = _mm512_loadu_si512(sources[disks-1] + d + 64);
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm512_loadu_si512(sources[z] + d);
+			wd1 = _mm512_loadu_si512(sources[z] + d + 64);
+			wp0 = _mm512_xor_si512(wp0, wd0);
+			wp1 = _mm512_xor_si512(wp1, wd1);
+			h0 = _mm512_movepi8_mask(wq0);
+			h1 = _mm512_movepi8_mask(wq1);
+			wq0 = _mm512_add_epi8(wq0, wq0);
+			wq1 = _mm512_add_epi8(wq1, wq1);
+			wq0 = _mm512_xor_si512(wq0, _mm512_maskz_mov_epi8(h0, poly));
+			wq1 = _mm512_xor_si512(wq1, _mm512_maskz_mov_epi8(h1, poly));
+			wq0 = _mm512_xor_si512(wq0, wd0);
+			wq1 = _mm512_xor_si512(wq1, wd1);
+		}
+		_mm512_storeu_si512(p + d, wp0);
+		_mm512_storeu_si512(p + d + 64, wp1);
+		_mm512_storeu_si512(q + d, wq0);
+		_mm512_storeu_si512(q + d + 64, wq1);
+	}
+	qsyndrome_range(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("gfni,avx2")))
+static void qsyndrome_gfni_avx2(uint8_t *p, uint8_t *q, uint8_t **sources,
+				int disks, int size)
+{
+	const __m256i mul2 = _mm256_set1_epi64x(gf_affine_matrix(2));
+	__m256i wp0, wp1, wq0, wq1, wd0, wd1;
+	int d, z;
+
+	for (d = 0; d + 64 <= size; d += 64) {
+		wq0 = wp0 = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d));
+		wq1 = wp1 = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d + 32));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm256_loadu_si256((__m256i *)(sources[z] + d));
+			wd1 = _mm256_loadu_si256((__m256i *)(sources[z] + d + 32));
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+			wq0 = _mm256_gf2p8affine_epi64_epi8(wq0, mul2, 0);
+			wq1 = _mm256_gf2p8affine_epi64_epi8(wq1, mul2, 0);
+			wq0 = _mm256_xor_si256(wq0, wd0);
+			wq1 = _mm256_xor_si256(wq1, wd1);
+		}
+		_mm256_storeu_si256((__m256i *)(p + d), wp0);
+		_mm256_storeu_si256((__m256i *)(p + d + 32), wp1);
+		_mm256_storeu_si256((__m256i *)(q + d), wq0);
+		_mm256_storeu_si256((__m256i *)(q + d + 32), wq1);
+	}
+	qsyndrome_range(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("gfni,avx512f,avx512bw")))
+static void qsyndrome_gfni_avx512(uint8_t *p, uint8_t *q, uint8_t **sources,
+				  int disks, int size)
+{
+	const __m512i mul2 = _mm512_set1_epi64(gf_affine_matrix(2));
+	__m512i wp0, wp1, wq0, wq1, wd0, wd1;
+	int d, z;
+
+	for (d = 0; d + 128 <= size; d += 128) {
+		wq0 = wp0 = _mm512_loadu_si512(sources[disks-1] + d);
+		wq1 = wp1 = _mm512_loadu_si512(sources[disks-1] + d + 64);
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm512_loadu_si512(sources[z] + d);
+			wd1 = _mm512_loadu_si512(sources[z] + d + 64);
+			wp0 = _mm512_xor_si512(wp0, wd0);
+			wp1 = _mm512_xor_si512(wp1, wd1);
+			wq0 = _mm512_gf2p8affine_epi64_epi8(wq0, mul2, 0);
+			wq1 = _mm512_gf2p8affine_epi64_epi8(wq1, mul2, 0);
+			wq0 = _mm512_xor_si512(wq0, wd0);
+			wq1 = _mm512_xor_si512(wq1, wd1);
+		}
+		_mm512_storeu_si512(p + d, wp0);
+		_mm512_storeu_si512(p + d + 64, wp1);
+		_mm512_storeu_si512(q + d, wq0);
+		_mm512_storeu_si512(q + d + 64, wq1);
+	}
+	qsyndrome_range(p, q, sources, disks, d, size);
+}
+#endif /* RESTRIPE_X86 */
+
+/* In increasing order of preference */
+static const struct raid6_calls raid6_algos[] = {
+	{ qsyndrome_byte, NULL, "byte" },
+	{ qsyndrome_long, NULL, "int64" },
+#ifdef RESTRIPE_X86
+	{ qsyndrome_sse2, cpu_has_sse2, "sse2" },
+	{ qsyndrome_avx2, cpu_has_avx2, "avx2" },
+	{ qsyndrome_gfni_avx2, cpu_has_gfni_avx2, "gfni-avx2" },
+	{ qsyndrome_avx512, cpu_has_avx512, "avx512" },
+	{ qsyndrome_gfni_avx512, cpu_has_gfni_avx512, "gfni-avx512" },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+static const struct raid6_calls *raid6_algo;
+static unsigned long raid6_speed;
+
+void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+{
+	if (!raid6_algo)
+		select_parity_algorithms(0);
+	raid6_algo->gen(p, q, sources, disks, size);
+}
+
 int tables_ready = 0;
 uint8_t raid6_gfmul[256][256];
 uint8_t raid6_gfexp[256];
@@ -364,130 +894,795 @@ void ensure_zero_has_size(int chunk_size)
 	}
 }
 
-/* Following was taken from linux/drivers/md/raid6recov.c */
-
-/* Recover two failed data blocks. */
-
-void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
-		       uint8_t **ptrs, int neg_offset)
+/*
+ * The inner loops of the recovery routines below multiply every byte by
+ * one or two constants.  Doing that through raid6_gfmul touches a 256
+ * byte row per constant, spread over a 64K table; the variants here use
+ * a pair of 16-entry tables per constant instead (products of the low
+ * and the high nibble) which fit in one vector register each for
+ * PSHUFB, or a single affine matrix with GFNI.
+ */
+struct raid6_recov_calls {
+	void (*data2)(size_t bytes, uint8_t *p, uint8_t *q,
+		      uint8_t *dp, uint8_t *dq, uint8_t pbmul, uint8_t qmul);
+	void (*datap)(size_t bytes, uint8_t *p, uint8_t *q,
+		      uint8_t *dq, uint8_t qmul);
+	int (*valid)(void);	/* NULL means always usable */
+	const char *name;
+};
+
+static void recov_data2_table(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dp, uint8_t *dq,
+			      uint8_t pbmul, uint8_t qmul)
 {
-	uint8_t *p, *q, *dp, *dq;
+	const uint8_t *pbtbl = raid6_gfmul[pbmul];
+	const uint8_t *qtbl = raid6_gfmul[qmul];
 	uint8_t px, qx, db;
-	const uint8_t *pbmul;	/* P multiplier table for B data */
-	const uint8_t *qmul;		/* Q multiplier table (for both) */
 
-	if (faila > failb) {
-		int t = faila;
-		faila = failb;
-		failb = t;
+	while (bytes--) {
+		px    = *p ^ *dp;
+		qx    = qtbl[*q ^ *dq];
+		*dq++ = db = pbtbl[px] ^ qx; /* Reconstructed B */
+		*dp++ = db ^ px; /* Reconstructed A */
+		p++; q++;
 	}
+}
 
-	if (neg_offset) {
-		p = ptrs[-1];
-		q = ptrs[-2];
-	} else {
-		p = ptrs[disks-2];
-		q = ptrs[disks-1];
-	}
+static void recov_datap_table(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dq, uint8_t qmul)
+{
+	const uint8_t *qtbl = raid6_gfmul[qmul];
 
-	/* Compute syndrome with zero for the missing data pages
-	   Use the dead data pages as temporary storage for
-	   delta p and delta q */
-	dp = ptrs[faila];
-	ptrs[faila] = zero;
-	dq = ptrs[failb];
-	ptrs[failb] = zero;
+	while (bytes--) {
+		*p++ ^= *dq = qtbl[*q ^ *dq];
+		q++; dq++;
+	}
+}
 
-	qsyndrome(dp, dq, ptrs, disks-2, bytes);
+static void make_nibble_tables(uint8_t c, uint8_t lo[16], uint8_t hi[16])
+{
+	int i;
 
-	/* Restore pointer table */
-	ptrs[faila]   = dp;
-	ptrs[failb]   = dq;
+	for (i = 0; i < 16; i++) {
+		lo[i] = gfmul(c, i);
+		hi[i] = gfmul(c, i << 4);
+	}
+}
 
-	/* Now, pick the proper data tables */
-	pbmul = raid6_gfmul[raid6_gfexi[failb-faila]];
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]]];
+#define NIBBLE_MUL(lo, hi, x) ((lo)[(x) & 0xf] ^ (hi)[(x) >> 4])
 
-	/* Now do it... */
-	while ( bytes-- ) {
-		px    = *p ^ *dp;
-		qx    = qmul[*q ^ *dq];
-		*dq++ = db = pbmul[px] ^ qx; /* Reconstructed B */
-		*dp++ = db ^ px; /* Reconstructed A */
-		p++; q++;
+static void recov_data2_range(size_t from, size_t bytes,
+			      uint8_t *p, uint8_t *q, uint8_t *dp, uint8_t *dq,
+			      const uint8_t *pblo, const uint8_t *pbhi,
+			      const uint8_t *qlo, const uint8_t *qhi)
+{
+	uint8_t px, qx, db;
+	size_t i;
+
+	for (i = from; i < bytes; i++) {
+		px = p[i] ^ dp[i];
+		qx = q[i] ^ dq[i];
+		qx = NIBBLE_MUL(qlo, qhi, qx);
+		db = NIBBLE_MUL(pblo, pbhi, px) ^ qx;
+		dq[i] = db;
+		dp[i] = db ^ px;
 	}
 }
 
-/* Recover failure of one data block plus the P block */
-void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs,
-		       int neg_offset)
+static void recov_datap_range(size_t from, size_t bytes,
+			      uint8_t *p, uint8_t *q, uint8_t *dq,
+			      const uint8_t *qlo, const uint8_t *qhi)
 {
-	uint8_t *p, *q, *dq;
-	const uint8_t *qmul;		/* Q multiplier table */
+	uint8_t qx;
+	size_t i;
 
-	if (neg_offset) {
-		p = ptrs[-1];
-		q = ptrs[-2];
-	} else {
-		p = ptrs[disks-2];
-		q = ptrs[disks-1];
+	for (i = from; i < bytes; i++) {
+		qx = q[i] ^ dq[i];
+		dq[i] = NIBBLE_MUL(qlo, qhi, qx);
+		p[i] ^= dq[i];
 	}
+}
 
-	/* Compute syndrome with zero for the missing data page
-	   Use the dead data page as temporary storage for delta q */
-	dq = ptrs[faila];
-	ptrs[faila] = zero;
+static void recov_data2_nibble(size_t bytes, uint8_t *p, uint8_t *q,
+			       uint8_t *dp, uint8_t *dq,
+			       uint8_t pbmul, uint8_t qmul)
+{
+	uint8_t pblo[16], pbhi[16], qlo[16], qhi[16];
 
-	qsyndrome(p, dq, ptrs, disks-2, bytes);
+	make_nibble_tables(pbmul, pblo, pbhi);
+	make_nibble_tables(qmul, qlo, qhi);
+	recov_data2_range(0, bytes, p, q, dp, dq, pblo, pbhi, qlo, qhi);
+}
 
-	/* Restore pointer table */
-	ptrs[faila]   = dq;
+static void recov_datap_nibble(size_t bytes, uint8_t *p, uint8_t *q,
+			       uint8_t *dq, uint8_t qmul)
+{
+	uint8_t qlo[16], qhi[16];
 
-	/* Now, pick the proper data tables */
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]]];
+	make_nibble_tables(qmul, qlo, qhi);
+	recov_datap_range(0, bytes, p, q, dq, qlo, qhi);
+}
 
-	/* Now do it... */
-	while ( bytes-- ) {
-		*p++ ^= *dq = qmul[*q ^ *dq];
-		q++; dq++;
-	}
+#ifdef RESTRIPE_X86
+static int cpu_has_ssse3(void)
+{
+	return __builtin_cpu_supports("ssse3");
 }
 
-/* Try to find out if a specific disk has a problem */
-int raid6_check_disks(int data_disks, int start, int chunk_size,
-		      int level, int layout, int diskP, int diskQ,
-		      uint8_t *p, uint8_t *q, char **stripes)
+__attribute__((target("ssse3")))
+static inline __m128i mul_ssse3(__m128i lo, __m128i hi, __m128i x)
 {
-	int i;
-	int data_id, diskD;
-	uint8_t Px, Qx;
-	int curr_broken_disk = -1;
-	int prev_broken_disk = -1;
-	int broken_status = 0;
+	const __m128i mask = _mm_set1_epi8(0x0f);
 
-	for(i = 0; i < chunk_size; i++) {
-		Px = (uint8_t)stripes[diskP][i] ^ (uint8_t)p[i];
-		Qx = (uint8_t)stripes[diskQ][i] ^ (uint8_t)q[i];
+	return _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+			     _mm_shuffle_epi8(hi, _mm_and_si128(
+					     _mm_srli_epi16(x, 4), mask)));
+}
 
-		if((Px != 0) && (Qx == 0))
-			curr_broken_disk = diskP;
+__attribute__((target("ssse3")))
+static void recov_data2_ssse3(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dp, uint8_t *dq,
+			      uint8_t pbmul, uint8_t qmul)
+{
+	uint8_t pblo[16], pbhi[16], qlo[16], qhi[16];
+	__m128i vpblo, vpbhi, vqlo, vqhi, px, qx, db;
+	size_t i;
+
+	make_nibble_tables(pbmul, pblo, pbhi);
+	make_nibble_tables(qmul, qlo, qhi);
+	vpblo = _mm_loadu_si128((__m128i *)pblo);
+	vpbhi = _mm_loadu_si128((__m128i *)pbhi);
+	vqlo = _mm_loadu_si128((__m128i *)qlo);
+	vqhi = _mm_loadu_si128((__m128i *)qhi);
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		px = _mm_xor_si128(_mm_loadu_si128((__m128i *)(p + i)),
+				   _mm_loadu_si128((__m128i *)(dp + i)));
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)(q + i)),
+				   _mm_loadu_si128((__m128i *)(dq + i)));
+		db = _mm_xor_si128(mul_ssse3(vpblo, vpbhi, px),
+				   mul_ssse3(vqlo, vqhi, qx));
+		_mm_storeu_si128((__m128i *)(dq + i), db);
+		_mm_storeu_si128((__m128i *)(dp + i), _mm_xor_si128(db, px));
+	}
+	recov_data2_range(i, bytes, p, q, dp, dq, pblo, pbhi, qlo, qhi);
+}
 
-		if((Px == 0) && (Qx != 0))
-			curr_broken_disk = diskQ;
+__attribute__((target("ssse3")))
+static void recov_datap_ssse3(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dq, uint8_t qmul)
+{
+	uint8_t qlo[16], qhi[16];
+	__m128i vqlo, vqhi, qx;
+	size_t i;
+
+	make_nibble_tables(qmul, qlo, qhi);
+	vqlo = _mm_loadu_si128((__m128i *)qlo);
+	vqhi = _mm_loadu_si128((__m128i *)qhi);
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)(q + i)),
+				   _mm_loadu_si128((__m128i *)(dq + i)));
+		qx = mul_ssse3(vqlo, vqhi, qx);
+		_mm_storeu_si128((__m128i *)(dq + i), qx);
+		_mm_storeu_si128((__m128i *)(p + i),
+				 _mm_xor_si128(_mm_loadu_si128((__m128i *)(p + i)),
+					       qx));
+	}
+	recov_datap_range(i, bytes, p, q, dq, qlo, qhi);
+}
 
-		if((Px != 0) && (Qx != 0)) {
-			data_id = (raid6_gflog[Qx] - raid6_gflog[Px]);
-			if(data_id < 0) data_id += 255;
-			diskD = geo_map(data_id, start/chunk_size,
-					data_disks + 2, level, layout);
-			curr_broken_disk = diskD;
-		}
+__attribute__((target("avx2")))
+static inline __m256i mul_avx2(__m256i lo, __m256i hi, __m256i x)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
 
-		if((Px == 0) && (Qx == 0))
-			curr_broken_disk = prev_broken_disk;
+	return _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+				_mm256_shuffle_epi8(hi, _mm256_and_si256(
+						_mm256_srli_epi16(x, 4), mask)));
+}
 
-		if(curr_broken_disk >= data_disks + 2)
-			broken_status = 2;
+__attribute__((target("avx2")))
+static void recov_data2_avx2(size_t bytes, uint8_t *p, uint8_t *q,
+			     uint8_t *dp, uint8_t *dq,
+			     uint8_t pbmul, uint8_t qmul)
+{
+	uint8_t pblo[16], pbhi[16], qlo[16], qhi[16];
+	__m256i vpblo, vpbhi, vqlo, vqhi, px, qx, db;
+	size_t i;
+
+	make_nibble_tables(pbmul, pblo, pbhi);
+	make_nibble_tables(qmul, qlo, qhi);
+	vpblo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)pblo));
+	vpbhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)pbhi));
+	vqlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)qlo));
+	vqhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)qhi));
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		px = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(p + i)),
+				      _mm256_loadu_si256((__m256i *)(dp + i)));
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(q + i)),
+				      _mm256_loadu_si256((__m256i *)(dq + i)));
+		db = _mm256_xor_si256(mul_avx2(vpblo, vpbhi, px),
+				      mul_avx2(vqlo, vqhi, qx));
+		_mm256_storeu_si256((__m256i *)(dq + i), db);
+		_mm256_storeu_si256((__m256i *)(dp + i),
+				    _mm256_xor_si256(db, px));
+	}
+	recov_data2_range(i, bytes, p, q, dp, dq, pblo, pbhi, qlo, qhi);
+}
+
+__attribute__((target("avx2")))
+static void recov_datap_avx2(size_t bytes, uint8_t *p, uint8_t *q,
+			     uint8_t *dq, uint8_t qmul)
+{
+	uint8_t qlo[16], qhi[16];
+	__m256i vqlo, vqhi, qx;
+	size_t i;
+
+	make_nibble_tables(qmul, qlo, qhi);
+	vqlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)qlo));
+	vqhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)qhi));
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(q + i)),
+				      _mm256_loadu_si256((__m256i *)(dq + i)));
+		qx = mul_avx2(vqlo, vqhi, qx);
+		_mm256_storeu_si256((__m256i *)(dq + i), qx);
+		_mm256_storeu_si256((__m256i *)(p + i),
+				    _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(p + i)),
+						     qx));
+	}
+	recov_datap_range(i, bytes, p, q, dq, qlo, qhi);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i mul_avx512(__m512i lo, __m512i hi, __m512i x)
+{
+	const __m512i mask = _mm512_set1_epi8(0x0f);
+
+	return _mm512_xor_si512(_mm512_shuffle_epi8(lo, _mm512_and_si512(x, mask)),
+				_mm512_shuffle_epi8(hi, _mm512_and_si512(
+						_mm512_srli_epi16(x, 4), mask)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void recov_data2_avx512(size_t bytes, uint8_t *p, uint8_t *q,
+			       uint8_t *dp, uint8_t *dq,
+			       uint8_t pbmul, uint8_t qmul)
+{
+	uint8_t pblo[16], pbhi[16], qlo[16], qhi[16];
+	__m512i vpblo, vpbhi, vqlo, vqhi, px, qx, db;
+	size_t i;
+
+	make_nibble_tables(pbmul, pblo, pbhi);
+	make_nibble_tables(qmul, qlo, qhi);
+	vpblo = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)pblo));
+	vpbhi = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)pbhi));
+	vqlo = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)qlo));
+	vqhi = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)qhi));
+
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		px = _mm512_xor_si512(_mm512_loadu_si512(p + i),
+				      _mm512_loadu_si512(dp + i));
+		qx = _mm512_xor_si512(_mm512_loadu_si512(q + i),
+				      _mm512_loadu_si512(dq + i));
+		db = _mm512_xor_si512(mul_avx512(vpblo, vpbhi, px),
+				      mul_avx512(vqlo, vqhi, qx));
+		_mm512_storeu_si512(dq + i, db);
+		_mm512_storeu_si512(dp + i, _mm512_xor_si512(db, px));
+	}
+	recov_data2_range(i, bytes, p, q, dp, dq, pblo, pbhi, qlo, qhi);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void recov_datap_avx512(size_t bytes, uint8_t *p, uint8_t *q,
+			       uint8_t *dq, uint8_t qmul)
+{
+	uint8_t qlo[16], qhi[16];
+	__m512i vqlo, vqhi, qx;
+	size_t i;
+
+	make_nibble_tables(qmul, qlo, qhi);
+	vqlo = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)qlo));
+	vqhi = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)qhi));
+
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		qx = _mm512_xor_si512(_mm512_loadu_si512(q + i),
+				      _mm512_loadu_si512(dq + i));
+		qx = mul_avx512(vqlo, vqhi, qx);
+		_mm512_storeu_si512(dq + i, qx);
+		_mm512_storeu_si512(p + i,
+				    _mm512_xor_si512(_mm512_loadu_si512(p + i), qx));
+	}
+	recov_datap_range(i, bytes, p, q, dq, qlo, qhi);
+}
+
+__attribute__((target("gfni,avx512f,avx512bw")))
+static void recov_data2_gfni_avx512(size_t bytes, uint8_t *p, uint8_t *q,
+				    uint8_t *dp, uint8_t *dq,
+				    uint8_t pbmul, uint8_t qmul)
+{
+	uint8_t pblo[16], pbhi[16], qlo[16], qhi[16];
+	const __m512i mpb = _mm512_set1_epi64(gf_affine_matrix(pbmul));
+	const __m512i mq = _mm512_set1_epi64(gf_affine_matrix(qmul));
+	__m512i px, qx, db;
+	size_t i;
+
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		px = _mm512_xor_si512(_mm512_loadu_si512(p + i),
+				      _mm512_loadu_si512(dp + i));
+		qx = _mm512_xor_si512(_mm512_loadu_si512(q + i),
+				      _mm512_loadu_si512(dq + i));
+		db = _mm512_xor_si512(_mm512_gf2p8affine_epi64_epi8(px, mpb, 0),
+				      _mm512_gf2p8affine_epi64_epi8(qx, mq, 0));
+		_mm512_storeu_si512(dq + i, db);
+		_mm512_storeu_si512(dp + i, _mm512_xor_si512(db, px));
+	}
+	if (i < bytes) {
+		make_nibble_tables(pbmul, pblo, pbhi);
+		make_nibble_tables(qmul, qlo, qhi);
+		recov_data2_range(i, bytes, p, q, dp, dq, pblo, pbhi, qlo, qhi);
+	}
+}
+
+__attribute__((target("gfni,avx512f,avx512bw")))
+static void recov_datap_gfni_avx512(size_t bytes, uint8_t *p, uint8_t *q,
+				    uint8_t *dq, uint8_t qmul)
+{
+	uint8_t qlo[16], qhi[16];
+	const __m512i mq = _mm512_set1_epi64(gf_affine_matrix(qmul));
+	__m512i qx;
+	size_t i;
+
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		qx = _mm512_xor_si512(_mm512_loadu_si512(q + i),
+				      _mm512_loadu_si512(dq + i));
+		qx = _mm512_gf2p8affine_epi64_epi8(qx, mq, 0);
+		_mm512_storeu_si512(dq + i, qx);
+		_mm512_storeu_si512(p + i,
+				    _mm512_xor_si512(_mm512_loadu_si512(p + i), qx));
+	}
+	if (i < bytes) {
+		make_nibble_tables(qmul, qlo, qhi);
+		recov_datap_range(i, bytes, p, q, dq, qlo, qhi);
+	}
+}
+#endif /* RESTRIPE_X86 */
+
+/* In increasing order of preference */
+static const struct raid6_recov_calls raid6_recov_algos[] = {
+	{ recov_data2_table, recov_datap_table, NULL, "table" },
+	{ recov_data2_nibble, recov_datap_nibble, NULL, "nibble" },
+#ifdef RESTRIPE_X86
+	{ recov_data2_ssse3, recov_datap_ssse3, cpu_has_ssse3, "ssse3" },
+	{ recov_data2_avx2, recov_datap_avx2, cpu_has_avx2, "avx2" },
+	{ recov_data2_avx512, recov_datap_avx512, cpu_has_avx512, "avx512" },
+	{ recov_data2_gfni_avx512, recov_datap_gfni_avx512,
+	  cpu_has_gfni_avx512, "gfni-avx512" },
+#endif
+	{ NULL, NULL, NULL, NULL }
+};
+
+static const struct raid6_recov_calls *raid6_recov_algo;
+static unsigned long raid6_recov_speed;
+
+/*
+ * Like the kernel's raid6 and xor code, pick each implementation by
+ * running all the usable candidates over a few small buffers for a
+ * fixed time and keeping the fastest.  This is done once, the first
+ * time any parity is needed.  Speeds are in MB/s of data read.
+ */
+#define BENCH_DISKS	8
+#define BENCH_SIZE	4096
+#define BENCH_NSEC	2000000ULL
+
+static uint8_t *bench_bufs[BENCH_DISKS + 2];
+static uint8_t *bench_scratch[4];
+
+static unsigned long long bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long bench_mbps(unsigned long long bytes,
+				unsigned long long nsec)
+{
+	if (!nsec)
+		nsec = 1;
+	return bytes * 1000 / nsec;
+}
+
+static unsigned long bench_xor(const struct xor_calls *x)
+{
+	unsigned long long start = bench_now(), end, n = 0;
+
+	do {
+		x->gen((char *)bench_bufs[BENCH_DISKS], (char **)bench_bufs,
+		       BENCH_DISKS, BENCH_SIZE);
+		n++;
+		end = bench_now();
+	} while (end - start < BENCH_NSEC);
+
+	return bench_mbps(n * BENCH_DISKS * BENCH_SIZE, end - start);
+}
+
+static unsigned long bench_raid6(const struct raid6_calls *r)
+{
+	unsigned long long start = bench_now(), end, n = 0;
+
+	do {
+		r->gen(bench_bufs[BENCH_DISKS], bench_bufs[BENCH_DISKS + 1],
+		       bench_bufs, BENCH_DISKS, BENCH_SIZE);
+		n++;
+		end = bench_now();
+	} while (end - start < BENCH_NSEC);
+
+	return bench_mbps(n * BENCH_DISKS * BENCH_SIZE, end - start);
+}
+
+static unsigned long bench_raid6_recov(const struct raid6_recov_calls *r)
+{
+	unsigned long long start = bench_now(), end, n = 0;
+	uint8_t *p = bench_bufs[BENCH_DISKS], *q = bench_bufs[BENCH_DISKS + 1];
+
+	do {
+		/* one two-data and one data+P recovery per pass */
+		r->data2(BENCH_SIZE, p, q, bench_bufs[0], bench_bufs[1],
+			 0x8e, 0x47);
+		r->datap(BENCH_SIZE, p, q, bench_bufs[2], 0x47);
+		n++;
+		end = bench_now();
+	} while (end - start < BENCH_NSEC);
+
+	return bench_mbps(n * 7 * BENCH_SIZE, end - start);
+}
+
+static void bench_teardown(void)
+{
+	int i;
+
+	for (i = 0; i < BENCH_DISKS + 2; i++) {
+		free(bench_bufs[i]);
+		bench_bufs[i] = NULL;
+	}
+	for (i = 0; i < 4; i++) {
+		free(bench_scratch[i]);
+		bench_scratch[i] = NULL;
+	}
+}
+
+static int bench_setup(void)
+{
+	unsigned int seed = 0x6d646164;
+	int i, j;
+
+	for (i = 0; i < BENCH_DISKS + 2; i++) {
+		if (posix_memalign((void **)&bench_bufs[i], 64, BENCH_SIZE)) {
+			bench_teardown();
+			return -1;
+		}
+		for (j = 0; j < BENCH_SIZE; j++) {
+			seed = seed * 1103515245 + 12345;
+			bench_bufs[i][j] = seed >> 16;
+		}
+	}
+	for (i = 0; i < 4; i++)
+		if (posix_memalign((void **)&bench_scratch[i], 64,
+				   BENCH_SIZE)) {
+			bench_teardown();
+			return -1;
+		}
+	return 0;
+}
+
+/*
+ * A candidate is only selected if it gives the same result as the
+ * first (byte-wise) entry of its table on the benchmark data.  Each
+ * check runs over a short odd-sized tail as well as the full buffer,
+ * so the scalar cleanup of the SIMD variants is covered too.
+ */
+static int bench_check_sizes[] = { BENCH_SIZE, BENCH_SIZE - 64 + 3, 0 };
+
+static int bench_check_xor(const struct xor_calls *x)
+{
+	char *want = (char *)bench_scratch[0], *got = (char *)bench_scratch[1];
+	int *size;
+
+	for (size = bench_check_sizes; *size; size++) {
+		memset(want, 0x5a, BENCH_SIZE);
+		memset(got, 0xa5, BENCH_SIZE);
+		xor_algos[0].gen(want, (char **)bench_bufs, BENCH_DISKS, *size);
+		x->gen(got, (char **)bench_bufs, BENCH_DISKS, *size);
+		if (memcmp(want, got, *size) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static int bench_check_raid6(const struct raid6_calls *r)
+{
+	uint8_t *wp = bench_scratch[0], *wq = bench_scratch[1];
+	uint8_t *gp = bench_scratch[2], *gq = bench_scratch[3];
+	int *size;
+
+	for (size = bench_check_sizes; *size; size++) {
+		memset(gp, 0xa5, BENCH_SIZE);
+		memset(gq, 0xa5, BENCH_SIZE);
+		raid6_algos[0].gen(wp, wq, bench_bufs, BENCH_DISKS, *size);
+		r->gen(gp, gq, bench_bufs, BENCH_DISKS, *size);
+		if (memcmp(wp, gp, *size) != 0 || memcmp(wq, gq, *size) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static int bench_check_raid6_recov(const struct raid6_recov_calls *rr)
+{
+	const struct raid6_recov_calls *ref = &raid6_recov_algos[0];
+	uint8_t **s = bench_scratch;
+	uint8_t *p = bench_bufs[BENCH_DISKS], *q = bench_bufs[BENCH_DISKS + 1];
+	int *size;
+
+	for (size = bench_check_sizes; *size; size++) {
+		/* data2 changes dp and dq, datap changes p and dq */
+		memcpy(s[0], bench_bufs[0], BENCH_SIZE);
+		memcpy(s[1], bench_bufs[1], BENCH_SIZE);
+		memcpy(s[2], bench_bufs[0], BENCH_SIZE);
+		memcpy(s[3], bench_bufs[1], BENCH_SIZE);
+		ref->data2(*size, p, q, s[0], s[1], 0x8e, 0x47);
+		rr->data2(*size, p, q, s[2], s[3], 0x8e, 0x47);
+		if (memcmp(s[0], s[2], *size) != 0 ||
+		    memcmp(s[1], s[3], *size) != 0)
+			return 0;
+
+		memcpy(s[0], p, BENCH_SIZE);
+		memcpy(s[1], bench_bufs[2], BENCH_SIZE);
+		memcpy(s[2], p, BENCH_SIZE);
+		memcpy(s[3], bench_bufs[2], BENCH_SIZE);
+		ref->datap(*size, s[0], q, s[1], 0x47);
+		rr->datap(*size, s[2], q, s[3], 0x47);
+		if (memcmp(s[0], s[2], *size) != 0 ||
+		    memcmp(s[1], s[3], *size) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static void bench_parity_algorithms(int verbose)
+{
+	const struct xor_calls *x;
+	const struct raid6_calls *r;
+	const struct raid6_recov_calls *rr;
+	unsigned long speed;
+
+	if (!tables_ready)
+		make_tables();
+
+	if (bench_setup() != 0) {
+		/* No memory to test with; only the reference is trusted */
+		xor_algo = xor_algos;
+		raid6_algo = raid6_algos;
+		raid6_recov_algo = raid6_recov_algos;
+		return;
+	}
+
+	for (x = xor_algos; x->gen; x++) {
+		if (x->valid && !x->valid())
+			continue;
+		if (!bench_check_xor(x)) {
+			pr_err("parity: xor %s gives wrong results, not using it\n",
+			       x->name);
+			continue;
+		}
+		speed = bench_xor(x);
+		if (verbose > 0)
+			pr_err("parity: xor %-12s %8lu MB/s\n", x->name, speed);
+		if (!xor_algo || speed > xor_speed) {
+			xor_algo = x;
+			xor_speed = speed;
+		}
+	}
+	for (r = raid6_algos; r->gen; r++) {
+		if (r->valid && !r->valid())
+			continue;
+		if (!bench_check_raid6(r)) {
+			pr_err("parity: gen %s gives wrong results, not using it\n",
+			       r->name);
+			continue;
+		}
+		speed = bench_raid6(r);
+		if (verbose > 0)
+			pr_err("parity: gen %-12s %8lu MB/s\n", r->name, speed);
+		if (!raid6_algo || speed > raid6_speed) {
+			raid6_algo = r;
+			raid6_speed = speed;
+		}
+	}
+	for (rr = raid6_recov_algos; rr->data2; rr++) {
+		if (rr->valid && !rr->valid())
+			continue;
+		if (!bench_check_raid6_recov(rr)) {
+			pr_err("parity: rec %s gives wrong results, not using it\n",
+			       rr->name);
+			continue;
+		}
+		speed = bench_raid6_recov(rr);
+		if (verbose > 0)
+			pr_err("parity: rec %-12s %8lu MB/s\n", rr->name, speed);
+		if (!raid6_recov_algo || speed > raid6_recov_speed) {
+			raid6_recov_algo = rr;
+			raid6_recov_speed = speed;
+		}
+	}
+
+	bench_teardown();
+}
+
+/*
+ * Make sure xor_blocks(), qsyndrome() and the recovery routines have
+ * an implementation chosen.  With verbose > 0 every candidate timing
+ * and the final choice are reported.
+ */
+void select_parity_algorithms(int verbose)
+{
+	if (xor_algo && raid6_algo && raid6_recov_algo) {
+		if (verbose <= 0)
+			return;
+	} else
+		bench_parity_algorithms(verbose);
+
+	if (verbose > 0)
+		pr_err("parity: using xor %s (%lu MB/s), gen %s (%lu MB/s), recovery %s (%lu MB/s)\n",
+		       xor_algo->name, xor_speed,
+		       raid6_algo->name, raid6_speed,
+		       raid6_recov_algo->name, raid6_recov_speed);
+}
+
+/* Report the chosen implementations, for --detail-platform */
+void print_parity_algorithms(void)
+{
+	select_parity_algorithms(0);
+
+	printf("     Parity XOR : %s (%lu MB/s)\n", xor_algo->name, xor_speed);
+	printf("RAID-6 Syndrome : %s (%lu MB/s)\n", raid6_algo->name,
+	       raid6_speed);
+	printf("RAID-6 Recovery : %s (%lu MB/s)\n", raid6_recov_algo->name,
+	       raid6_recov_speed);
+}
+
+/* Following was taken from linux/drivers/md/raid6recov.c */
+
+/* Recover two failed data blocks. */
+
+void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
+		       uint8_t **ptrs, int neg_offset)
+{
+	uint8_t *p, *q, *dp, *dq;
+	uint8_t pbmul;		/* P multiplier for B data */
+	uint8_t qmul;		/* Q multiplier (for both) */
+
+	if (faila > failb) {
+		int t = faila;
+		faila = failb;
+		failb = t;
+	}
+
+	if (neg_offset) {
+		p = ptrs[-1];
+		q = ptrs[-2];
+	} else {
+		p = ptrs[disks-2];
+		q = ptrs[disks-1];
+	}
+
+	/* Compute syndrome with zero for the missing data pages
+	   Use the dead data pages as temporary storage for
+	   delta p and delta q */
+	dp = ptrs[faila];
+	ptrs[faila] = zero;
+	dq = ptrs[failb];
+	ptrs[failb] = zero;
+
+	qsyndrome(dp, dq, ptrs, disks-2, bytes);
+
+	/* Restore pointer table */
+	ptrs[faila]   = dp;
+	ptrs[failb]   = dq;
+
+	/* Now, pick the proper multipliers */
+	pbmul = raid6_gfexi[failb-faila];
+	qmul  = raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]];
+
+	/* Now do it... */
+	if (!raid6_recov_algo)
+		select_parity_algorithms(0);
+	raid6_recov_algo->data2(bytes, p, q, dp, dq, pbmul, qmul);
+}
+
+/* Recover failure of one data block plus the P block */
+void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs,
+		       int neg_offset)
+{
+	uint8_t *p, *q, *dq;
+	uint8_t qmul;		/* Q multiplier */
+
+	if (neg_offset) {
+		p = ptrs[-1];
+		q = ptrs[-2];
+	} else {
+		p = ptrs[disks-2];
+		q = ptrs[disks-1];
+	}
+
+	/* Compute syndrome with zero for the missing data page
+	   Use the dead data page as temporary storage for delta q */
+	dq = ptrs[faila];
+	ptrs[faila] = zero;
+
+	qsyndrome(p, dq, ptrs, disks-2, bytes);
+
+	/* Restore pointer table */
+	ptrs[faila]   = dq;
+
+	/* Now, pick the proper multiplier */
+	qmul  = raid6_gfinv[raid6_gfexp[faila]];
+
+	/* Now do it... */
+	if (!raid6_recov_algo)
+		select_parity_algorithms(0);
+	raid6_recov_algo->datap(bytes, p, q, dq, qmul);
+}
+
+/* Try to find out if a specific disk has a problem */
+int raid6_check_disks(int data_disks, int start, int chunk_size,
+		      int level, int layout, int diskP, int diskQ,
+		      uint8_t *p, uint8_t *q, char **stripes)
+{
+	int i;
+	int data_id, diskD;
+	uint8_t Px, Qx;
+	int curr_broken_disk = -1;
+	int prev_broken_disk = -1;
+	int broken_status = 0;
+	struct stripe_map *map = NULL;
+	const int *syn = NULL;
+
+	for(i = 0; i < chunk_size; i++) {
+		Px = (uint8_t)stripes[diskP][i] ^ (uint8_t)p[i];
+		Qx = (uint8_t)stripes[diskQ][i] ^ (uint8_t)q[i];
+
+		if((Px != 0) && (Qx == 0))
+			curr_broken_disk = diskP;
+
+		if((Px == 0) && (Qx != 0))
+			curr_broken_disk = diskQ;
+
+		if((Px != 0) && (Qx != 0)) {
+			data_id = (raid6_gflog[Qx] - raid6_gflog[Px]);
+			if(data_id < 0) data_id += 255;
+			if (!map) {
+				/* data_id is a syndrome slot */
+				map = stripe_map_get(data_disks + 2, level,
+						     layout);
+				syn = stripe_map_syndrome(map,
+							  start/chunk_size);
+			}
+			if (data_id < map->syndrome_disks)
+				diskD = syn[data_id];
+			else
+				diskD = data_disks + 2;
+			curr_broken_disk = diskD;
+		}
+
+		if((Px == 0) && (Qx == 0))
+			curr_broken_disk = prev_broken_disk;
+
+		if(curr_broken_disk >= data_disks + 2)
+			broken_status = 2;
 
 		switch(broken_status) {
 		case 0:
@@ -512,6 +1707,170 @@ int raid6_check_disks(int data_disks, int start, int chunk_size,
 	return curr_broken_disk;
 }
 
+/*
+ * save_stripes() and restore_stripes() move a batch of stripes with one
+ * request per device, scattering the chunks straight into (or gathering
+ * them from) their place in memory.  The requests for all devices are
+ * issued together through stripe_io_submit().  This bounds the memory
+ * used for a batch, summed over all devices.
+ */
+#define STRIPE_BATCH_SIZE (32 * 1024 * 1024)
+
+static unsigned long long stripe_batch(int raid_disks, int chunk_size,
+				       unsigned long long stripes)
+{
+	unsigned long long batch;
+
+	batch = STRIPE_BATCH_SIZE / raid_disks / chunk_size;
+	if (batch < 1)
+		batch = 1;
+	if (batch > IOV_MAX)
+		batch = IOV_MAX;
+	if (batch > stripes)
+		batch = stripes;
+	return batch;
+}
+
+/*
+ * Transfer 'cnt' chunks between 'fd' at 'offset' and the buffers listed
+ * in 'iov'.  The whole span is tried in as few requests as possible; if
+ * that fails, the remaining chunks are retried one at a time so that a
+ * single bad sector only costs the chunk it is in.  Failed chunks are
+ * flagged in 'bad' when it is given.
+ * Returns the number of failed chunks.
+ */
+static int span_io(int fd, int do_write, struct iovec *iov, int cnt,
+		   unsigned long long offset, char *bad)
+{
+	size_t chunk_size = iov[0].iov_len;
+	int done = 0;
+	int failed = 0;
+
+	while (done < cnt) {
+		int n = cnt - done;
+		off_t pos = offset + done * chunk_size;
+		ssize_t rv;
+
+		if (n > IOV_MAX)
+			n = IOV_MAX;
+		if (do_write)
+			rv = pwritev(fd, iov + done, n, pos);
+		else
+			rv = preadv(fd, iov + done, n, pos);
+		if (rv != (ssize_t)(n * chunk_size))
+			break;
+		done += n;
+	}
+
+	for (; done < cnt; done++) {
+		off_t pos = offset + done * chunk_size;
+		ssize_t rv;
+
+		if (do_write)
+			rv = pwrite(fd, iov[done].iov_base, chunk_size, pos);
+		else
+			rv = pread(fd, iov[done].iov_base, chunk_size, pos);
+		if (rv != (ssize_t)chunk_size) {
+			failed++;
+			if (bad)
+				bad[done] = 1;
+		}
+	}
+	return failed;
+}
+
+/*
+ * Rebuild the missing data blocks of one stripe read by save_stripes().
+ * 'buf' holds the data blocks in order, 'p' and 'q' the parity.
+ * fblock[] lists the failed blocks in that order, data_disks standing
+ * for P and data_disks + 1 for Q.
+ */
+static int recover_stripe(struct stripe_map *map, unsigned long long stripe,
+			  int chunk_size, int failed, int *fdisk, int *fblock,
+			  char *buf, char *p, char *q)
+{
+	int data_disks = map->data_disks;
+	int raid_disks = map->raid_disks;
+	int i;
+
+	if (failed == 0 || fblock[0] >= data_disks)
+		/* all data disks are good */
+		return 0;
+
+	if (failed == 1 || fblock[1] >= data_disks+1) {
+		/* one failed data disk and good parity */
+		char *bufs[data_disks];
+		for (i=0; i < data_disks; i++)
+			if (fblock[0] == i)
+				bufs[i] = p;
+			else
+				bufs[i] = buf + i*chunk_size;
+
+		xor_blocks(buf + fblock[0]*chunk_size,
+			   bufs, data_disks, chunk_size);
+	} else if (failed > 2 || map->level != 6)
+		/* too much failure */
+		return -1;
+	else {
+		/* RAID6 computations needed. */
+		uint8_t *bufs[data_disks+4];
+		const int *blocks = stripe_map_blocks(map, stripe);
+		const int *syn = stripe_map_syndrome(map, stripe);
+		int syndrome_disks = map->syndrome_disks;
+		int snum;
+
+		if (is_ddf(map->layout)) {
+			/* q over 'raid_disks' blocks, in device order.
+			 * 'p' and 'q' get to be all zero
+			 */
+			for (snum = 0; snum < raid_disks; snum++) {
+				/* i is the logical block number, so is
+				 * index to 'buf'.  The physical disk
+				 * number is the syndrome number.
+				 */
+				i = blocks[syn[snum]];
+				if (i < 0)
+					bufs[snum] = zero;
+				else
+					bufs[snum] = (uint8_t*)buf + chunk_size * i;
+			}
+		} else {
+			/* for md, q is over 'data_disks' blocks,
+			 * starting immediately after 'q'
+			 * Note that for the '_6' variety, the p block
+			 * makes a hole, which the map skips.
+			 */
+			for (snum = 0; snum < syndrome_disks; snum++) {
+				/* i is the logical block number, so is index to 'buf'.
+				 * snum is syndrome disk for which 0 is immediately after Q
+				 */
+				i = blocks[syn[snum]];
+				bufs[snum] = (uint8_t*)buf + chunk_size * i;
+
+				if (fblock[0] == i)
+					fdisk[0] = snum;
+				if (fblock[1] == i)
+					fdisk[1] = snum;
+			}
+		}
+
+		/* Place P and Q blocks at end of bufs */
+		bufs[syndrome_disks] = (uint8_t*)p;
+		bufs[syndrome_disks+1] = (uint8_t*)q;
+
+		if (fblock[1] == data_disks)
+			/* One data failed, and parity failed */
+			raid6_datap_recov(syndrome_disks+2, chunk_size,
+					  fdisk[0], bufs, 0);
+		else {
+			/* Two data blocks failed, P,Q OK */
+			raid6_2data_recov(syndrome_disks+2, chunk_size,
+					  fdisk[0], fdisk[1], bufs, 0);
+		}
+	}
+	return 0;
+}
+
 /*******************************************************************************
  * Function:	save_stripes
  * Description:
@@ -536,7 +1895,7 @@ int raid6_check_disks(int data_disks, int start, int chunk_size,
  *	length	-	: length of data to read (must be stripe-aligned)
  *			  [bytes]
  *	buf		: buffer for data. It is large enough to hold
- *			  one stripe. It is stripe aligned
+ *			  'length' bytes. Not used if dest is given
  * Returns:
  *	 0 : success
  *	-1 : fail
@@ -552,10 +1911,20 @@ int save_stripes(int *source, unsigned long long *offsets,
 	int disk;
 	int i;
 	unsigned long long length_test;
+	unsigned long long batch;
+	struct stripe_map *map;
+	struct iovec *iov = NULL;
+	struct stripe_io *io = NULL;
+	unsigned long long *destpos = NULL;
+	char *parity = NULL;
+	char *out = NULL;
+	char *bad = NULL;
+	int rv = -1;
 
 	if (!tables_ready)
 		make_tables();
 	ensure_zero_has_size(chunk_size);
+	map = stripe_map_get(raid_disks, level, layout);
 
 	len = data_disks * chunk_size;
 	length_test = length / len;
@@ -569,135 +1938,139 @@ int save_stripes(int *source, unsigned long long *offsets,
 			length_test);
 		abort();
 	}
+	if (length == 0)
+		return 0;
+
+	/* Each device is read for a whole batch of stripes at once, data
+	 * chunks land directly in their place in 'out' and P/Q in 'parity'.
+	 */
+	batch = stripe_batch(raid_disks, chunk_size, length / len);
+	if (posix_memalign((void **)&parity, 4096, batch * 2 * chunk_size))
+		goto out;
+	if (dest && posix_memalign((void **)&out, 4096, batch * len))
+		goto out;
+	iov = xmalloc(raid_disks * batch * sizeof(*iov));
+	bad = xmalloc(raid_disks * batch);
+	io = xmalloc((raid_disks > nwrites ? raid_disks : nwrites) *
+		     sizeof(*io));
+	if (dest) {
+		destpos = xmalloc(nwrites * sizeof(*destpos));
+		for (i = 0; i < nwrites; i++) {
+			off_t pos = lseek(dest[i], 0, SEEK_CUR);
+
+			if (pos < 0)
+				goto out;
+			destpos[i] = pos;
+		}
+	}
 
 	while (length > 0) {
-		int failed = 0;
-		int fdisk[3], fblock[3];
-		for (disk = 0; disk < raid_disks ; disk++) {
-			unsigned long long offset;
-			int dnum;
-
-			offset = (start/chunk_size/data_disks)*chunk_size;
-			dnum = geo_map(disk < data_disks ? disk : data_disks - disk - 1,
-				       start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (dnum < 0) abort();
-			if (source[dnum] < 0 ||
-			    lseek64(source[dnum],
-				    offsets[dnum] + offset, 0) < 0 ||
-			    read(source[dnum], buf+disk * chunk_size,
-				 chunk_size) != chunk_size) {
-				if (failed <= 2) {
-					fdisk[failed] = dnum;
-					fblock[failed] = disk;
-					failed++;
-				}
+		unsigned long long first = start/chunk_size/data_disks;
+		unsigned long long n = length / len;
+		char *obuf = dest ? out : buf;
+		unsigned long long k;
+		int nio = 0;
+		int dnum;
+
+		if (n > batch)
+			n = batch;
+
+		memset(bad, 0, raid_disks * batch);
+		for (dnum = 0; dnum < raid_disks; dnum++) {
+			struct iovec *div = iov + dnum * batch;
+
+			for (k = 0; k < n; k++) {
+				int b = stripe_map_blocks(map, first + k)[dnum];
+
+				if (b >= 0)
+					div[k].iov_base = obuf + k * len +
+						b * chunk_size;
+				else if (b >= -2)
+					div[k].iov_base = parity +
+						(k * 2 - b - 1) * chunk_size;
+				else
+					abort();
+				div[k].iov_len = chunk_size;
 			}
+			if (source[dnum] < 0) {
+				memset(bad + dnum * batch, 1, n);
+				continue;
+			}
+			io[nio].fd = source[dnum];
+			io[nio].op = STRIPE_IO_READ;
+			io[nio].iov = div;
+			io[nio].iovcnt = n;
+			io[nio].offset = offsets[dnum] + first * chunk_size;
+			nio++;
+		}
+		stripe_io_submit(io, nio);
+		for (i = 0; i < nio; i++) {
+			if (io[i].res == (ssize_t)(n * chunk_size))
+				continue;
+			/* find out which chunks are bad */
+			dnum = (io[i].iov - iov) / batch;
+			span_io(io[i].fd, 0, iov + dnum * batch, n,
+				io[i].offset, bad + dnum * batch);
 		}
-		if (failed == 0 || fblock[0] >= data_disks)
-			/* all data disks are good */
-			;
-		else if (failed == 1 || fblock[1] >= data_disks+1) {
-			/* one failed data disk and good parity */
-			char *bufs[data_disks];
-			for (i=0; i < data_disks; i++)
-				if (fblock[0] == i)
-					bufs[i] = buf + data_disks*chunk_size;
-				else
-					bufs[i] = buf + i*chunk_size;
 
-			xor_blocks(buf + fblock[0]*chunk_size,
-				   bufs, data_disks, chunk_size);
-		} else if (failed > 2 || level != 6)
-			/* too much failure */
-			return -1;
-		else {
-			/* RAID6 computations needed. */
-			uint8_t *bufs[data_disks+4];
-			int qdisk;
-			int syndrome_disks;
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (is_ddf(layout)) {
-				/* q over 'raid_disks' blocks, in device order.
-				 * 'p' and 'q' get to be all zero
-				 */
-				for (i = 0; i < raid_disks; i++)
-					bufs[i] = zero;
-				for (i = 0; i < data_disks; i++) {
-					int dnum = geo_map(i,
-							   start/chunk_size/data_disks,
-							   raid_disks, level, layout);
-					int snum;
-					/* i is the logical block number, so is index to 'buf'.
-					 * dnum is physical disk number
-					 * and thus the syndrome number.
-					 */
-					snum = dnum;
-					bufs[snum] = (uint8_t*)buf + chunk_size * i;
-				}
-				syndrome_disks = raid_disks;
-			} else {
-				/* for md, q is over 'data_disks' blocks,
-				 * starting immediately after 'q'
-				 * Note that for the '_6' variety, the p block
-				 * makes a hole that we need to be careful of.
-				 */
-				int j;
-				int snum = 0;
-				for (j = 0; j < raid_disks; j++) {
-					int dnum = (qdisk + 1 + j) % raid_disks;
-					if (dnum == disk || dnum == qdisk)
-						continue;
-					for (i = 0; i < data_disks; i++)
-						if (geo_map(i,
-							    start/chunk_size/data_disks,
-							    raid_disks, level, layout) == dnum)
-							break;
-					/* i is the logical block number, so is index to 'buf'.
-					 * dnum is physical disk number
-					 * snum is syndrome disk for which 0 is immediately after Q
-					 */
-					bufs[snum] = (uint8_t*)buf + chunk_size * i;
+		for (k = 0; k < n; k++) {
+			unsigned long long stripe = first + k;
+			const int *disks = stripe_map_disks(map, stripe);
+			int failed = 0;
+			int fdisk[3], fblock[3];
 
-					if (fblock[0] == i)
-						fdisk[0] = snum;
-					if (fblock[1] == i)
-						fdisk[1] = snum;
-					snum++;
+			for (disk = 0; disk < raid_disks ; disk++) {
+				dnum = disks[disk < data_disks ? disk : data_disks - disk - 1];
+				if (dnum < 0) abort();
+				if (bad[dnum * batch + k] && failed <= 2) {
+					fdisk[failed] = dnum;
+					fblock[failed] = disk;
+					failed++;
 				}
-
-				syndrome_disks = data_disks;
-			}
-
-			/* Place P and Q blocks at end of bufs */
-			bufs[syndrome_disks] = (uint8_t*)buf + chunk_size * data_disks;
-			bufs[syndrome_disks+1] = (uint8_t*)buf + chunk_size * (data_disks+1);
-
-			if (fblock[1] == data_disks)
-				/* One data failed, and parity failed */
-				raid6_datap_recov(syndrome_disks+2, chunk_size,
-						  fdisk[0], bufs, 0);
-			else {
-				/* Two data blocks failed, P,Q OK */
-				raid6_2data_recov(syndrome_disks+2, chunk_size,
-						  fdisk[0], fdisk[1], bufs, 0);
 			}
+			if (recover_stripe(map, stripe, chunk_size,
+					   failed, fdisk, fblock,
+					   obuf + k * len,
+					   parity + k * 2 * chunk_size,
+					   parity + (k * 2 + 1) * chunk_size))
+				goto out;
 		}
+
 		if (dest) {
+			struct iovec v = { .iov_base = out, .iov_len = n * len };
+
+			for (i = 0; i < nwrites; i++) {
+				io[i].fd = dest[i];
+				io[i].op = STRIPE_IO_WRITE;
+				io[i].iov = &v;
+				io[i].iovcnt = 1;
+				io[i].offset = destpos[i];
+				destpos[i] += n * len;
+			}
+			stripe_io_submit(io, nwrites);
 			for (i = 0; i < nwrites; i++)
-				if (write(dest[i], buf, len) != len)
-					return -1;
+				if (io[i].res != (ssize_t)(n * len))
+					goto out;
 		} else {
-			/* build next stripe in buffer */
-			buf += len;
+			/* build next stripes in buffer */
+			buf += n * len;
 		}
-		length -= len;
-		start += len;
+		length -= n * len;
+		start += n * len;
 	}
-	return 0;
+	/* leave the targets where plain write()s would have */
+	for (i = 0; dest && i < nwrites; i++)
+		if (lseek(dest[i], destpos[i], SEEK_SET) < 0)
+			goto out;
+	rv = 0;
+out:
+	free(parity);
+	free(out);
+	free(iov);
+	free(io);
+	free(destpos);
+	free(bad);
+	return rv;
 }
 
 /* Restore data:
@@ -708,7 +2081,8 @@ int save_stripes(int *source, unsigned long long *offsets,
  *  A start and length.
  * The length must be a multiple of the stripe size.
  *
- * We build a full stripe in memory and then write it out.
+ * We build a batch of full stripes in memory, one span per device, and
+ * then write each span out with a single request.
  * We assume that there are enough working devices.
  */
 int restore_stripes(int *dest, unsigned long long *offsets,
@@ -720,12 +2094,25 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 	char *stripe_buf;
 	char **stripes = xmalloc(raid_disks * sizeof(char*));
 	char **blocks = xmalloc(raid_disks * sizeof(char*));
+	struct stripe_map *map = stripe_map_get(raid_disks, level, layout);
+	struct iovec *iov = NULL;
+	struct iovec *div = NULL;
+	struct stripe_io *io = NULL;
+	unsigned long long batch;
+	unsigned long long span;
 	int i;
 	int rv;
 
 	int data_disks = raid_disks - (level == 0 ? 0 : level <= 5 ? 1 : 2);
+	unsigned int len = data_disks * chunk_size;
+
+	batch = stripe_batch(raid_disks, chunk_size,
+			     (length + len - 1) / len);
+	if (batch == 0)
+		batch = 1;
+	span = batch * chunk_size;
 
-	if (posix_memalign((void**)&stripe_buf, 4096, raid_disks * chunk_size))
+	if (posix_memalign((void**)&stripe_buf, 4096, raid_disks * span))
 		stripe_buf = NULL;
 
 	if (zero == NULL || chunk_size > zero_size) {
@@ -740,97 +2127,122 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 		rv = -2;
 		goto abort;
 	}
-	for (i = 0; i < raid_disks; i++)
-		stripes[i] = stripe_buf + i * chunk_size;
+	iov = xmalloc(batch * data_disks * sizeof(*iov));
+	div = xmalloc(raid_disks * sizeof(*div));
+	io = xmalloc(raid_disks * sizeof(*io));
 	while (length > 0) {
-		unsigned int len = data_disks * chunk_size;
-		unsigned long long offset;
-		int disk, qdisk;
-		int syndrome_disks;
-		if (length < len) {
+		unsigned long long first = start/chunk_size/data_disks;
+		unsigned long long offset = first * chunk_size;
+		unsigned long long n = length / len;
+		unsigned long long k;
+		int nio;
+
+		if (n == 0) {
 			rv = -3;
 			goto abort;
 		}
-		for (i = 0; i < data_disks; i++) {
-			int disk = geo_map(i, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
-			if (src_buf == NULL) {
-				/* read from file */
-				if (lseek64(source, read_offset, 0) !=
-					 (off64_t)read_offset) {
-					rv = -1;
-					goto abort;
-				}
-				if (read(source,
-					 stripes[disk],
-					 chunk_size) != chunk_size) {
-					rv = -1;
-					goto abort;
-				}
-			} else {
-				/* read from input buffer */
-				memcpy(stripes[disk],
-				       src_buf + read_offset,
-				       chunk_size);
+		if (n > batch)
+			n = batch;
+
+		/* Gather the data for the whole batch */
+		for (k = 0; k < n; k++) {
+			const int *disks = stripe_map_disks(map, first + k);
+
+			for (i = 0; i < data_disks; i++) {
+				struct iovec *v = &iov[k * data_disks + i];
+
+				v->iov_base = stripe_buf + disks[i] * span +
+					k * chunk_size;
+				v->iov_len = chunk_size;
+				if (src_buf)
+					/* read from input buffer */
+					memcpy(v->iov_base,
+					       src_buf + read_offset,
+					       chunk_size);
+				read_offset += chunk_size;
 			}
-			read_offset += chunk_size;
 		}
+		if (src_buf == NULL &&
+		    span_io(source, 0, iov, n * data_disks,
+			    read_offset - n * len, NULL)) {
+			/* read from file */
+			rv = -1;
+			goto abort;
+		}
+
 		/* We have the data, now do the parity */
-		offset = (start/chunk_size/data_disks) * chunk_size;
-		switch (level) {
-		case 4:
-		case 5:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
-			for (i = 0; i < data_disks; i++)
-				blocks[i] = stripes[(disk+1+i) % raid_disks];
-			xor_blocks(stripes[disk], blocks, data_disks, chunk_size);
-			break;
-		case 6:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (is_ddf(layout)) {
-				/* q over 'raid_disks' blocks, in device order.
-				 * 'p' and 'q' get to be all zero
-				 */
-				for (i = 0; i < raid_disks; i++)
-					if (i == disk || i == qdisk)
-						blocks[i] = (char*)zero;
-					else
-						blocks[i] = stripes[i];
-				syndrome_disks = raid_disks;
-			} else {
-				/* for md, q is over 'data_disks' blocks,
-				 * starting immediately after 'q'
-				 */
+		for (k = 0; k < n; k++) {
+			unsigned long long stripe = first + k;
+			const int *disks = stripe_map_disks(map, stripe);
+			int disk, qdisk;
+			int syndrome_disks;
+
+			for (i = 0; i < raid_disks; i++)
+				stripes[i] = stripe_buf + i * span +
+					k * chunk_size;
+
+			switch (level) {
+			case 4:
+			case 5:
+				disk = disks[-1];
 				for (i = 0; i < data_disks; i++)
-					blocks[i] = stripes[(qdisk+1+i) % raid_disks];
+					blocks[i] = stripes[(disk+1+i) % raid_disks];
+				xor_blocks(stripes[disk], blocks, data_disks, chunk_size);
+				break;
+			case 6:
+				disk = disks[-1];
+				qdisk = disks[-2];
+				if (is_ddf(layout)) {
+					/* q over 'raid_disks' blocks, in device order.
+					 * 'p' and 'q' get to be all zero
+					 */
+					for (i = 0; i < raid_disks; i++)
+						if (i == disk || i == qdisk)
+							blocks[i] = (char*)zero;
+						else
+							blocks[i] = stripes[i];
+					syndrome_disks = raid_disks;
+				} else {
+					/* for md, q is over 'data_disks' blocks,
+					 * starting immediately after 'q' and
+					 * skipping 'p'
+					 */
+					const int *syn = stripe_map_syndrome(map, stripe);
+
+					for (i = 0; i < data_disks; i++)
+						blocks[i] = stripes[syn[i]];
 
-				syndrome_disks = data_disks;
+					syndrome_disks = data_disks;
+				}
+				qsyndrome((uint8_t*)stripes[disk],
+					  (uint8_t*)stripes[qdisk],
+					  (uint8_t**)blocks,
+					  syndrome_disks, chunk_size);
+				break;
 			}
-			qsyndrome((uint8_t*)stripes[disk],
-				  (uint8_t*)stripes[qdisk],
-				  (uint8_t**)blocks,
-				  syndrome_disks, chunk_size);
-			break;
 		}
-		for (i=0; i < raid_disks ; i++)
+
+		/* and write out one span per device, all at once */
+		nio = 0;
+		for (i = 0; i < raid_disks ; i++)
 			if (dest[i] >= 0) {
-				if (lseek64(dest[i],
-					 offsets[i]+offset, 0) < 0) {
-					rv = -1;
-					goto abort;
-				}
-				if (write(dest[i], stripes[i],
-					 chunk_size) != chunk_size) {
-					rv = -1;
-					goto abort;
-				}
+				div[i].iov_base = stripe_buf + i * span;
+				div[i].iov_len = n * chunk_size;
+				io[nio].fd = dest[i];
+				io[nio].op = STRIPE_IO_WRITE;
+				io[nio].iov = &div[i];
+				io[nio].iovcnt = 1;
+				io[nio].offset = offsets[i] + offset;
+				nio++;
 			}
-		length -= len;
-		start += len;
+		stripe_io_submit(io, nio);
+		for (i = 0; i < nio; i++)
+			if (io[i].res != (ssize_t)(n * chunk_size)) {
+				rv = -1;
+				goto abort;
+			}
+		length -= n * len;
+		start += n * len;
 	}
 	rv = 0;
 
@@ -838,6 +2250,9 @@ abort:
 	free(stripe_buf);
 	free(stripes);
 	free(blocks);
+	free(iov);
+	free(div);
+	free(io);
 	return rv;
 }
 
@@ -857,14 +2272,19 @@ int test_stripes(int *source, unsigned long long *offsets,
 	int i;
 	int diskP, diskQ;
 	int data_disks = raid_disks - (level == 5 ? 1: 2);
+	struct stripe_map *map = stripe_map_get(raid_disks, level, layout);
+	int syndrome_disks = map->syndrome_disks;
 
 	if (!tables_ready)
 		make_tables();
+	ensure_zero_has_size(chunk_size);
 
 	for ( i = 0 ; i < raid_disks ; i++)
 		stripes[i] = stripe_buf + i * chunk_size;
 
 	while (length > 0) {
+		const int *disks = stripe_map_disks(map, start/chunk_size);
+		const int *syn;
 		int disk;
 
 		for (i = 0 ; i < raid_disks ; i++) {
@@ -879,23 +2299,24 @@ int test_stripes(int *source, unsigned long long *offsets,
 				return -1;
 			}
 		}
-		for (i = 0 ; i < data_disks ; i++) {
-			int disk = geo_map(i, start/chunk_size, raid_disks,
-					   level, layout);
-			blocks[i] = stripes[disk];
-			printf("%d->%d\n", i, disk);
-		}
+		for (i = 0 ; i < data_disks ; i++)
+			printf("%d->%d\n", i, disks[i]);
 		switch(level) {
 		case 6:
-			qsyndrome(p, q, (uint8_t**)blocks, data_disks, chunk_size);
-			diskP = geo_map(-1, start/chunk_size, raid_disks,
-				       level, layout);
+			diskP = disks[-1];
+			diskQ = disks[-2];
+			syn = stripe_map_syndrome(map, start/chunk_size);
+			for (i = 0; i < syndrome_disks; i++)
+				if (syn[i] == diskP || syn[i] == diskQ)
+					blocks[i] = (char *)zero;
+				else
+					blocks[i] = stripes[syn[i]];
+			qsyndrome(p, q, (uint8_t**)blocks, syndrome_disks,
+				  chunk_size);
 			if (memcmp(p, stripes[diskP], chunk_size) != 0) {
 				printf("P(%d) wrong at %llu\n", diskP,
 				       start / chunk_size);
 			}
-			diskQ = geo_map(-2, start/chunk_size, raid_disks,
-				       level, layout);
 			if (memcmp(q, stripes[diskQ], chunk_size) != 0) {
 				printf("Q(%d) wrong at %llu\n", diskQ,
 				       start / chunk_size);
@@ -946,6 +2367,7 @@ int main(int argc, char *argv[])
 	char *err = NULL;
 	if (argc < 10) {
 		fprintf(stderr, "Usage: test_stripe save/restore file raid_disks chunk_size level layout start length devices...\n");
+		fprintf(stderr, "       a device may be given as 'missing'\n");
 		exit(1);
 	}
 	if (strcmp(argv[1], "save")==0)
@@ -986,6 +2408,12 @@ int main(int argc, char *argv[])
 	}
 	for (i=0; i<raid_disks; i++) {
 		char *p;
+
+		/* 'missing' for a failed device, as save_stripes() sees it */
+		if (strcmp(argv[9+i], "missing") == 0) {
+			fds[i] = -1;
+			continue;
+		}
 		p = strchr(argv[9+i], ':');
 
 		if(p != NULL) {
@@ -1038,3 +2466,769 @@ int main(int argc, char *argv[])
 }
 
 #endif /* MAIN */
+
+#ifdef BENCH
+
+/*
+ * bench_stripe - throughput of the parity kernels and geo_map().
+ *
+ * Results are printed one per line as CSV:
+ *   op,impl,level,layout,disks,chunk,value,unit
+ * 'disks' is the number of raid disks, 'chunk' is in bytes and 'value'
+ * is MB/s of stripe data for the parity kernels, or millions of lookups
+ * per second for geo_map.  Fields that don't apply are left as '-'.
+ */
+
+static unsigned long long bench_msec = 20;
+static int bench_all;
+
+static int default_chunks[] = { 4096, 16384, 65536, 262144, 1048576, 0 };
+static int default_disks[] = { 3, 4, 6, 8, 12, 16, 24, 32, 0 };
+
+static int *parse_list(char *str, int scale)
+{
+	int *list = xcalloc(strlen(str) + 2, sizeof(int));
+	int n = 0;
+	char *tok;
+
+	for (tok = strtok(str, ","); tok; tok = strtok(NULL, ","))
+		list[n++] = atoi(tok) * scale;
+	list[n] = 0;
+	return list;
+}
+
+static void report(const char *op, const char *impl, int level,
+		   const char *layout, int disks, int chunk,
+		   double value, const char *unit)
+{
+	printf("%s,%s,", op, impl);
+	if (level >= 0)
+		printf("%d,", level);
+	else
+		printf("-,");
+	printf("%s,%d,", layout ? layout : "-", disks);
+	if (chunk > 0)
+		printf("%d,", chunk);
+	else
+		printf("-,");
+	printf("%.1f,%s\n", value, unit);
+	fflush(stdout);
+}
+
+/* Run 'stmt' until bench_msec has passed; 'rate' gets runs per second */
+#define BENCH_RATE(rate, stmt)						\
+	do {								\
+		unsigned long long _start = bench_now(), _end, _n = 0;	\
+		do {							\
+			stmt;						\
+			_n++;						\
+			_end = bench_now();				\
+		} while (_end - _start < bench_msec * 1000000ULL);	\
+		rate = _n * 1e9 / (_end - _start);			\
+	} while (0)
+
+static uint8_t **bench_stripe_alloc(int disks, int chunk)
+{
+	uint8_t **blocks = xcalloc(disks, sizeof(*blocks));
+	unsigned int seed = disks * 31 + chunk;
+	int i, j;
+
+	for (i = 0; i < disks; i++) {
+		if (posix_memalign((void **)&blocks[i], 4096, chunk)) {
+			fprintf(stderr, "bench_stripe: out of memory\n");
+			exit(1);
+		}
+		for (j = 0; j < chunk; j++) {
+			seed = seed * 1103515245 + 12345;
+			blocks[i][j] = seed >> 16;
+		}
+	}
+	return blocks;
+}
+
+static void bench_stripe_free(uint8_t **blocks, int disks)
+{
+	int i;
+
+	for (i = 0; i < disks; i++)
+		free(blocks[i]);
+	free(blocks);
+}
+
+static void bench_kernels(int disks, int chunk)
+{
+	uint8_t **blocks = bench_stripe_alloc(disks, chunk);
+	double mb = (double)(disks - 2) * chunk / 1000000;
+	const struct xor_calls *xsel = xor_algo, *x;
+	const struct raid6_calls *rsel = raid6_algo, *r;
+	const struct raid6_recov_calls *rrsel = raid6_recov_algo, *rr;
+	volatile int sink;
+	int diskP, diskQ;
+	double rate;
+
+	ensure_zero_has_size(chunk);
+
+	for (x = xor_algos; x->gen; x++) {
+		if ((!bench_all && x != xsel) || (x->valid && !x->valid()))
+			continue;
+		xor_algo = x;
+		/* RAID-5 parity over the other raid_disks - 1 blocks */
+		BENCH_RATE(rate, xor_blocks((char *)blocks[disks - 1],
+					    (char **)blocks, disks - 1, chunk));
+		report("xor", x->name, 5, NULL, disks, chunk,
+		       rate * (disks - 1) * chunk / 1000000, "MB/s");
+	}
+	xor_algo = xsel;
+
+	for (r = raid6_algos; r->gen; r++) {
+		if ((!bench_all && r != rsel) || (r->valid && !r->valid()))
+			continue;
+		raid6_algo = r;
+		BENCH_RATE(rate, qsyndrome(blocks[disks - 2], blocks[disks - 1],
+					   blocks, disks - 2, chunk));
+		report("qsyndrome", r->name, 6, NULL, disks, chunk,
+		       rate * mb, "MB/s");
+	}
+
+	/* The recovery runs need a consistent stripe */
+	raid6_algo = rsel;
+	qsyndrome(blocks[disks - 2], blocks[disks - 1], blocks, disks - 2,
+		  chunk);
+
+	for (rr = raid6_recov_algos; rr->data2; rr++) {
+		if ((!bench_all && rr != rrsel) ||
+		    (rr->valid && !rr->valid()))
+			continue;
+		raid6_recov_algo = rr;
+		if (disks >= 4) {
+			BENCH_RATE(rate, raid6_2data_recov(disks, chunk, 0,
+							   disks - 3, blocks, 0));
+			report("raid6_2data_recov", rr->name, 6, NULL, disks,
+			       chunk, rate * mb, "MB/s");
+		}
+		BENCH_RATE(rate, raid6_datap_recov(disks, chunk, 0, blocks, 0));
+		report("raid6_datap_recov", rr->name, 6, NULL, disks, chunk,
+		       rate * mb, "MB/s");
+	}
+	raid6_recov_algo = rrsel;
+
+	/* raid6_check_disks() wants P and Q where geo_map() puts them */
+	diskP = geo_map(-1, 0, disks, 6, ALGORITHM_PARITY_N);
+	diskQ = geo_map(-2, 0, disks, 6, ALGORITHM_PARITY_N);
+	qsyndrome(blocks[diskP], blocks[diskQ], blocks, disks - 2, chunk);
+	BENCH_RATE(rate, sink = raid6_check_disks(disks - 2, 0, chunk, 6,
+						  ALGORITHM_PARITY_N,
+						  diskP, diskQ,
+						  blocks[diskP], blocks[diskQ],
+						  (char **)blocks));
+	(void)sink;
+	report("raid6_check_disks", "byte", 6, "parity-last", disks, chunk,
+	       rate * mb, "MB/s");
+
+	bench_stripe_free(blocks, disks);
+}
+
+/* Map every block of one stripe, as save_stripes() does */
+static int map_stripe(unsigned long long stripe, int disks, int level,
+		      int layout)
+{
+	int data_disks = disks - (level == 6 ? 2 : 1);
+	int b, sum = 0;
+
+	for (b = (level == 6 ? -2 : -1); b < data_disks; b++)
+		sum += geo_map(b, stripe, disks, level, layout);
+	return sum;
+}
+
+/* The same, through a stripe_map */
+static int map_stripe_table(struct stripe_map *map, unsigned long long stripe)
+{
+	const int *disks = stripe_map_disks(map, stripe);
+	int b, sum = 0;
+
+	for (b = (map->level == 6 ? -2 : -1); b < map->data_disks; b++)
+		sum += disks[b];
+	return sum;
+}
+
+static void bench_geo_map(int level, mapping_t *layouts, int disks)
+{
+	int seen[ALGORITHM_PARITY_0_6 + 1] = { 0 };
+	int data_disks = disks - (level == 6 ? 2 : 1);
+	mapping_t *m;
+	double rate;
+
+	for (m = layouts; m->name; m++) {
+		unsigned long long stripe = 0;
+		struct stripe_map *map;
+		volatile int sink;
+
+		if (m->num < 0 || m->num > ALGORITHM_PARITY_0_6 ||
+		    seen[m->num])
+			continue;
+		seen[m->num] = 1;
+		BENCH_RATE(rate, sink = map_stripe(stripe++, disks, level,
+						   m->num));
+		(void)sink;
+		report("geo_map", "switch", level, m->name, disks, -1,
+		       rate * (data_disks + (level == 6 ? 2 : 1)) / 1000000,
+		       "Mlookups/s");
+
+		map = stripe_map_get(disks, level, m->num);
+		stripe = 0;
+		BENCH_RATE(rate, sink = map_stripe_table(map, stripe++));
+		report("geo_map", "table", level, m->name, disks, -1,
+		       rate * (data_disks + (level == 6 ? 2 : 1)) / 1000000,
+		       "Mlookups/s");
+	}
+}
+
+static int bench_wanted(char *ops, const char *op)
+{
+	char *p;
+	int len = strlen(op);
+
+	if (!ops)
+		return 1;
+	for (p = strstr(ops, op); p; p = strstr(p + 1, op))
+		if ((p == ops || p[-1] == ',') &&
+		    (p[len] == ',' || p[len] == '\0'))
+			return 1;
+	return 0;
+}
+
+/*
+ * -T: check every usable implementation against the byte-wise one and,
+ * for recovery, that two lost blocks of a real stripe come back.
+ * Prints one line per implementation and fails if any is wrong.
+ */
+static int check_one(const char *op, const char *impl, int ok)
+{
+	printf("check,%s,%s,%s\n", op, impl, ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+static int check_recovery(int disks, int chunk)
+{
+	uint8_t **blocks = bench_stripe_alloc(disks, chunk);
+	uint8_t **orig = bench_stripe_alloc(disks, chunk);
+	int a = 0, b = disks - 3, i, ok;
+
+	ensure_zero_has_size(chunk);
+	raid6_algo = raid6_algos;
+	qsyndrome(blocks[disks - 2], blocks[disks - 1], blocks, disks - 2,
+		  chunk);
+	for (i = 0; i < disks; i++)
+		memcpy(orig[i], blocks[i], chunk);
+
+	memset(blocks[a], 0, chunk);
+	memset(blocks[b], 0, chunk);
+	raid6_2data_recov(disks, chunk, a, b, blocks, 0);
+	ok = memcmp(blocks[a], orig[a], chunk) == 0 &&
+		memcmp(blocks[b], orig[b], chunk) == 0;
+
+	memset(blocks[a], 0, chunk);
+	memset(blocks[disks - 2], 0, chunk);
+	raid6_datap_recov(disks, chunk, a, blocks, 0);
+	ok = ok && memcmp(blocks[a], orig[a], chunk) == 0 &&
+		memcmp(blocks[disks - 2], orig[disks - 2], chunk) == 0;
+
+	bench_stripe_free(blocks, disks);
+	bench_stripe_free(orig, disks);
+	return ok;
+}
+
+static int check_kernels(int *disks)
+{
+	const struct xor_calls *x;
+	const struct raid6_calls *r;
+	const struct raid6_recov_calls *rr;
+	int *d, ok, failed = 0;
+
+	if (bench_setup() != 0) {
+		fprintf(stderr, "bench_stripe: out of memory\n");
+		return 1;
+	}
+	for (x = xor_algos; x->gen; x++)
+		if (!x->valid || x->valid())
+			failed += check_one("xor", x->name, bench_check_xor(x));
+	for (r = raid6_algos; r->gen; r++)
+		if (!r->valid || r->valid())
+			failed += check_one("qsyndrome", r->name,
+					    bench_check_raid6(r));
+	for (rr = raid6_recov_algos; rr->data2; rr++) {
+		if (rr->valid && !rr->valid())
+			continue;
+		ok = bench_check_raid6_recov(rr);
+		raid6_recov_algo = rr;
+		for (d = disks; *d; d++)
+			if (*d >= 4)
+				ok = ok && check_recovery(*d, 4096 + 192);
+		failed += check_one("recovery", rr->name, ok);
+	}
+	bench_teardown();
+	return failed ? 1 : 0;
+}
+
+char const Name[] = "bench_stripe";
+int main(int argc, char *argv[])
+{
+	int *chunks = default_chunks;
+	int *disks = default_disks;
+	char *ops = NULL;
+	int check = 0;
+	int *c, *d;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ac:d:o:t:T")) != -1) {
+		switch (opt) {
+		case 'a':
+			bench_all = 1;
+			break;
+		case 'T':
+			check = 1;
+			break;
+		case 'c':
+			chunks = parse_list(optarg, 1024);
+			break;
+		case 'd':
+			disks = parse_list(optarg, 1);
+			break;
+		case 'o':
+			ops = optarg;
+			break;
+		case 't':
+			bench_msec = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: bench_stripe [-a] [-c chunkK,...] [-d disks,...] [-o op,...] [-t msec]\n");
+			fprintf(stderr, "       bench_stripe -T [-d disks,...]\n");
+			fprintf(stderr, "  -a   time every usable implementation, not just the selected one\n");
+			fprintf(stderr, "  -T   check every usable implementation against the byte-wise one\n");
+			fprintf(stderr, "  -o   any of kernels,geo_map (default: all)\n");
+			exit(2);
+		}
+	}
+	for (d = disks; *d; d++)
+		if (*d < 3 || *d > 255) {
+			fprintf(stderr, "bench_stripe: disks must be 3..255, not %d\n",
+				*d);
+			exit(2);
+		}
+
+	if (check) {
+		if (!tables_ready)
+			make_tables();
+		exit(check_kernels(disks));
+	}
+
+	select_parity_algorithms(0);
+
+	printf("op,impl,level,layout,disks,chunk,value,unit\n");
+	if (bench_wanted(ops, "kernels"))
+		for (d = disks; *d; d++)
+			for (c = chunks; *c; c++)
+				bench_kernels(*d, *c);
+	if (bench_wanted(ops, "geo_map"))
+		for (d = disks; *d; d++) {
+			bench_geo_map(5, r5layout, *d);
+			bench_geo_map(6, r6layout, *d);
+		}
+	exit(0);
+}
+
+#endif /* BENCH */
+
+#ifdef SIM
+
+/*
+ * reshape_sim - try the backup policy of child_monitor() without a
+ * kernel or real devices.
+ *
+ * An in-place reshape (as many data disks after as before, so that every
+ * stripe goes through the backup) of an array of sparse files is run in
+ * virtual time:
+ *  - the kernel reshapes at a fixed speed, but not past what has been
+ *    backed up or outside the suspended region, and at half that speed
+ *    while the members are being read for the backup;
+ *  - a device completes a request after a fixed latency, at a fixed
+ *    bandwidth, and a flush takes a fixed time.
+ * The windows and the suspended region are sized by the functions that
+ * child_monitor() and progress_reshape() use, backups are pipelined as
+ * in child_monitor() unless -S is given, and the data is really read
+ * with save_stripes() and written to a backup file.
+ */
+
+#include "reshape_policy.h"
+
+static int sim_chunk = 512 * 1024;
+static unsigned long long sim_lat_us = 100;
+static unsigned long long sim_bw = 200;		/* MB/s per device */
+static unsigned long long sim_speed;		/* MB/s per device */
+static unsigned long long sim_flush_us = 1000;
+
+/* suspend times: [0] is under 1ms, [i] under 2^i ms */
+#define SIM_BUCKETS 16
+static unsigned long long sim_hist[SIM_BUCKETS];
+
+/* when suspend_point got past each point */
+static struct sim_mark {
+	unsigned long long point;
+	unsigned long long us;
+} *sim_marks;
+static int sim_nmarks;
+
+static void sim_mark(unsigned long long point, unsigned long long us)
+{
+	if ((sim_nmarks & (sim_nmarks - 1)) == 0)
+		sim_marks = xrealloc(sim_marks, (sim_nmarks ? sim_nmarks * 2 : 1)
+				     * sizeof(*sim_marks));
+	sim_marks[sim_nmarks].point = point;
+	sim_marks[sim_nmarks].us = us;
+	sim_nmarks++;
+}
+
+static unsigned long long sim_suspended_at(unsigned long long sector)
+{
+	int lo = 0, hi = sim_nmarks - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (sim_marks[mid].point > sector)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return sim_marks[lo].us;
+}
+
+/* time for one request of 'bytes' */
+static unsigned long long sim_io_us(unsigned long long bytes)
+{
+	return sim_lat_us + bytes / sim_bw;
+}
+
+static int sim_open(char *dir, unsigned long long size)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/reshape_sim.XXXXXX", dir);
+	fd = mkstemp(path);
+	if (fd < 0 || unlink(path) || ftruncate(fd, size)) {
+		fprintf(stderr, "reshape_sim: cannot create %s: %s\n",
+			path, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+struct sim_window {
+	unsigned long long start, end;	/* array sectors */
+	unsigned long stripes;
+	int part;
+	unsigned long long begin_us;	/* started reading */
+	unsigned long long io_us;	/* time its IO took */
+};
+
+char const Name[] = "reshape_sim";
+int main(int argc, char *argv[])
+{
+	struct reshape reshape;
+	int disks = 8, level = 5, layout = ALGORITHM_LEFT_SYMMETRIC;
+	unsigned long long size = 256;	/* MB per device */
+	unsigned long long step_us = 100;
+	int sequential = 0;
+	char *dir = "/tmp";
+	int data, *fds, bfd, opt, i;
+	unsigned long long *offsets;
+	unsigned long long array_size, blocks, target, max_progress;
+	unsigned long stripes, unit;
+	char *wbuf[2];
+	int cur = 0, part = 0;
+	unsigned long long part_end[2] = { 0, 0 };
+	struct sim_window rd = { 0 }, wr = { 0 }, *win = NULL;
+	int reading = 0, writing = 0, nwin = 0, win0 = 0;
+	unsigned long long read_until = 0, write_until = 0, busy_until = 0;
+	unsigned long long now = 0, suspend_point = 0, backup_point = 0;
+	unsigned long long next_point = 0;
+	double progress = 0, rate;
+	unsigned long long run_us = 0, run_start = 0, stall_us = 0, last_us = 0;
+	unsigned long long flush_us = 0, suspend_us = 0, max_suspend = 0;
+	unsigned long long backup_bytes = 0, windows = 0, window_stripes = 0;
+	struct timespec t0, t1;
+
+	memset(&reshape, 0, sizeof(reshape));
+	while ((opt = getopt(argc, argv, "b:c:d:f:k:l:L:m:p:s:St:")) != -1) {
+		switch (opt) {
+		case 'b':
+			sim_bw = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			sim_chunk = atoi(optarg) * 1024;
+			break;
+		case 'd':
+			disks = atoi(optarg);
+			break;
+		case 'f':
+			sim_flush_us = strtoull(optarg, NULL, 10);
+			break;
+		case 'k':
+			sim_speed = strtoull(optarg, NULL, 10);
+			break;
+		case 'l':
+			level = atoi(optarg);
+			break;
+		case 'L':
+			sim_lat_us = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			reshape.max_suspend_ms = atoi(optarg);
+			break;
+		case 'p':
+			dir = optarg;
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			sequential = 1;
+			break;
+		case 't':
+			step_us = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: reshape_sim [-d disks] [-l 5|6] [-c chunkK] [-s MB-per-device]\n");
+			fprintf(stderr, "                   [-m max-suspend-ms] [-L latency-us] [-b device-MB/s]\n");
+			fprintf(stderr, "                   [-k reshape-MB/s-per-device] [-f flush-us] [-S]\n");
+			fprintf(stderr, "                   [-t step-us] [-p dir]\n");
+			fprintf(stderr, "  -S   back up without overlapping reads and writes\n");
+			exit(2);
+		}
+	}
+	if ((level != 5 && level != 6) || disks < level - 2 || disks > 255 ||
+	    sim_chunk < 4096 || sim_chunk % 4096 || !size || !sim_bw ||
+	    !step_us) {
+		fprintf(stderr, "reshape_sim: bad parameters\n");
+		exit(2);
+	}
+	/* each stripe is read and written again */
+	if (!sim_speed || sim_speed > sim_bw / 2)
+		sim_speed = sim_bw / 2;
+	if (!sim_speed)
+		sim_speed = 1;
+
+	data = disks - (level == 6 ? 2 : 1);
+	size = size * 1024 * 1024 / sim_chunk * (sim_chunk / 512);
+	array_size = size * data;
+	reshape.level = level;
+	reshape.parity = level == 6 ? 2 : 1;
+	reshape.before.data_disks = reshape.after.data_disks = data;
+	reshape.before.layout = reshape.after.layout = layout;
+	reshape.backup_blocks = compute_backup_blocks(sim_chunk, sim_chunk,
+						      data, data);
+	blocks = reshape_backup_size(&reshape, size);
+	if (blocks >= size / 2) {
+		fprintf(stderr, "reshape_sim: devices too small for a %lluK backup\n",
+			blocks / 2);
+		exit(2);
+	}
+	stripes = blocks / (sim_chunk / 512) / data;
+	unit = reshape.backup_blocks / (sim_chunk / 512) / data;
+	if (unit < 1 || unit > stripes)
+		unit = stripes;
+
+	fds = xcalloc(disks, sizeof(*fds));
+	offsets = xcalloc(disks, sizeof(*offsets));
+	for (i = 0; i < disks; i++)
+		fds[i] = sim_open(dir, size * 512);
+	bfd = sim_open(dir, 4096 + 2 * blocks * 512);
+	if (posix_memalign((void **)&wbuf[0], 4096, blocks * 512) ||
+	    posix_memalign((void **)&wbuf[1], 4096, blocks * 512)) {
+		fprintf(stderr, "reshape_sim: out of memory\n");
+		exit(1);
+	}
+	win = xcalloc(2 * (array_size / reshape.backup_blocks + 2),
+		      sizeof(*win));
+	select_parity_algorithms(0);
+	/* bandwidth in bytes per microsecond */
+	sim_speed = sim_speed * 1024 * 1024 / 1000000;
+	sim_bw = sim_bw * 1024 * 1024 / 1000000;
+	if (!sim_speed || !sim_bw) {
+		fprintf(stderr, "reshape_sim: bandwidth too low\n");
+		exit(2);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (progress < array_size) {
+		unsigned long long p = progress;
+
+		/* progress_reshape(): release what is done ... */
+		while (win0 < nwin && p >= win[win0].end) {
+			unsigned long long us = now -
+				sim_suspended_at(win[win0].start);
+			int b = 0;
+
+			while (b < SIM_BUCKETS - 1 && us >= (1000ULL << b))
+				b++;
+			sim_hist[b]++;
+			suspend_us += us;
+			if (us > max_suspend)
+				max_suspend = us;
+			win0++;
+		}
+		/* ... and suspend more when needed */
+		target = suspend_target(&reshape);
+		if (suspend_point < p + target) {
+			if (suspend_point + 2 * target < array_size)
+				suspend_point += 2 * target;
+			else
+				suspend_point = array_size;
+			sim_mark(suspend_point, now);
+		}
+		max_progress = backup_point < suspend_point ?
+			backup_point : suspend_point;
+
+		/* child_monitor(): forget_backup() of what is done ... */
+		for (i = 0; i < 2; i++)
+			if (part_end[i] && p >= part_end[i] && !writing &&
+			    now >= busy_until) {
+				part_end[i] = 0;
+				busy_until = now + sim_io_us(4096) +
+					sim_flush_us;
+				flush_us += sim_flush_us;
+				backup_bytes += 4096;
+			}
+		/* ... and back up the next window once it is suspended */
+		if (!reading && !part_end[part] && now >= busy_until &&
+		    next_point < array_size && (!sequential || !writing)) {
+			unsigned long w = backup_window(&reshape, stripes, unit);
+			unsigned long long offset = next_point / data;
+
+			if (offset + w * (sim_chunk/512) > size)
+				w = (size - offset) / (sim_chunk/512);
+			if (w && next_point + w * (sim_chunk/512) * data <=
+			    suspend_point) {
+				rd.start = next_point;
+				rd.end = next_point +
+					w * (sim_chunk/512) * data;
+				rd.stripes = w;
+				rd.part = part;
+				rd.begin_us = now;
+				rd.io_us = sim_io_us(w * sim_chunk);
+				read_until = now + rd.io_us;
+				reading = 1;
+				if (save_stripes(fds, offsets, disks,
+						 sim_chunk, level, layout, 0,
+						 NULL, next_point * 512,
+						 w * sim_chunk * data,
+						 wbuf[cur])) {
+					fprintf(stderr, "reshape_sim: save_stripes failed\n");
+					exit(1);
+				}
+				part_end[part] = rd.end;
+				part = !part;
+				next_point = rd.end;
+				win[nwin].start = rd.start;
+				win[nwin].end = rd.end;
+				nwin++;
+			}
+		}
+		/* the writer takes a window once the last is out */
+		if (reading && now >= read_until && !writing) {
+			unsigned long long len = rd.stripes * sim_chunk * data;
+			unsigned long long us = sim_io_us(len) +
+				sim_io_us(4096) + sim_flush_us;
+
+			if (pwrite(bfd, wbuf[cur], len, 4096 + (rd.part ?
+				   blocks * 512 : 0)) != (ssize_t)len) {
+				fprintf(stderr, "reshape_sim: writing backup failed\n");
+				exit(1);
+			}
+			wr = rd;
+			wr.io_us += us;
+			write_until = now + us;
+			reading = 0;
+			writing = 1;
+			cur = !cur;
+		}
+		if (writing && now >= write_until) {
+			backup_point = wr.end;
+			writing = 0;
+			backup_time_sample(&reshape, wr.end - wr.start,
+					   wr.io_us / 1000);
+			backup_bytes += wr.stripes * sim_chunk * data + 4096;
+			flush_us += sim_flush_us;
+			windows++;
+			window_stripes += wr.stripes;
+		}
+
+		/* the kernel, in array sectors per microsecond */
+		rate = (double)sim_speed * data / 512;
+		if (reading && now < read_until)
+			rate /= 2;
+		if (progress < max_progress) {
+			progress += rate * step_us;
+			if (progress > max_progress)
+				progress = max_progress;
+			run_us += step_us;
+			last_us = now;
+		} else {
+			stall_us += step_us;
+			if (now - last_us > 3600000000ULL) {
+				fprintf(stderr, "reshape_sim: no progress at %llu of %llu sectors\n",
+					(unsigned long long)progress,
+					array_size);
+				exit(1);
+			}
+		}
+		/* progress_reshape() samples the speed while it waits */
+		if (run_us >= 100000 || (progress >= max_progress && run_us)) {
+			reshape_rate_sample(&reshape,
+					    (unsigned long long)progress -
+					    run_start, run_us / 1000);
+			run_start = progress;
+			run_us = 0;
+		}
+		now += step_us;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	printf("array: raid%d, %d devices of %lluM, %dK chunk\n", level, disks,
+	       size / 2048, sim_chunk / 1024);
+	printf("devices: %lluus latency, %lluMB/s, %lluus flush; reshape %lluMB/s per device\n",
+	       sim_lat_us, sim_bw * 1000000 / 1024 / 1024, sim_flush_us,
+	       sim_speed * 1000000 / 1024 / 1024);
+	printf("policy: max-suspend-ms %u, backup up to %lluK in units of %lluK, %s\n",
+	       reshape.max_suspend_ms, blocks / 2,
+	       (unsigned long long)unit * sim_chunk / 1024 * data,
+	       sequential ? "sequential" : "pipelined");
+	printf("duration: %.3fs, kernel held back %.3fs, flushing %.3fs\n",
+	       now / 1e6, stall_us / 1e6, flush_us / 1e6);
+	printf("backup: %llu windows, average %lluK, %lluM written\n",
+	       windows, windows ? window_stripes * sim_chunk / 1024 * data /
+	       windows : 0, backup_bytes / 1024 / 1024);
+	printf("suspended: average %.1fms, max %.1fms\n",
+	       win0 ? suspend_us / 1e3 / win0 : 0.0, max_suspend / 1e3);
+	printf("suspend time histogram (windows):\n");
+	for (i = 0; i < SIM_BUCKETS; i++) {
+		if (!sim_hist[i])
+			continue;
+		if (i == 0)
+			printf("  %6s - %6dms: %llu\n", "0", 1, sim_hist[i]);
+		else if (i == SIM_BUCKETS - 1)
+			printf("  %6d -       ms: %llu\n", 1 << (i - 1),
+			       sim_hist[i]);
+		else
+			printf("  %6d - %6dms: %llu\n", 1 << (i - 1), 1 << i,
+			       sim_hist[i]);
+	}
+	printf("final estimates: reshape %lluK/s, backup %lluK/s\n",
+	       reshape.rate / 2, reshape.backup_rate / 2);
+	printf("simulated in %.3fs\n", (t1.tv_sec - t0.tv_sec) +
+	       (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	exit(0);
+}
+
+#endif /* SIM */
@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Concurrent I/O to the member devices of an array.
+ *
+ * save_stripes() and restore_stripes() move a span of every member for
+ * each batch of stripes.  Issuing those one device after another makes a
+ * backup window cost the sum of the members' latencies; here they are
+ * all put in flight together and the caller waits for the slowest.
+ *
+ * io_uring is used when the kernel offers it, otherwise a few threads
+ * share the requests.  The engine can be forced with
+ * MDADM_STRIPE_IO=uring|threads|sync.
+ */
+
+#include "mdadm.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifndef NO_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+/* Threads working on one stripe_io_submit() call, the caller included */
+#define STRIPE_IO_THREADS 8
+
+enum stripe_io_engine {
+	ENGINE_UNSET,
+	ENGINE_URING,
+	ENGINE_THREADS,
+	ENGINE_SYNC,
+};
+
+static enum stripe_io_engine engine;
+
+/* Set by stripe_io_no_threads() */
+static bool no_threads;
+
+static void stripe_io_one(struct stripe_io *io)
+{
+	switch (io->op) {
+	case STRIPE_IO_READ:
+		io->res = preadv(io->fd, io->iov, io->iovcnt, io->offset);
+		break;
+	case STRIPE_IO_WRITE:
+		io->res = pwritev(io->fd, io->iov, io->iovcnt, io->offset);
+		break;
+	case STRIPE_IO_SYNC:
+		io->res = fdatasync(io->fd);
+		break;
+	}
+	if (io->res < 0)
+		io->res = -errno;
+}
+
+struct stripe_io_pool {
+	struct stripe_io *io;
+	int cnt;
+	int next;
+};
+
+static void *stripe_io_worker(void *arg)
+{
+	struct stripe_io_pool *pool = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+	       pool->cnt)
+		stripe_io_one(&pool->io[i]);
+	return NULL;
+}
+
+/*
+ * Threads are started per call rather than kept around: the callers do a
+ * handful of large requests at a time, and child_monitor() runs in a
+ * process forked after the first use, which would not inherit them.
+ */
+static void stripe_io_threads(struct stripe_io *io, int cnt)
+{
+	struct stripe_io_pool pool = { .io = io, .cnt = cnt, .next = 0 };
+	pthread_t threads[STRIPE_IO_THREADS - 1];
+	pthread_attr_t attr;
+	int nthreads = 0;
+	int i;
+
+	if (no_threads) {
+		for (i = 0; i < cnt; i++)
+			stripe_io_one(&io[i]);
+		return;
+	}
+
+	/* The reshape monitor runs with its memory locked */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+	while (nthreads < cnt - 1 && nthreads < STRIPE_IO_THREADS - 1) {
+		if (pthread_create(&threads[nthreads], &attr,
+				   stripe_io_worker, &pool))
+			break;
+		nthreads++;
+	}
+	pthread_attr_destroy(&attr);
+	stripe_io_worker(&pool);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+#ifndef NO_IO_URING
+
+#define URING_ENTRIES 64
+
+/* The ring is used by one caller at a time, others use threads */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct uring {
+	int fd;
+	pid_t pid;
+	unsigned int sq_entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+} ring = { .fd = -1 };
+
+static void uring_exit(void)
+{
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_sz);
+	if (ring.cq_ring && ring.cq_ring != ring.sq_ring)
+		munmap(ring.cq_ring, ring.cq_ring_sz);
+	if (ring.sq_ring)
+		munmap(ring.sq_ring, ring.sq_ring_sz);
+	if (ring.fd >= 0)
+		close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+}
+
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	/* A ring inherited over fork() belongs to the parent */
+	if (ring.fd >= 0 && ring.pid == getpid())
+		return 0;
+	uring_exit();
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd < 0) {
+		ring.fd = -1;
+		return -1;
+	}
+	ring.pid = getpid();
+	ring.sq_entries = p.sq_entries;
+
+	ring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_ring_sz > ring.sq_ring_sz)
+			ring.sq_ring_sz = ring.cq_ring_sz;
+		ring.cq_ring_sz = ring.sq_ring_sz;
+	}
+	ring.sq_ring = mmap(NULL, ring.sq_ring_sz, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring.fd,
+			    IORING_OFF_SQ_RING);
+	if (ring.sq_ring == MAP_FAILED) {
+		ring.sq_ring = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.cq_ring = ring.sq_ring;
+	else {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_sz,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring.fd,
+				    IORING_OFF_CQ_RING);
+		if (ring.cq_ring == MAP_FAILED) {
+			ring.cq_ring = NULL;
+			goto fail;
+		}
+	}
+	ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		ring.sqes = NULL;
+		goto fail;
+	}
+
+	sq = ring.sq_ring;
+	ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+	cq = ring.cq_ring;
+	ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+fail:
+	uring_exit();
+	return -1;
+}
+
+/*
+ * Wait for 'want' completions.  This never returns early: the requests
+ * point into the caller's buffers and their completions carry indices
+ * into its array, so none may be left for a later call to find.  If the
+ * kernel stops accepting io_uring_enter(), the completions are still
+ * posted to the ring, so wait for them there and report the ring as
+ * dead once they are all in.
+ */
+static int uring_reap(struct stripe_io *io, int want)
+{
+	bool dead = false;
+	int got = 0;
+
+	while (got < want) {
+		unsigned int head = *ring.cq_head;
+		unsigned int tail = __atomic_load_n(ring.cq_tail,
+						    __ATOMIC_ACQUIRE);
+
+		if (head == tail) {
+			if (dead)
+				usleep(1000);
+			else if (syscall(__NR_io_uring_enter, ring.fd, 0,
+					 want - got, IORING_ENTER_GETEVENTS,
+					 NULL, 0) < 0 &&
+				 errno != EINTR && errno != EAGAIN &&
+				 errno != EBUSY)
+				dead = true;
+			continue;
+		}
+		for (; head != tail; head++, got++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+			io[cqe->user_data].res = cqe->res;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return dead ? -1 : 0;
+}
+
+/* Returns -1 if the ring could not be used, the requests are then untouched */
+static int stripe_io_uring(struct stripe_io *io, int cnt)
+{
+	int done = 0;
+	int i;
+
+	while (done < cnt) {
+		unsigned int tail = *ring.sq_tail;
+		int n = cnt - done;
+		int submitted = 0;
+
+		if (n > (int)ring.sq_entries)
+			n = ring.sq_entries;
+		for (i = 0; i < n; i++) {
+			struct stripe_io *r = &io[done + i];
+			unsigned int idx = (tail + i) & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->fd = r->fd;
+			if (r->op == STRIPE_IO_SYNC) {
+				sqe->opcode = IORING_OP_FSYNC;
+				sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			} else {
+				sqe->opcode = r->op == STRIPE_IO_WRITE ?
+					IORING_OP_WRITEV : IORING_OP_READV;
+				sqe->addr = (unsigned long)r->iov;
+				sqe->len = r->iovcnt;
+				sqe->off = r->offset;
+			}
+			sqe->user_data = done + i;
+			ring.sq_array[idx] = idx;
+			r->res = -EIO;
+		}
+		__atomic_store_n(ring.sq_tail, tail + n, __ATOMIC_RELEASE);
+
+		while (submitted < n) {
+			int rv = syscall(__NR_io_uring_enter, ring.fd,
+					 n - submitted, 0, 0, NULL, 0);
+
+			if (rv < 0 && errno == EINTR)
+				continue;
+			if (rv <= 0)
+				break;
+			submitted += rv;
+		}
+		if (uring_reap(io, submitted) != 0 || submitted < n) {
+			/*
+			 * The ring is not usable.  Nothing is in flight any
+			 * more; tearing it down drops any entries the kernel
+			 * did not take, and the rest is finished without it.
+			 */
+			uring_exit();
+			engine = ENGINE_THREADS;
+			if (done + submitted == 0)
+				return -1;
+			stripe_io_threads(io + done + submitted,
+					  cnt - done - submitted);
+			break;
+		}
+		done += n;
+	}
+
+	/* Kernels without vectored ops reject them, redo those directly */
+	for (i = 0; i < cnt; i++)
+		if (io[i].res == -EINVAL || io[i].res == -EOPNOTSUPP)
+			stripe_io_one(&io[i]);
+	return 0;
+}
+#endif /* NO_IO_URING */
+
+static void stripe_io_select(void)
+{
+	char *env = getenv("MDADM_STRIPE_IO");
+
+	if (env && strcmp(env, "sync") == 0)
+		engine = ENGINE_SYNC;
+	else if (env && strcmp(env, "threads") == 0)
+		engine = ENGINE_THREADS;
+	else {
+#ifndef NO_IO_URING
+		if (uring_init() == 0)
+			engine = ENGINE_URING;
+		else
+#endif
+			engine = ENGINE_THREADS;
+	}
+	dprintf("using %s\n", stripe_io_engine_name());
+}
+
+const char *stripe_io_engine_name(void)
+{
+	switch (engine) {
+	case ENGINE_URING:
+		return "io_uring";
+	case ENGINE_THREADS:
+		return "threads";
+	case ENGINE_SYNC:
+		return "sync";
+	default:
+		return "unset";
+	}
+}
+
+static pthread_once_t selected = PTHREAD_ONCE_INIT;
+
+/*
+ * Never start threads, for mdmon: its memory is locked and a metadata
+ * commit must not wait for new stacks to be allocated.  The engine is
+ * chosen now, before the caller locks its memory, and what the ring
+ * cannot take is done one request after another.
+ */
+void stripe_io_no_threads(void)
+{
+	no_threads = true;
+	pthread_once(&selected, stripe_io_select);
+}
+
+/*
+ * Issue all of 'io' concurrently and wait for them to finish.
+ * Each request's result is left in ->res: the number of bytes
+ * transferred (0 for a sync), or -errno.  Callers check for short
+ * transfers.  Safe to call from several threads at once.
+ */
+void stripe_io_submit(struct stripe_io *io, int cnt)
+{
+	int i;
+
+	if (cnt <= 0)
+		return;
+	pthread_once(&selected, stripe_io_select);
+
+	if (cnt == 1 || engine == ENGINE_SYNC) {
+		for (i = 0; i < cnt; i++)
+			stripe_io_one(&io[i]);
+		return;
+	}
+#ifndef NO_IO_URING
+	if (engine == ENGINE_URING && pthread_mutex_trylock(&ring_lock) == 0) {
+		int rv = -1;
+
+		if (uring_init() == 0)
+			rv = stripe_io_uring(io, cnt);
+		if (rv) {
+			engine = ENGINE_THREADS;
+			dprintf("io_uring not usable, using threads\n");
+		}
+		pthread_mutex_unlock(&ring_lock);
+		if (rv == 0)
+			return;
+	}
+#endif
+	stripe_io_threads(io, cnt);
+}
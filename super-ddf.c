@@ -2942,13 +2942,25 @@ static int remove_from_super_ddf(struct supertype *st, mdu_disk_info_t *dk)
 	return 0;
 }
 
+/* write(), counting what was written for the mdmon statistics */
+static ssize_t ddf_write(int fd, unsigned long long *bytes, const void *buf,
+			 size_t len)
+{
+	ssize_t n = write(fd, buf, len);
+
+	if (n > 0)
+		*bytes += n;
+	return n;
+}
+
 /*
  * This is the write_init_super method for a ddf container.  It is
  * called when creating a container or adding another device to a
  * container.
  */
 
-static int __write_ddf_structure(struct dl *d, struct ddf_super *ddf, __u8 type)
+static int __write_ddf_structure(struct dl *d, struct ddf_super *ddf, __u8 type,
+				  unsigned long long *bytes)
 {
 	unsigned long long sector;
 	struct ddf_header *header;
@@ -2980,19 +2992,19 @@ static int __write_ddf_structure(struct dl *d, struct ddf_super *ddf, __u8 type)
 	if (lseek64(fd, sector << 9, 0) == -1L)
 		goto out;
 
-	if (write(fd, header, 512) < 0)
+	if (ddf_write(fd, bytes, header, 512) < 0)
 		goto out;
 
 	ddf->controller.crc = calc_crc(&ddf->controller, 512);
-	if (write(fd, &ddf->controller, 512) < 0)
+	if (ddf_write(fd, bytes, &ddf->controller, 512) < 0)
 		goto out;
 
 	ddf->phys->crc = calc_crc(ddf->phys, ddf->pdsize);
-	if (write(fd, ddf->phys, ddf->pdsize) < 0)
+	if (ddf_write(fd, bytes, ddf->phys, ddf->pdsize) < 0)
 		goto out;
 
 	ddf->virt->crc = calc_crc(ddf->virt, ddf->vdsize);
-	if (write(fd, ddf->virt, ddf->vdsize) < 0)
+	if (ddf_write(fd, bytes, ddf->virt, ddf->vdsize) < 0)
 		goto out;
 
 	/* Now write lots of config records. */
@@ -3032,11 +3044,11 @@ static int __write_ddf_structure(struct dl *d, struct ddf_super *ddf, __u8 type)
 		} else
 			memset(conf + i*conf_size, 0xff, conf_size);
 	}
-	if (write(fd, conf, buf_size) != buf_size)
+	if (ddf_write(fd, bytes, conf, buf_size) != buf_size)
 		goto out;
 
 	d->disk.crc = calc_crc(&d->disk, 512);
-	if (write(fd, &d->disk, 512) < 0)
+	if (ddf_write(fd, bytes, &d->disk, 512) < 0)
 		goto out;
 
 	ret = 1;
@@ -3047,13 +3059,14 @@ out:
 	if (lseek64(fd, sector << 9, 0) == -1L)
 		return 0;
 
-	if (write(fd, header, 512) < 0)
+	if (ddf_write(fd, bytes, header, 512) < 0)
 		ret = 0;
 
 	return ret;
 }
 
-static int _write_super_to_disk(struct ddf_super *ddf, struct dl *d)
+static int _write_super_to_disk(struct ddf_super *ddf, struct dl *d,
+				unsigned long long *bytes)
 {
 	unsigned long long size;
 	int fd = d->fd;
@@ -3093,16 +3106,16 @@ static int _write_super_to_disk(struct ddf_super *ddf, struct dl *d)
 	ddf->anchor.seq = cpu_to_be32(0xFFFFFFFF); /* no sequencing in anchor */
 	ddf->anchor.crc = calc_crc(&ddf->anchor, 512);
 
-	if (!__write_ddf_structure(d, ddf, DDF_HEADER_PRIMARY))
+	if (!__write_ddf_structure(d, ddf, DDF_HEADER_PRIMARY, bytes))
 		return 0;
 
-	if (!__write_ddf_structure(d, ddf, DDF_HEADER_SECONDARY))
+	if (!__write_ddf_structure(d, ddf, DDF_HEADER_SECONDARY, bytes))
 		return 0;
 
 	if (lseek64(fd, (size - 1) * 512, SEEK_SET) == -1L)
 		return 0;
 
-	if (write(fd, &ddf->anchor, 512) < 0)
+	if (ddf_write(fd, bytes, &ddf->anchor, 512) < 0)
 		return 0;
 
 	return 1;
@@ -3122,7 +3135,7 @@ static int __write_init_super_ddf(struct supertype *st)
 	 */
 	for (d = ddf->dlist; d; d=d->next) {
 		attempts++;
-		successes += _write_super_to_disk(ddf, d);
+		successes += _write_super_to_disk(ddf, d, &st->metadata_bytes);
 	}
 
 	return attempts != successes;
@@ -3885,7 +3898,7 @@ static int store_super_ddf(struct supertype *st, int fd)
 		}
 		ofd = dl->fd;
 		dl->fd = fd;
-		ret = (_write_super_to_disk(ddf, dl) != 1);
+		ret = (_write_super_to_disk(ddf, dl, &st->metadata_bytes) != 1);
 		dl->fd = ofd;
 		return ret;
 	}
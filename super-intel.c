@@ -32,6 +32,7 @@
 #include <scsi/sg.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <values.h>
 
 /* MPB == Metadata Parameter Block */
@@ -496,6 +497,15 @@ struct intel_super {
 		struct extent *e; /* for determining freespace @ create */
 		int raiddisk; /* slot to fill in autolayout */
 		enum action action;
+		/* geometry for metadata writes, 0 until first needed */
+		unsigned int sector_size;
+		unsigned long long dsize;
+		/* what the disk is known to hold from our last write: the
+		 * sha1 of the extended mpb (or of the spare record), and
+		 * whether the migration record is clear
+		 */
+		__u8 mpb_digest[20];
+		bool migr_rec_clear;
 	} *disks, *current_disk;
 	struct dl *disk_mgmt_list; /* list of disks to add/remove while mdmon
 				      active */
@@ -3414,6 +3424,7 @@ static int write_imsm_migr_rec(struct supertype *st)
 			       strerror(errno));
 			goto out;
 		}
+		sd->migr_rec_clear = false;
 		if ((unsigned int)write(sd->fd, super->migr_rec_buf,
 		    MIGR_REC_BUF_SECTORS*sector_size) !=
 		    MIGR_REC_BUF_SECTORS*sector_size) {
@@ -6206,20 +6217,187 @@ static int remove_from_super_imsm(struct supertype *st, mdu_disk_info_t *dk)
 
 static int store_imsm_mpb(int fd, struct imsm_super *mpb);
 
+/*
+ * Metadata is written to all members at once: the writes for a batch of
+ * disks are queued and issued together with stripe_io_submit(), so a
+ * commit costs about two disk writes rather than two per member.
+ * The anchor is what makes the rest valid, so the migration records and
+ * extended mpbs of the batch go first, and only once they are on disk
+ * the anchors of the members they were written to.
+ */
+#define IMSM_WRITE_BATCH 16	/* members per submission */
+#define IMSM_DISK_WRITES 3	/* migration record, extended mpb, anchor */
+#define IMSM_WRITE_SLOTS (IMSM_WRITE_BATCH * IMSM_DISK_WRITES)
+
+struct imsm_write {
+	/* anchors are queued from the end */
+	struct stripe_io io[IMSM_WRITE_SLOTS];
+	struct iovec iov[IMSM_WRITE_SLOTS];
+	struct dl *dl[IMSM_WRITE_SLOTS];
+	int cnt;
+	int anchors;
+	unsigned long long bytes; /* written so far */
+};
+
+/* Look up the geometry of a member once, rather than on every write */
+static int imsm_dl_geometry(struct dl *d)
+{
+	if (d->sector_size)
+		return 0;
+	if (!get_dev_sector_size(d->fd, NULL, &d->sector_size))
+		return 1;
+	if (!get_dev_size(d->fd, NULL, &d->dsize)) {
+		d->sector_size = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Every member queues exactly one anchor, so w->anchors counts the
+ * members of the batch.  Flushing once it reaches IMSM_WRITE_BATCH keeps
+ * the slots (at most IMSM_DISK_WRITES per member) and the failed
+ * members tracked by imsm_write_flush() within their arrays.
+ */
+static int imsm_write_full(struct imsm_write *w)
+{
+	return w->anchors == IMSM_WRITE_BATCH;
+}
+
+static void imsm_write_add(struct imsm_write *w, struct dl *d, void *buf,
+			   size_t len, unsigned long long offset, bool anchor)
+{
+	int i = anchor ? IMSM_WRITE_SLOTS - ++w->anchors : w->cnt++;
+
+	w->iov[i].iov_base = buf;
+	w->iov[i].iov_len = len;
+	w->io[i].fd = d->fd;
+	w->io[i].op = STRIPE_IO_WRITE;
+	w->io[i].iov = &w->iov[i];
+	w->io[i].iovcnt = 1;
+	w->io[i].offset = offset;
+	w->dl[i] = d;
+}
+
+/*
+ * Whether the disk already holds this part of the metadata, if not it
+ * is assumed to once the write queued for it succeeds.
+ */
+static bool imsm_dl_current(struct dl *d, void *buf, size_t len)
+{
+	__u8 digest[sizeof(d->mpb_digest)];
+
+	sha1_buffer(buf, len, digest);
+	if (memcmp(digest, d->mpb_digest, sizeof(digest)) == 0)
+		return true;
+	memcpy(d->mpb_digest, digest, sizeof(digest));
+	return false;
+}
+
+/*
+ * Queue what store_imsm_mpb() would write.  The anchor changes with
+ * every commit, the extended mpb (devices and bbm log) only with the
+ * configuration, so it is left alone if the disk has it already.
+ */
+static int imsm_write_add_mpb(struct imsm_write *w, struct dl *d,
+			      struct imsm_super *mpb)
+{
+	__u32 mpb_size = __le32_to_cpu(mpb->mpb_size);
+	unsigned int sector_size;
+	unsigned long long sectors;
+
+	if (imsm_dl_geometry(d))
+		return 1;
+	sector_size = d->sector_size;
+
+	if (mpb_size > sector_size) {
+		/* -1 to account for anchor */
+		sectors = mpb_sectors(mpb, sector_size) - 1;
+
+		/* the extended mpb goes in the sectors preceeding the anchor */
+		if (!imsm_dl_current(d, (void *)mpb + sector_size,
+				     sector_size * sectors))
+			imsm_write_add(w, d, (void *)mpb + sector_size,
+				       sector_size * sectors,
+				       d->dsize - sector_size * (2 + sectors),
+				       false);
+	}
+
+	/* first block is stored on second to last sector of the disk */
+	imsm_write_add(w, d, mpb, sector_size, d->dsize - sector_size * 2,
+		       true);
+	return 0;
+}
+
+static bool imsm_write_done(struct imsm_write *w, int i)
+{
+	if (w->io[i].res == (ssize_t)w->iov[i].iov_len)
+		return true;
+
+	/* the disk holds who knows what now */
+	memset(w->dl[i]->mpb_digest, 0, sizeof(w->dl[i]->mpb_digest));
+	w->dl[i]->migr_rec_clear = false;
+	pr_err("failed for device %d:%d (fd: %d) %s\n",
+	       w->dl[i]->major, w->dl[i]->minor, w->dl[i]->fd,
+	       w->io[i].res < 0 ? strerror(-w->io[i].res) : "short write");
+	return false;
+}
+
+/* Issue the queued writes, returns the number of members that failed */
+static int imsm_write_flush(struct imsm_write *w)
+{
+	struct dl *failed_dl[IMSM_WRITE_BATCH]; /* see imsm_write_full() */
+	int first = IMSM_WRITE_SLOTS - w->anchors;
+	int failed = 0;
+	int i, j, n;
+
+	stripe_io_submit(w->io, w->cnt);
+	for (i = 0; i < w->cnt; i++) {
+		if (w->io[i].res > 0)
+			w->bytes += w->io[i].res;
+		/* the writes of one member are queued together */
+		if (failed && failed_dl[failed - 1] == w->dl[i])
+			continue;
+		if (!imsm_write_done(w, i))
+			failed_dl[failed++] = w->dl[i];
+	}
+
+	/* leave the old anchor where the rest did not make it to the disk */
+	n = first;
+	for (i = first; i < IMSM_WRITE_SLOTS; i++) {
+		for (j = 0; j < failed; j++)
+			if (failed_dl[j] == w->dl[i])
+				break;
+		if (j < failed)
+			continue;
+		w->iov[n] = w->iov[i];
+		w->io[n] = w->io[i];
+		w->io[n].iov = &w->iov[n];
+		w->dl[n++] = w->dl[i];
+	}
+	stripe_io_submit(&w->io[first], n - first);
+	for (i = first; i < n; i++) {
+		if (w->io[i].res > 0)
+			w->bytes += w->io[i].res;
+		if (!imsm_write_done(w, i))
+			failed++;
+	}
+
+	w->cnt = 0;
+	w->anchors = 0;
+	return failed;
+}
+
 static union {
 	char buf[MAX_SECTOR_SIZE];
 	struct imsm_super anchor;
-} spare_record __attribute__ ((aligned(MAX_SECTOR_SIZE)));
+} spare_record[IMSM_WRITE_BATCH] __attribute__ ((aligned(MAX_SECTOR_SIZE)));
 
-
-static int write_super_imsm_spare(struct intel_super *super, struct dl *d)
+static void fill_imsm_spare(struct intel_super *super, struct dl *d,
+			    struct imsm_super *spare)
 {
-	struct imsm_super *spare = &spare_record.anchor;
 	__u32 sum;
 
-	if (d->index != -1)
-		return 1;
-
 	spare->mpb_size = __cpu_to_le32(sizeof(struct imsm_super));
 	spare->generation_num = __cpu_to_le32(1UL);
 	spare->num_disks = 1;
@@ -6240,6 +6418,16 @@ static int write_super_imsm_spare(struct intel_super *super, struct dl *d)
 	spare->orig_family_num = 0;
 	sum = __gen_imsm_checksum(spare);
 	spare->check_sum = __cpu_to_le32(sum);
+}
+
+static int write_super_imsm_spare(struct intel_super *super, struct dl *d)
+{
+	struct imsm_super *spare = &spare_record[0].anchor;
+
+	if (d->index != -1)
+		return 1;
+
+	fill_imsm_spare(super, d, spare);
 
 	if (store_imsm_mpb(d->fd, spare)) {
 		pr_err("failed for device %d:%d %s\n",
@@ -6252,20 +6440,45 @@ static int write_super_imsm_spare(struct intel_super *super, struct dl *d)
 /* spare records have their own family number and do not have any defined raid
  * devices
  */
-static int write_super_imsm_spares(struct intel_super *super, int doclose)
+static int write_super_imsm_spares(struct supertype *st, int doclose)
 {
+	struct intel_super *super = st->sb;
+	struct imsm_write w = { .cnt = 0 };
+	int failed = 0;
+	int n = 0;
 	struct dl *d;
 
 	for (d = super->disks; d; d = d->next) {
+		struct imsm_super *spare = &spare_record[n].anchor;
+
 		if (d->index != -1)
 			continue;
 
-		if (write_super_imsm_spare(super, d))
-			return 1;
-
-		if (doclose)
-			close_fd(&d->fd);
+		fill_imsm_spare(super, d, spare);
+		if (imsm_dl_current(d, spare, sizeof(spare_record[n])))
+			continue;
+		if (imsm_write_add_mpb(&w, d, spare)) {
+			pr_err("failed for device %d:%d %s\n",
+			       d->major, d->minor, strerror(errno));
+			memset(d->mpb_digest, 0, sizeof(d->mpb_digest));
+			failed++;
+			continue;
+		}
+		/* each spare record in flight needs its own buffer */
+		if (++n == IMSM_WRITE_BATCH) {
+			failed += imsm_write_flush(&w);
+			n = 0;
+		}
 	}
+	failed += imsm_write_flush(&w);
+	st->metadata_bytes += w.bytes;
+	if (failed)
+		return 1;
+
+	if (doclose)
+		for (d = super->disks; d; d = d->next)
+			if (d->index == -1)
+				close_fd(&d->fd);
 
 	return 0;
 }
@@ -6275,6 +6488,7 @@ static int write_super_imsm(struct supertype *st, int doclose)
 	struct intel_super *super = st->sb;
 	unsigned int sector_size = super->sector_size;
 	struct imsm_super *mpb = super->anchor;
+	struct imsm_write w = { .cnt = 0 };
 	struct dl *d;
 	__u32 generation;
 	__u32 sum;
@@ -6342,6 +6556,10 @@ static int write_super_imsm(struct supertype *st, int doclose)
 	sum = __gen_imsm_checksum(mpb);
 	mpb->check_sum = __cpu_to_le32(sum);
 
+	if (!clear_migration_record || super->clean_migration_record_by_mdmon)
+		/* mdadm writes the migration record during a migration */
+		for (d = super->disks; d; d = d->next)
+			d->migr_rec_clear = false;
 	if (super->clean_migration_record_by_mdmon) {
 		clear_migration_record = 1;
 		super->clean_migration_record_by_mdmon = 0;
@@ -6358,32 +6576,31 @@ static int write_super_imsm(struct supertype *st, int doclose)
 		if (d->index < 0 || is_failed(&d->disk))
 			continue;
 
-		if (clear_migration_record) {
-			unsigned long long dsize;
-
-			get_dev_size(d->fd, NULL, &dsize);
-			if (lseek64(d->fd, dsize - sector_size,
-			    SEEK_SET) >= 0) {
-				if ((unsigned int)write(d->fd,
-				    super->migr_rec_buf,
-				    MIGR_REC_BUF_SECTORS*sector_size) !=
-				    MIGR_REC_BUF_SECTORS*sector_size)
-					perror("Write migr_rec failed");
-			}
+		if (imsm_dl_geometry(d)) {
+			pr_err("failed for device %d:%d (fd: %d) %s\n",
+			       d->major, d->minor, d->fd, strerror(errno));
+			continue;
 		}
-
-		if (store_imsm_mpb(d->fd, mpb))
-			fprintf(stderr,
-				"failed for device %d:%d (fd: %d)%s\n",
-				d->major, d->minor,
-				d->fd, strerror(errno));
-
-		if (doclose)
-			close_fd(&d->fd);
+		if (clear_migration_record && !d->migr_rec_clear) {
+			imsm_write_add(&w, d, super->migr_rec_buf,
+				       MIGR_REC_BUF_SECTORS * sector_size,
+				       d->dsize - sector_size, false);
+			d->migr_rec_clear = true;
+		}
+		imsm_write_add_mpb(&w, d, mpb);
+		if (imsm_write_full(&w))
+			imsm_write_flush(&w);
 	}
+	imsm_write_flush(&w);
+	st->metadata_bytes += w.bytes;
+
+	if (doclose)
+		for (d = super->disks; d ; d = d->next)
+			if (d->index >= 0 && !is_failed(&d->disk))
+				close_fd(&d->fd);
 
 	if (spares)
-		return write_super_imsm_spares(super, doclose);
+		return write_super_imsm_spares(st, doclose);
 
 	return 0;
 }
@@ -12455,6 +12672,7 @@ int wait_for_reshape_imsm(struct mdinfo *sra, int ndata)
 			return 1;
 		} else if (rc == COMPLETED_NONE)
 			break;
+		reshape_report_done(completed * ndata);
 	} while (completed < position_to_set);
 
 	close(fd);
@@ -12625,6 +12843,8 @@ static int imsm_manage_reshape(
 
 	max_position = sra->component_size * ndata;
 	source_layout = imsm_level_to_layout(map_src->raid_level);
+	reshape_report_start(sra->sys_name, sra->reshape_progress,
+			     max_position);
 
 	while (current_migr_unit(migr_rec) <
 	       get_num_migr_units(migr_rec)) {
@@ -12633,6 +12853,7 @@ static int imsm_manage_reshape(
 			__le32_to_cpu(migr_rec->blocks_per_unit)
 			* current_migr_unit(migr_rec);
 		unsigned long long border;
+		unsigned long long sync_ms;
 
 		/* Check that array hasn't become failed.
 		 */
@@ -12688,6 +12909,7 @@ static int imsm_manage_reshape(
 			/* Convert data to destination format and store it
 			 * in backup general migration area
 			 */
+			sync_ms = monotonic_ms();
 			if (save_backup_imsm(st, dev, sra,
 				buf + start_buf_shift, copy_length)) {
 				dprintf("imsm: Cannot save stripes to target devices\n");
@@ -12698,6 +12920,8 @@ static int imsm_manage_reshape(
 				dprintf("imsm: Cannot write checkpoint to migration record (UNIT_SRC_IN_CP_AREA)\n");
 				goto abort;
 			}
+			reshape_report_sync(monotonic_ms() - sync_ms);
+			reshape_report_backup(copy_length);
 		} else {
 			/* set next step to use whole border area */
 			border /= next_step;
@@ -12713,6 +12937,8 @@ static int imsm_manage_reshape(
 			next_step = max_position;
 		sysfs_set_num(sra, NULL, "suspend_lo", sra->reshape_progress);
 		sysfs_set_num(sra, NULL, "suspend_hi", next_step);
+		reshape_report_progress(sra->reshape_progress,
+					sra->reshape_progress, next_step);
 		sra->reshape_progress = next_step;
 
 		/* wait until reshape finish */
@@ -12768,6 +12994,7 @@ abort:
 	sysfs_set_num(sra, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
 	sysfs_set_num(sra, NULL, "suspend_hi", 0);
 	sysfs_set_num(sra, NULL, "suspend_lo", 0);
+	reshape_report_end(ret_val ? "finished" : "aborted");
 
 	return ret_val;
 }
@@ -60,6 +60,29 @@ int load_sys(char *path, char *buf, int len)
 	return 0;
 }
 
+/**
+ * sysfs_get_blkstat() - read the block layer statistics of a device.
+ * @devnm: kernel name of the device.
+ * @bs: filled from /sys/block/@devnm/stat.
+ *
+ * Return: 0 on success, -1 if they could not be read.
+ */
+int sysfs_get_blkstat(char *devnm, struct blkstat *bs)
+{
+	char fname[MAX_SYSFS_PATH_LEN];
+	char buf[256];
+
+	snprintf(fname, MAX_SYSFS_PATH_LEN, "/sys/block/%s/stat", devnm);
+	if (load_sys(fname, buf, sizeof(buf)))
+		return -1;
+	if (sscanf(buf, "%llu %*u %llu %llu %llu %*u %llu %llu %llu %llu",
+		   &bs->rd_ios, &bs->rd_sectors, &bs->rd_ticks,
+		   &bs->wr_ios, &bs->wr_sectors, &bs->wr_ticks,
+		   &bs->in_flight, &bs->io_ticks) != 8)
+		return -1;
+	return 0;
+}
+
 void sysfs_free(struct mdinfo *sra)
 {
 	while (sra) {